@@ -0,0 +1,95 @@
+#include "BandPool.h"
+
+#include <QThread>
+
+BandPool::BandPool(int threads)
+{
+    for (int i = 0; i < threads; ++i) {
+        QThread *thread = QThread::create([this] { workerLoop(); });
+        thread->setObjectName(QStringLiteral("pipewire-band-worker-%1").arg(i));
+        thread->start();
+        m_threads.append(thread);
+    }
+}
+
+BandPool::~BandPool()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_quit = true;
+        m_wake.wakeAll();
+    }
+
+    for (QThread *thread : qAsConst(m_threads)) {
+        thread->wait();
+        delete thread;
+    }
+}
+
+void BandPool::run(int rows, int bandHeight, const std::function<void(int, int)> &band)
+{
+    Job job;
+    job.band = &band;
+    job.rows = rows;
+    job.bandHeight = qMax(1, bandHeight);
+    job.bands = (rows + job.bandHeight - 1) / job.bandHeight;
+
+    if (m_threads.isEmpty() || job.bands <= 1) {
+        runBands(&job);
+        return;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    m_job = &job;
+    ++m_generation;
+    m_wake.wakeAll();
+    locker.unlock();
+
+    runBands(&job);
+
+    // every band is claimed; take the job down so late threads can't pick
+    // it up, then wait for the ones still working on theirs
+    locker.relock();
+    m_job = nullptr;
+    while (job.workers > 0) {
+        m_done.wait(&m_mutex);
+    }
+}
+
+void BandPool::runBands(Job *job)
+{
+    for (;;) {
+        const int index = job->next.fetch_add(1, std::memory_order_relaxed);
+        if (index >= job->bands) {
+            return;
+        }
+        const int y = index * job->bandHeight;
+        (*job->band)(y, qMin(job->bandHeight, job->rows - y));
+    }
+}
+
+void BandPool::workerLoop()
+{
+    QMutexLocker locker(&m_mutex);
+    quint64 seen = 0;
+    for (;;) {
+        while (!m_quit && (!m_job || m_generation == seen)) {
+            m_wake.wait(&m_mutex);
+        }
+        if (m_quit) {
+            return;
+        }
+
+        seen = m_generation;
+        Job *job = m_job;
+        ++job->workers;
+        locker.unlock();
+
+        runBands(job);
+
+        locker.relock();
+        if (--job->workers == 0) {
+            m_done.wakeAll();
+        }
+    }
+}
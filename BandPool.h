@@ -0,0 +1,56 @@
+#ifndef BANDPOOL_H
+#define BANDPOOL_H
+
+#include <QList>
+#include <QMutex>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <functional>
+
+class QThread;
+
+// Persistent threads that split a frame into bands of rows. The calling
+// thread works on bands too and run() returns once every band is done.
+// Bands are claimed from a shared counter, so a thread that finishes early
+// simply takes the next one instead of waiting for a fixed share.
+class BandPool
+{
+public:
+    // threads in addition to the caller
+    explicit BandPool(int threads);
+    ~BandPool();
+
+    BandPool(const BandPool &) = delete;
+    BandPool &operator=(const BandPool &) = delete;
+
+    int threadCount() const { return m_threads.size(); }
+
+    // call band(y, rows) for every bandHeight rows of 0..rows, one run at a time
+    void run(int rows, int bandHeight, const std::function<void(int, int)> &band);
+
+private:
+    struct Job {
+        const std::function<void(int, int)> *band = nullptr;
+        int rows = 0;
+        int bandHeight = 0;
+        int bands = 0;
+        std::atomic<int> next{0};
+        // pool threads that picked the job up, guarded by m_mutex
+        int workers = 0;
+    };
+
+    static void runBands(Job *job);
+    void workerLoop();
+
+    QMutex m_mutex;
+    QWaitCondition m_wake;
+    QWaitCondition m_done;
+    QList<QThread *> m_threads;
+    // published while run() is in progress
+    Job *m_job = nullptr;
+    quint64 m_generation = 0;
+    bool m_quit = false;
+};
+
+#endif // BANDPOOL_H
@@ -0,0 +1,230 @@
+#include "CaptureManager.h"
+
+#include "FramePool.h"
+#include "PipewireStream.h"
+
+#include <QDebug>
+#include <QStringList>
+#include <QThread>
+#include <QTimer>
+#include <QVector>
+
+#include <cstring>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+
+static std::once_flag pwInitialized;
+
+// runs on the loop thread
+static int pinToCpu(spa_loop *loop, bool async, uint32_t seq, const void *data, size_t size, void *userData)
+{
+    Q_UNUSED(loop);
+    Q_UNUSED(async);
+    Q_UNUSED(seq);
+    Q_UNUSED(size);
+    Q_UNUSED(userData);
+
+    const int cpu = *static_cast<const int *>(data);
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+
+    const int res = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (res != 0) {
+        qWarning() << "Failed to pin PipeWire loop to CPU" << cpu << ":" << strerror(res);
+    }
+    return 0;
+}
+
+CaptureManager::CaptureManager(int loopCount, bool pinLoops, QObject *parent)
+    : QObject(parent)
+{
+    std::call_once(pwInitialized, [] { pw_init(nullptr, nullptr); });
+
+    m_coreEvents.version = PW_VERSION_CORE_EVENTS;
+    m_coreEvents.error = &onCoreError;
+
+    for (int i = 0; i < qMax(1, loopCount); ++i) {
+        Loop *loop = new Loop;
+        loop->index = i;
+        m_loops.append(loop);
+        if (!startLoop(loop, pinLoops)) {
+            m_valid = false;
+            return;
+        }
+    }
+}
+
+CaptureManager::~CaptureManager()
+{
+    // streams lock their loop on the way out, the loops have to stay up
+    for (Loop *loop : qAsConst(m_loops)) {
+        qDeleteAll(loop->streams);
+        loop->streams.clear();
+    }
+
+    for (Loop *loop : qAsConst(m_loops)) {
+        if (loop->loop) {
+            pw_thread_loop_stop(loop->loop);
+        }
+        if (loop->core) {
+            pw_core_disconnect(loop->core);
+        }
+        if (loop->context) {
+            pw_context_destroy(loop->context);
+        }
+        if (loop->loop) {
+            pw_thread_loop_destroy(loop->loop);
+        }
+        delete loop;
+    }
+}
+
+bool CaptureManager::startLoop(Loop *loop, bool pin)
+{
+    const QByteArray name = QByteArrayLiteral("pipewire-capture-loop-") + QByteArray::number(loop->index);
+    loop->loop = pw_thread_loop_new(name.constData(), nullptr);
+    if (!loop->loop) {
+        qWarning() << "Failed to create PipeWire loop";
+        return false;
+    }
+
+    pw_thread_loop_lock(loop->loop);
+
+    loop->context = pw_context_new(pw_thread_loop_get_loop(loop->loop), nullptr, 0);
+    if (!loop->context) {
+        qWarning() << "Failed to create PipeWire context";
+        pw_thread_loop_unlock(loop->loop);
+        return false;
+    }
+
+    loop->core = pw_context_connect(loop->context, nullptr, 0);
+    if (!loop->core) {
+        qWarning() << "Failed to connect PipeWire context";
+        pw_thread_loop_unlock(loop->loop);
+        return false;
+    }
+
+    pw_core_add_listener(loop->core, &loop->coreListener, &m_coreEvents, loop);
+
+    if (pw_thread_loop_start(loop->loop) < 0) {
+        qWarning() << "Failed to start PipeWire loop" << loop->index;
+        pw_thread_loop_unlock(loop->loop);
+        return false;
+    }
+
+    pw_thread_loop_unlock(loop->loop);
+
+    if (pin) {
+        // the cpu is copied, the call doesn't wait for the loop
+        const int cpu = loop->index % qMax(1, QThread::idealThreadCount());
+        pw_loop_invoke(pw_thread_loop_get_loop(loop->loop), &pinToCpu, 0, &cpu, sizeof(cpu), false, nullptr);
+    }
+    return true;
+}
+
+void CaptureManager::onCoreError(void *data, uint32_t id, int seq, int res, const char *message)
+{
+    Q_UNUSED(seq);
+    auto loop = static_cast<Loop *>(data);
+    qWarning() << "PipeWire core error on loop" << loop->index << "object" << id << ":" << spa_strerror(res) << message;
+}
+
+PipewireStream *CaptureManager::createStream(uint nodeId)
+{
+    if (!m_valid) {
+        qWarning() << "Capture manager has no PipeWire connection";
+        return nullptr;
+    }
+
+    Loop *least = m_loops.first();
+    for (Loop *loop : qAsConst(m_loops)) {
+        if (loop->streams.size() < least->streams.size()) {
+            least = loop;
+        }
+    }
+
+    PipewireStream *stream = new PipewireStream(this);
+    stream->pwStreamNodeId = nodeId;
+    least->streams.append(stream);
+    return stream;
+}
+
+void CaptureManager::startStream(PipewireStream *stream)
+{
+    Loop *loop = loopOf(stream);
+    if (!loop) {
+        qWarning() << "Stream" << stream->pwStreamNodeId << "wasn't created by this capture manager";
+        return;
+    }
+
+    stream->initPw(loop->loop, loop->core);
+}
+
+void CaptureManager::removeStream(PipewireStream *stream)
+{
+    Loop *loop = loopOf(stream);
+    if (!loop) {
+        return;
+    }
+
+    loop->streams.removeOne(stream);
+    delete stream;
+}
+
+QList<PipewireStream *> CaptureManager::streams() const
+{
+    QList<PipewireStream *> streams;
+    for (const Loop *loop : qAsConst(m_loops)) {
+        streams += loop->streams;
+    }
+    return streams;
+}
+
+QString CaptureManager::summary() const
+{
+    QStringList lines;
+    // streams share the process wide pool unless given their own
+    QVector<const FramePool *> pools;
+    for (const Loop *loop : qAsConst(m_loops)) {
+        for (const PipewireStream *stream : qAsConst(loop->streams)) {
+            lines << QStringLiteral("Stream %1 on loop %2:").arg(stream->pwStreamNodeId).arg(loop->index);
+            lines << stream->statsSummary();
+            if (stream->framePool && !pools.contains(stream->framePool.get())) {
+                pools.append(stream->framePool.get());
+            }
+        }
+    }
+    for (const FramePool *pool : qAsConst(pools)) {
+        lines << pool->summary();
+    }
+    return lines.join(QLatin1Char('\n'));
+}
+
+void CaptureManager::setStatsDumpInterval(int msec)
+{
+    if (msec <= 0) {
+        delete m_statsTimer;
+        m_statsTimer = nullptr;
+        return;
+    }
+
+    if (!m_statsTimer) {
+        m_statsTimer = new QTimer(this);
+        connect(m_statsTimer, &QTimer::timeout, this, [this] {
+            qInfo().noquote() << "Capture stats:\n" << summary();
+        });
+    }
+    m_statsTimer->start(msec);
+}
+
+CaptureManager::Loop *CaptureManager::loopOf(PipewireStream *stream) const
+{
+    for (Loop *loop : m_loops) {
+        if (loop->streams.contains(stream)) {
+            return loop;
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,60 @@
+#ifndef CAPTUREMANAGER_H
+#define CAPTUREMANAGER_H
+
+#include <QList>
+#include <QObject>
+
+#include <pipewire/pipewire.h>
+
+class PipewireStream;
+class QTimer;
+
+// Runs any number of streams over a fixed set of PipeWire thread loops,
+// each with one context and one core connection. A single loop serves
+// many streams; more loops only help when the callbacks of one stream
+// delay the others. Streams go to the loop with the fewest streams.
+class CaptureManager : public QObject
+{
+    Q_OBJECT
+
+public:
+    // with pinLoops, loop i runs on CPU i modulo the CPU count
+    explicit CaptureManager(int loopCount = 1, bool pinLoops = false, QObject *parent = nullptr);
+    ~CaptureManager();
+
+    bool isValid() const { return m_valid; }
+    int loopCount() const { return m_loops.size(); }
+
+    // unconnected stream for the node; set it up, then startStream() it
+    PipewireStream *createStream(uint nodeId);
+    void startStream(PipewireStream *stream);
+    // disconnects and deletes the stream
+    void removeStream(PipewireStream *stream);
+    QList<PipewireStream *> streams() const;
+
+    // stats of every stream, by node and loop
+    QString summary() const;
+    // log the summary every msec milliseconds, 0 turns it off
+    void setStatsDumpInterval(int msec);
+
+    static void onCoreError(void *data, uint32_t id, int seq, int res, const char *message);
+
+private:
+    struct Loop {
+        int index = 0;
+        pw_thread_loop *loop = nullptr;
+        pw_context *context = nullptr;
+        pw_core *core = nullptr;
+        spa_hook coreListener = {};
+        QList<PipewireStream *> streams;
+    };
+    bool startLoop(Loop *loop, bool pin);
+    Loop *loopOf(PipewireStream *stream) const;
+
+    pw_core_events m_coreEvents = {};
+    QList<Loop *> m_loops;
+    bool m_valid = true;
+    QTimer *m_statsTimer = nullptr;
+};
+
+#endif // CAPTUREMANAGER_H
@@ -0,0 +1,36 @@
+#include "DmaBufImage.h"
+
+#include <QVector>
+
+EGLImageKHR DmaBufImage::create(EGLDisplay display, const QSize &size, uint32_t drmFormat, uint64_t modifier,
+                                const Plane *planes, int count)
+{
+    static const EGLint planeAttribs[4][5] = {
+        {EGL_DMA_BUF_PLANE0_FD_EXT, EGL_DMA_BUF_PLANE0_OFFSET_EXT, EGL_DMA_BUF_PLANE0_PITCH_EXT,
+         EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT},
+        {EGL_DMA_BUF_PLANE1_FD_EXT, EGL_DMA_BUF_PLANE1_OFFSET_EXT, EGL_DMA_BUF_PLANE1_PITCH_EXT,
+         EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT},
+        {EGL_DMA_BUF_PLANE2_FD_EXT, EGL_DMA_BUF_PLANE2_OFFSET_EXT, EGL_DMA_BUF_PLANE2_PITCH_EXT,
+         EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT},
+        {EGL_DMA_BUF_PLANE3_FD_EXT, EGL_DMA_BUF_PLANE3_OFFSET_EXT, EGL_DMA_BUF_PLANE3_PITCH_EXT,
+         EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT, EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT},
+    };
+
+    QVector<EGLint> attribs = {
+        EGL_WIDTH, size.width(),
+        EGL_HEIGHT, size.height(),
+        EGL_LINUX_DRM_FOURCC_EXT, static_cast<EGLint>(drmFormat),
+    };
+    for (int i = 0; i < qMin(count, 4); ++i) {
+        attribs << planeAttribs[i][0] << static_cast<EGLint>(planes[i].fd)
+                << planeAttribs[i][1] << static_cast<EGLint>(planes[i].offset)
+                << planeAttribs[i][2] << static_cast<EGLint>(planes[i].stride);
+        // without one the driver falls back to the implicit layout
+        if (modifier != DRM_FORMAT_MOD_INVALID) {
+            attribs << planeAttribs[i][3] << static_cast<EGLint>(modifier & 0xffffffff)
+                    << planeAttribs[i][4] << static_cast<EGLint>(modifier >> 32);
+        }
+    }
+    attribs << EGL_NONE;
+    return eglCreateImageKHR(display, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, nullptr, attribs.constData());
+}
@@ -0,0 +1,28 @@
+#ifndef DMABUFIMAGE_H
+#define DMABUFIMAGE_H
+
+#include <QSize>
+
+#include <drm_fourcc.h>
+#include <epoxy/egl.h>
+
+// EGL_EXT_image_dma_buf_import of a DMA-BUF the way PipeWire describes one,
+// shared by PipewireStream and the import check in MicroBench.
+class DmaBufImage
+{
+public:
+    // one spa_data of the buffer and its chunk
+    struct Plane {
+        int fd = -1;
+        uint32_t offset = 0;
+        uint32_t stride = 0;
+    };
+
+    // up to four planes of a drmFormat image; DRM_FORMAT_MOD_INVALID passes
+    // no modifier and leaves the layout to the driver. EGL_NO_IMAGE_KHR when
+    // the driver refuses the combination
+    static EGLImageKHR create(EGLDisplay display, const QSize &size, uint32_t drmFormat, uint64_t modifier,
+                              const Plane *planes, int count);
+};
+
+#endif // DMABUFIMAGE_H
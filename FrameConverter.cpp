@@ -0,0 +1,259 @@
+#include "FrameConverter.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define HAVE_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+// Scalar reference kernels
+
+void copy32Scalar(const uint8_t *src, uint8_t *dst, int width)
+{
+    std::memcpy(dst, src, width * 4);
+}
+
+void copy24Scalar(const uint8_t *src, uint8_t *dst, int width)
+{
+    std::memcpy(dst, src, width * 3);
+}
+
+void swapRB32Scalar(const uint8_t *src, uint8_t *dst, int width)
+{
+    for (int i = 0; i < width; ++i) {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+        dst[3] = src[3];
+        src += 4;
+        dst += 4;
+    }
+}
+
+#if HAVE_X86_KERNELS
+__attribute__((target("ssse3")))
+void swapRB32Ssse3(const uint8_t *src, uint8_t *dst, int width)
+{
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+    int i = 0;
+    for (; i + 8 <= width; i += 8) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm_shuffle_epi8(a, mask));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 16), _mm_shuffle_epi8(b, mask));
+        src += 32;
+        dst += 32;
+    }
+    for (; i + 4 <= width; i += 4) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm_shuffle_epi8(a, mask));
+        src += 16;
+        dst += 16;
+    }
+    swapRB32Scalar(src, dst, width - i);
+}
+
+__attribute__((target("avx2")))
+void swapRB32Avx2(const uint8_t *src, uint8_t *dst, int width)
+{
+    const __m256i mask = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                          2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+    int i = 0;
+    for (; i + 16 <= width; i += 16) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 32));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), _mm256_shuffle_epi8(a, mask));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + 32), _mm256_shuffle_epi8(b, mask));
+        src += 64;
+        dst += 64;
+    }
+    for (; i + 8 <= width; i += 8) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst), _mm256_shuffle_epi8(a, mask));
+        src += 32;
+        dst += 32;
+    }
+    swapRB32Scalar(src, dst, width - i);
+}
+#endif /* HAVE_X86_KERNELS */
+
+#if HAVE_NEON_KERNELS
+void swapRB32Neon(const uint8_t *src, uint8_t *dst, int width)
+{
+    int i = 0;
+    for (; i + 16 <= width; i += 16) {
+        uint8x16x4_t px = vld4q_u8(src);
+        const uint8x16_t r = px.val[0];
+        px.val[0] = px.val[2];
+        px.val[2] = r;
+        vst4q_u8(dst, px);
+        src += 64;
+        dst += 64;
+    }
+    swapRB32Scalar(src, dst, width - i);
+}
+#endif /* HAVE_NEON_KERNELS */
+
+} // namespace
+
+FrameConverter::FrameConverter(spa_video_format format, Isa isa)
+    : m_isa(isSupported(isa) ? isa : Scalar)
+{
+    setFormat(format);
+}
+
+void FrameConverter::setFormat(spa_video_format format)
+{
+    m_format = format;
+    m_bytesPerPixel = bytesPerPixel(format);
+    m_kernel = selectKernel(format, m_isa);
+}
+
+void FrameConverter::convertRow(const uint8_t *src, uint8_t *dst, int width) const
+{
+    m_kernel(src, dst, width);
+}
+
+void FrameConverter::convert(const uint8_t *src, qint64 srcStride, uint8_t *dst, qint64 dstStride, int width, int height) const
+{
+    for (int i = 0; i < height; ++i) {
+        m_kernel(src, dst, width);
+        src += srcStride;
+        dst += dstStride;
+    }
+}
+
+FrameConverter::Isa FrameConverter::bestIsa()
+{
+    if (isSupported(AVX2)) {
+        return AVX2;
+    }
+    if (isSupported(SSSE3)) {
+        return SSSE3;
+    }
+    if (isSupported(NEON)) {
+        return NEON;
+    }
+    return Scalar;
+}
+
+bool FrameConverter::isSupported(Isa isa)
+{
+    switch (isa) {
+    case Scalar:
+        return true;
+#if HAVE_X86_KERNELS
+    case SSSE3:
+        return __builtin_cpu_supports("ssse3");
+    case AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif /* HAVE_X86_KERNELS */
+#if HAVE_NEON_KERNELS
+    case NEON:
+        return true;
+#endif /* HAVE_NEON_KERNELS */
+    default:
+        return false;
+    }
+}
+
+const char *FrameConverter::isaName(Isa isa)
+{
+    switch (isa) {
+    case Scalar:
+        return "scalar";
+    case SSSE3:
+        return "ssse3";
+    case AVX2:
+        return "avx2";
+    case NEON:
+        return "neon";
+    }
+    return "unknown";
+}
+
+const char *FrameConverter::formatName(spa_video_format format)
+{
+    switch (format) {
+    case SPA_VIDEO_FORMAT_RGB:
+        return "RGB";
+    case SPA_VIDEO_FORMAT_BGR:
+        return "BGR";
+    case SPA_VIDEO_FORMAT_RGBx:
+        return "RGBx";
+    case SPA_VIDEO_FORMAT_BGRx:
+        return "BGRx";
+    case SPA_VIDEO_FORMAT_RGBA:
+        return "RGBA";
+    case SPA_VIDEO_FORMAT_BGRA:
+        return "BGRA";
+    case SPA_VIDEO_FORMAT_NV12:
+        return "NV12";
+    case SPA_VIDEO_FORMAT_I420:
+        return "I420";
+    case SPA_VIDEO_FORMAT_ENCODED:
+        return "encoded";
+    default:
+        return "unknown";
+    }
+}
+
+int FrameConverter::bytesPerPixel(spa_video_format format)
+{
+    switch (format) {
+    case SPA_VIDEO_FORMAT_RGB:
+    case SPA_VIDEO_FORMAT_BGR:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+spa_video_format FrameConverter::outputFormat(spa_video_format format)
+{
+    // BGR 32bit formats are swizzled, everything else is copied
+    switch (format) {
+    case SPA_VIDEO_FORMAT_BGRx:
+        return SPA_VIDEO_FORMAT_RGBx;
+    case SPA_VIDEO_FORMAT_BGRA:
+        return SPA_VIDEO_FORMAT_RGBA;
+    default:
+        return format;
+    }
+}
+
+FrameConverter::RowKernel FrameConverter::selectKernel(spa_video_format format, Isa isa)
+{
+    switch (format) {
+    case SPA_VIDEO_FORMAT_RGB:
+    case SPA_VIDEO_FORMAT_BGR:
+        return copy24Scalar;
+    case SPA_VIDEO_FORMAT_BGRx:
+    case SPA_VIDEO_FORMAT_BGRA:
+        switch (isa) {
+#if HAVE_X86_KERNELS
+        case AVX2:
+            return swapRB32Avx2;
+        case SSSE3:
+            return swapRB32Ssse3;
+#endif /* HAVE_X86_KERNELS */
+#if HAVE_NEON_KERNELS
+        case NEON:
+            return swapRB32Neon;
+#endif /* HAVE_NEON_KERNELS */
+        default:
+            return swapRB32Scalar;
+        }
+    default:
+        // RGBx/RGBA are already in the layout we hand out
+        return copy32Scalar;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef FRAMECONVERTER_H
+#define FRAMECONVERTER_H
+
+#include <QtGlobal>
+
+#include <spa/param/video/raw.h>
+
+// Fused copy/crop/swizzle of negotiated SPA frames into the packed layout
+// handed out by PipewireStream. One row kernel is selected per format and
+// instruction set; the scalar kernels are the reference implementation.
+class FrameConverter
+{
+public:
+    enum Isa {
+        Scalar,
+        SSSE3,
+        AVX2,
+        NEON
+    };
+
+    explicit FrameConverter(spa_video_format format = SPA_VIDEO_FORMAT_UNKNOWN, Isa isa = bestIsa());
+
+    void setFormat(spa_video_format format);
+    spa_video_format format() const { return m_format; }
+    Isa isa() const { return m_isa; }
+    int bytesPerPixel() const { return m_bytesPerPixel; }
+
+    // Convert `width` pixels starting at `src` into `dst`
+    void convertRow(const uint8_t *src, uint8_t *dst, int width) const;
+    // Convert a `width` x `height` rectangle, `src` points at its top left pixel
+    void convert(const uint8_t *src, qint64 srcStride, uint8_t *dst, qint64 dstStride, int width, int height) const;
+
+    static Isa bestIsa();
+    static bool isSupported(Isa isa);
+    static const char *isaName(Isa isa);
+    static const char *formatName(spa_video_format format);
+    static int bytesPerPixel(spa_video_format format);
+    // byte order of the converted pixels
+    static spa_video_format outputFormat(spa_video_format format);
+
+private:
+    typedef void (*RowKernel)(const uint8_t *src, uint8_t *dst, int width);
+    static RowKernel selectKernel(spa_video_format format, Isa isa);
+
+    spa_video_format m_format = SPA_VIDEO_FORMAT_UNKNOWN;
+    Isa m_isa = Scalar;
+    int m_bytesPerPixel = 4;
+    RowKernel m_kernel = nullptr;
+};
+
+#endif // FRAMECONVERTER_H
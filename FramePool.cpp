@@ -0,0 +1,182 @@
+#include "FramePool.h"
+
+#include <QDebug>
+
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const int SUB_CLASSES = 4;
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+static size_t roundUp(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+std::shared_ptr<FramePool> FramePool::create()
+{
+    return create(Settings());
+}
+
+std::shared_ptr<FramePool> FramePool::create(const Settings &settings)
+{
+    return std::shared_ptr<FramePool>(new FramePool(settings));
+}
+
+std::shared_ptr<FramePool> FramePool::instance()
+{
+    static const std::shared_ptr<FramePool> pool = create();
+    return pool;
+}
+
+FramePool::FramePool(const Settings &settings)
+    : m_settings(settings)
+{
+}
+
+FramePool::~FramePool()
+{
+    trim();
+}
+
+size_t FramePool::classSize(int sizeClass)
+{
+    // class 0 is one page, then four steps per power of two
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const size_t base = page << (sizeClass / SUB_CLASSES);
+    return roundUp(base + base / SUB_CLASSES * (sizeClass % SUB_CLASSES), page);
+}
+
+int FramePool::sizeClassFor(size_t size)
+{
+    const size_t page = sysconf(_SC_PAGESIZE);
+    if (size <= page) {
+        return 0;
+    }
+
+    // the power of two below size, then the first quarter step reaching it
+    const int power = 63 - __builtin_clzll((size - 1) / page);
+    const size_t base = page << power;
+    const size_t step = base / SUB_CLASSES;
+    return power * SUB_CLASSES + static_cast<int>((size - base + step - 1) / step);
+}
+
+FrameBufferHandle FramePool::acquire(size_t size)
+{
+    ++acquires;
+    const int sizeClass = sizeClassFor(size);
+
+    FrameBuffer *buffer = nullptr;
+    {
+        QMutexLocker locker(&m_mutex);
+        if (sizeClass < static_cast<int>(m_free.size()) && !m_free[sizeClass].empty()) {
+            buffer = m_free[sizeClass].back();
+            m_free[sizeClass].pop_back();
+            freeBytes -= buffer->m_size;
+            ++hits;
+        }
+    }
+
+    if (!buffer) {
+        buffer = map(sizeClass);
+        if (!buffer) {
+            return FrameBufferHandle();
+        }
+    }
+
+    // the handle keeps the pool alive for as long as the buffer is out
+    std::shared_ptr<FramePool> pool = shared_from_this();
+    return FrameBufferHandle(buffer, [pool](FrameBuffer *buffer) { pool->release(buffer); });
+}
+
+FrameBuffer *FramePool::map(int sizeClass)
+{
+    size_t size = classSize(sizeClass);
+    bool hugePages = false;
+    void *data = MAP_FAILED;
+
+    if (m_settings.hugePages && size >= HUGE_PAGE_SIZE) {
+        size = roundUp(size, HUGE_PAGE_SIZE);
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        hugePages = data != MAP_FAILED;
+    }
+
+    if (data == MAP_FAILED) {
+        data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED) {
+            qWarning() << "Failed to map" << size << "bytes for a frame:" << strerror(errno);
+            return nullptr;
+        }
+        // no reserved huge pages, let khugepaged back it when it can
+        if (m_settings.hugePages && size >= HUGE_PAGE_SIZE) {
+            madvise(data, size, MADV_HUGEPAGE);
+        }
+    }
+
+    FrameBuffer *buffer = new FrameBuffer;
+    buffer->m_data = static_cast<uint8_t *>(data);
+    buffer->m_size = size;
+    buffer->m_sizeClass = sizeClass;
+    buffer->m_hugePages = hugePages;
+
+    ++maps;
+    mappedBytes += size;
+    return buffer;
+}
+
+void FramePool::unmap(FrameBuffer *buffer)
+{
+    munmap(buffer->m_data, buffer->m_size);
+    mappedBytes -= buffer->m_size;
+    ++unmaps;
+    delete buffer;
+}
+
+void FramePool::release(FrameBuffer *buffer)
+{
+    ++releases;
+
+    QMutexLocker locker(&m_mutex);
+    if (buffer->m_sizeClass >= static_cast<int>(m_free.size())) {
+        m_free.resize(buffer->m_sizeClass + 1);
+    }
+
+    std::vector<FrameBuffer *> &free = m_free[buffer->m_sizeClass];
+    if (static_cast<int>(free.size()) < m_settings.maxFreePerClass &&
+        freeBytes + buffer->m_size <= m_settings.maxFreeBytes) {
+        free.push_back(buffer);
+        freeBytes += buffer->m_size;
+        return;
+    }
+    locker.unlock();
+
+    unmap(buffer);
+}
+
+void FramePool::trim()
+{
+    QMutexLocker locker(&m_mutex);
+    std::vector<std::vector<FrameBuffer *>> free;
+    free.swap(m_free);
+    freeBytes = 0;
+    locker.unlock();
+
+    for (const std::vector<FrameBuffer *> &buffers : free) {
+        for (FrameBuffer *buffer : buffers) {
+            unmap(buffer);
+        }
+    }
+}
+
+QString FramePool::summary() const
+{
+    return QStringLiteral("pool acquires=%1 hits=%2 maps=%3 releases=%4 unmaps=%5 mapped=%6KiB free=%7KiB")
+        .arg(acquires.load())
+        .arg(hits.load())
+        .arg(maps.load())
+        .arg(releases.load())
+        .arg(unmaps.load())
+        .arg(mappedBytes.load() / 1024)
+        .arg(freeBytes.load() / 1024);
+}
@@ -0,0 +1,89 @@
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <QMutex>
+#include <QString>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// Page aligned frame memory from a FramePool. Dropping the last handle
+// gives the buffer back to its pool, so consumers can keep a frame for as
+// long as they need while the producer moves on to a fresh buffer.
+class FrameBuffer
+{
+public:
+    uint8_t *data() const { return m_data; }
+    // usable bytes, at least what was asked for
+    size_t size() const { return m_size; }
+    bool hugePages() const { return m_hugePages; }
+
+private:
+    friend class FramePool;
+
+    uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+    int m_sizeClass = 0;
+    bool m_hugePages = false;
+};
+
+typedef std::shared_ptr<FrameBuffer> FrameBufferHandle;
+
+// Recycles frame buffers by size class. Classes split every power of two
+// in four, so a buffer is at most 25% larger than asked for and the sizes
+// of a resize storm land on a few classes that are mapped once. Buffers
+// live as long as their handles, the pool as long as any of its buffers.
+class FramePool : public std::enable_shared_from_this<FramePool>
+{
+public:
+    struct Settings {
+        // back buffers of 2MB and more with huge pages, explicit ones when
+        // reserved, transparent ones otherwise
+        bool hugePages = false;
+        // free buffers kept per size class and in total
+        int maxFreePerClass = 2;
+        size_t maxFreeBytes = 256 * 1024 * 1024;
+    };
+
+    static std::shared_ptr<FramePool> create();
+    static std::shared_ptr<FramePool> create(const Settings &settings);
+    // the pool streams use unless given another
+    static std::shared_ptr<FramePool> instance();
+
+    ~FramePool();
+
+    // null when the memory can't be mapped
+    FrameBufferHandle acquire(size_t size);
+    // unmap every free buffer
+    void trim();
+
+    static size_t classSize(int sizeClass);
+    static int sizeClassFor(size_t size);
+
+    // acquire() calls, the ones served from the free lists and the ones
+    // that had to map; buffers given back and unmapped
+    std::atomic<quint64> acquires{0};
+    std::atomic<quint64> hits{0};
+    std::atomic<quint64> maps{0};
+    std::atomic<quint64> releases{0};
+    std::atomic<quint64> unmaps{0};
+    std::atomic<quint64> mappedBytes{0};
+    std::atomic<quint64> freeBytes{0};
+
+    QString summary() const;
+
+private:
+    explicit FramePool(const Settings &settings);
+
+    FrameBuffer *map(int sizeClass);
+    void unmap(FrameBuffer *buffer);
+    void release(FrameBuffer *buffer);
+
+    const Settings m_settings;
+    QMutex m_mutex;
+    // free buffers by size class, guarded by m_mutex
+    std::vector<std::vector<FrameBuffer *>> m_free;
+};
+
+#endif // FRAMEPOOL_H
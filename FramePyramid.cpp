@@ -0,0 +1,192 @@
+#include "FramePyramid.h"
+
+#include <QDebug>
+#include <QStringList>
+
+#include <algorithm>
+#include <cstring>
+
+#include "ImageScaler.h"
+
+QVector<FramePyramid::Level> FramePyramid::parseLevels(const QString &spec)
+{
+    QVector<Level> levels;
+    for (const QString &entry : spec.split(QLatin1Char(','))) {
+        const QStringList parts = entry.trimmed().split(QLatin1Char(':'));
+        if (parts.first().isEmpty()) {
+            continue;
+        }
+
+        Level level;
+        const QStringList size = parts.first().split(QLatin1Char('x'));
+        if (size.size() == 2) {
+            level.size = QSize(size[0].toInt(), size[1].toInt());
+            level.filter = BilinearFilter;
+        } else {
+            level.divisor = parts.first().toInt();
+        }
+        if (size.size() == 2 ? level.size.isEmpty() : level.divisor < 1) {
+            qWarning() << "Skipping pyramid level" << entry;
+            continue;
+        }
+
+        if (parts.size() > 1) {
+            if (parts[1] == QLatin1String("bilinear")) {
+                level.filter = BilinearFilter;
+            } else if (parts[1] == QLatin1String("box") && !level.size.isValid()) {
+                level.filter = BoxFilter;
+            } else {
+                qWarning() << "Pyramid level" << entry << "can't use filter" << parts[1];
+            }
+        }
+        levels.append(level);
+    }
+    return levels;
+}
+
+void FramePyramid::Footprint::build(const Level &level, int srcLength, int dstLength)
+{
+    first.resize(dstLength);
+    last.resize(dstLength);
+    for (int d = 0; d < dstLength; ++d) {
+        if (level.filter == BoxFilter) {
+            first[d] = d * level.divisor;
+            last[d] = first[d] + level.divisor - 1;
+        } else {
+            first[d] = ImageScaler::sourcePosition(d, srcLength, dstLength) >> 16;
+            last[d] = qMin(first[d] + 1, srcLength - 1);
+        }
+    }
+}
+
+void FramePyramid::Footprint::map(int begin, int end, int *mappedBegin, int *mappedEnd) const
+{
+    // both ends grow with d
+    *mappedBegin = std::lower_bound(last.begin(), last.end(), begin) - last.begin();
+    *mappedEnd = std::lower_bound(first.begin(), first.end(), end) - first.begin();
+}
+
+FramePyramid::FramePyramid(const QVector<Level> &levels, std::shared_ptr<FramePool> pool)
+    : m_pool(std::move(pool))
+{
+    for (const Level &level : levels) {
+        LevelState state;
+        state.level = level;
+        m_levels.append(state);
+    }
+}
+
+void FramePyramid::begin(const QSize &frameSize, const QRegion &updated, int bandHeight)
+{
+    const bool resized = frameSize != m_frameSize;
+    m_frameSize = frameSize;
+    m_bandHeight = qMax(1, bandHeight);
+
+    for (LevelState &state : m_levels) {
+        const Level &level = state.level;
+        Output &output = state.output;
+        const QSize size = level.size.isValid() ? level.size
+                                                : QSize(frameSize.width() / level.divisor, frameSize.height() / level.divisor);
+        output.damage = QRegion();
+        if (size.isEmpty()) {
+            output.buffer.reset();
+            output.size = size;
+            state.valid = false;
+            continue;
+        }
+
+        if (resized || size != output.size) {
+            output.size = size;
+            output.stride = qint64(size.width()) * 4;
+            state.rows.build(level, frameSize.height(), size.height());
+            state.columns.build(level, frameSize.width(), size.width());
+            state.valid = false;
+        }
+
+        const size_t bytes = size_t(output.stride) * size.height();
+        if (output.buffer && output.buffer.use_count() > 1) {
+            // a consumer kept the last level, continue in a copy of it so
+            // damage still applies
+            FrameBufferHandle fresh = m_pool->acquire(bytes);
+            if (fresh && state.valid) {
+                std::memcpy(fresh->data(), output.buffer->data(), bytes);
+            }
+            output.buffer = fresh;
+        }
+        if (!output.buffer || output.buffer->size() < bytes) {
+            output.buffer = m_pool->acquire(bytes);
+            state.valid = false;
+        }
+        if (!output.buffer) {
+            qWarning() << "Failed to allocate pyramid level of" << size;
+            state.valid = false;
+            continue;
+        }
+
+        if (!state.valid) {
+            output.damage = QRect(QPoint(0, 0), size);
+        } else {
+            for (const QRect &rect : updated) {
+                int left, right, top, bottom;
+                state.columns.map(rect.x(), rect.x() + rect.width(), &left, &right);
+                state.rows.map(rect.y(), rect.y() + rect.height(), &top, &bottom);
+                output.damage += QRect(left, top, right - left, bottom - top);
+            }
+        }
+        state.valid = true;
+    }
+}
+
+void FramePyramid::scaleBand(const uint8_t *frame, qint64 frameStride, int y, int rows)
+{
+    for (const LevelState &state : qAsConst(m_levels)) {
+        const Output &output = state.output;
+        if (!output.buffer || output.damage.isEmpty()) {
+            continue;
+        }
+
+        // level rows reading from this band only
+        const std::vector<int> &first = state.rows.first;
+        const std::vector<int> &last = state.rows.last;
+        const int top = std::lower_bound(first.begin(), first.end(), y) - first.begin();
+        const int end = std::upper_bound(last.begin(), last.end(), y + rows - 1) - last.begin();
+        if (top >= end) {
+            continue;
+        }
+
+        const QRect band(0, top, output.size.width(), end - top);
+        for (const QRect &rect : output.damage) {
+            const QRect part = rect & band;
+            if (!part.isEmpty()) {
+                scaleRows(state, frame, frameStride, part);
+            }
+        }
+    }
+}
+
+void FramePyramid::finish(const uint8_t *frame, qint64 frameStride)
+{
+    // the rows no band could do alone
+    for (const LevelState &state : qAsConst(m_levels)) {
+        if (!state.output.buffer) {
+            continue;
+        }
+        for (const QRect &rect : state.output.damage) {
+            for (int y = rect.top(); y <= rect.bottom(); ++y) {
+                if (state.rows.first[y] / m_bandHeight != state.rows.last[y] / m_bandHeight) {
+                    scaleRows(state, frame, frameStride, QRect(rect.x(), y, rect.width(), 1));
+                }
+            }
+        }
+    }
+}
+
+void FramePyramid::scaleRows(const LevelState &state, const uint8_t *frame, qint64 frameStride, const QRect &rect) const
+{
+    const Output &output = state.output;
+    if (state.level.filter == BoxFilter) {
+        ImageScaler::boxDownscale(frame, frameStride, state.level.divisor, output.buffer->data(), output.stride, rect);
+    } else {
+        ImageScaler::scale(frame, frameStride, m_frameSize, false, output.buffer->data(), output.stride, output.size, rect);
+    }
+}
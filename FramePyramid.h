@@ -0,0 +1,94 @@
+#ifndef FRAMEPYRAMID_H
+#define FRAMEPYRAMID_H
+
+#include <QRegion>
+#include <QSize>
+#include <QString>
+#include <QVector>
+
+#include <memory>
+#include <vector>
+
+#include "FramePool.h"
+
+// Reduced copies of a 32 bit frame for thumbnails and analytics, kept up to
+// date while the frame itself is converted. PipewireStream::processFrame
+// converts fb in bands of rows and passes every finished band to
+// scaleBand(), which fills the level rows that read only from that band
+// while it is still in cache; the few rows reading across a band border
+// are done in finish(). Like fb, a level only recomputes what the frame's
+// damage reaches, and a level a consumer still holds is continued in a
+// fresh buffer.
+class FramePyramid
+{
+public:
+    enum Filter {
+        // average of divisor x divisor blocks, divisors only
+        BoxFilter,
+        // ImageScaler's bilinear filter, any size
+        BilinearFilter
+    };
+
+    struct Level {
+        // the frame size divided by divisor, or size when that is valid
+        int divisor = 2;
+        QSize size;
+        Filter filter = BoxFilter;
+    };
+
+    // "2,4,320x180" and so on: a divisor or a size per level, optionally
+    // followed by ":box" or ":bilinear". Divisors default to the box
+    // filter and sizes to bilinear; invalid entries are skipped
+    static QVector<Level> parseLevels(const QString &spec);
+
+    FramePyramid(const QVector<Level> &levels, std::shared_ptr<FramePool> pool);
+
+    int levelCount() const { return m_levels.size(); }
+
+    // start a frame; updated is what will change in the frame, in frame
+    // coordinates, and bands start at every bandHeight rows from the top
+    void begin(const QSize &frameSize, const QRegion &updated, int bandHeight);
+    // rows y..y+rows-1 of the frame are final. Bands may be passed from
+    // several threads at once, every row of the frame has to be passed
+    void scaleBand(const uint8_t *frame, qint64 frameStride, int y, int rows);
+    void finish(const uint8_t *frame, qint64 frameStride);
+
+    struct Output {
+        // null when the level is empty at this frame size or had no memory
+        FrameBufferHandle buffer;
+        QSize size;
+        qint64 stride = 0;
+        // changed by the current frame, in level coordinates
+        QRegion damage;
+    };
+    const Output &output(int level) const { return m_levels[level].output; }
+
+private:
+    // source rows or columns read by each level row or column
+    struct Footprint {
+        std::vector<int> first;
+        std::vector<int> last;
+
+        void build(const Level &level, int srcLength, int dstLength);
+        // level span reading from source span [begin, end)
+        void map(int begin, int end, int *mappedBegin, int *mappedEnd) const;
+    };
+
+    struct LevelState {
+        Level level;
+        Output output;
+        Footprint rows;
+        Footprint columns;
+        // the buffer holds the level of the previous frame
+        bool valid = false;
+    };
+
+    void scaleRows(const LevelState &state, const uint8_t *frame, qint64 frameStride, const QRect &rect) const;
+
+    std::shared_ptr<FramePool> m_pool;
+    QVector<LevelState> m_levels;
+    QSize m_frameSize;
+    int m_bandHeight = 0;
+};
+
+#endif // FRAMEPYRAMID_H
@@ -0,0 +1,116 @@
+#include "FrameRecorder.h"
+
+#include <QDebug>
+
+#include <cstring>
+
+#include "StreamStats.h"
+
+static FrameRecordRect recordRect(const QRect &rect)
+{
+    return {rect.x(), rect.y(), uint32_t(rect.width()), uint32_t(rect.height())};
+}
+
+FrameRecorder::~FrameRecorder()
+{
+    close();
+}
+
+bool FrameRecorder::open(const QString &path)
+{
+    QMutexLocker locker(&m_mutex);
+
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "Failed to open recording" << path << ":" << m_file.errorString();
+        return false;
+    }
+
+    // the first record starts aligned too
+    char header[FRAME_RECORDING_ALIGN] = {};
+    FrameRecordingHeader fileHeader = {};
+    fileHeader.magic = FRAME_RECORDING_MAGIC;
+    fileHeader.version = FRAME_RECORDING_VERSION;
+    fileHeader.recordAlign = FRAME_RECORDING_ALIGN;
+    std::memcpy(header, &fileHeader, sizeof(fileHeader));
+    m_file.write(header, sizeof(header));
+    bytesWritten += sizeof(header);
+    return true;
+}
+
+void FrameRecorder::close()
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_file.isOpen()) {
+        m_file.close();
+    }
+}
+
+void FrameRecorder::writeRecord(FrameRecord *record, const uint8_t *data, size_t size)
+{
+    static const char padding[FRAME_RECORDING_ALIGN] = {};
+    const size_t unpadded = sizeof(FrameRecord) + size;
+    record->size = (unpadded + FRAME_RECORDING_ALIGN - 1) / FRAME_RECORDING_ALIGN * FRAME_RECORDING_ALIGN;
+
+    m_file.write(reinterpret_cast<const char *>(record), sizeof(FrameRecord));
+    if (size) {
+        m_file.write(reinterpret_cast<const char *>(data), size);
+    }
+    m_file.write(padding, record->size - unpadded);
+    bytesWritten += record->size;
+}
+
+void FrameRecorder::recordFormat(uint32_t mediaSubtype, const spa_video_info_raw &info)
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_file.isOpen()) {
+        return;
+    }
+
+    FrameRecord record = {};
+    record.type = FrameRecordFormat;
+    record.mediaSubtype = mediaSubtype;
+    record.format = info.format;
+    record.flags = info.flags;
+    record.modifier = info.modifier;
+    record.width = info.size.width;
+    record.height = info.size.height;
+    record.framerateNum = info.framerate.num;
+    record.framerateDenom = info.framerate.denom;
+    record.maxFramerateNum = info.max_framerate.num;
+    record.maxFramerateDenom = info.max_framerate.denom;
+    writeRecord(&record, nullptr, 0);
+}
+
+void FrameRecorder::recordFrame(uint32_t dataType, const uint8_t *data, qint64 stride, size_t size,
+                                const QRect &crop, const QRegion &damage, qint64 pts, quint64 sequence)
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_file.isOpen()) {
+        return;
+    }
+
+    FrameRecord record = {};
+    record.type = FrameRecordFrame;
+    record.dataType = dataType;
+    record.stride = stride;
+    record.chunkSize = size;
+    record.pts = pts;
+    record.recordTime = StreamStats::now();
+    record.sequence = sequence;
+    record.crop = recordRect(crop);
+
+    // back to buffer coordinates; too many rects go out as their bounding rect
+    const QRegion bufferDamage = damage.translated(crop.topLeft());
+    if (bufferDamage.rectCount() > FRAME_RECORDING_MAX_DAMAGE) {
+        record.damage[0] = recordRect(bufferDamage.boundingRect());
+        record.damageCount = 1;
+    } else {
+        for (const QRect &rect : bufferDamage) {
+            record.damage[record.damageCount++] = recordRect(rect);
+        }
+    }
+
+    writeRecord(&record, data, size);
+    ++framesRecorded;
+}
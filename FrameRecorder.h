@@ -0,0 +1,47 @@
+#ifndef FRAMERECORDER_H
+#define FRAMERECORDER_H
+
+#include <QFile>
+#include <QMutex>
+#include <QRect>
+#include <QRegion>
+
+#include <atomic>
+
+#include <spa/param/video/raw.h>
+
+#include "FrameRecording.h"
+
+// Writes the negotiated format and every received packed RGB frame to a
+// recording, see FrameRecording.h; FrameReplayer plays it back through
+// PipewireStream::handleFrame. Frames are written on the calling thread,
+// a recording at full HD and 60 fps writes about 500 MB/s.
+class FrameRecorder
+{
+public:
+    FrameRecorder() = default;
+    ~FrameRecorder();
+
+    FrameRecorder(const FrameRecorder &) = delete;
+    FrameRecorder &operator=(const FrameRecorder &) = delete;
+
+    bool open(const QString &path);
+    void close();
+    bool isOpen() const { return m_file.isOpen(); }
+
+    void recordFormat(uint32_t mediaSubtype, const spa_video_info_raw &info);
+    // chunk bytes at data as handleFrame sees them, damage relative to the crop
+    void recordFrame(uint32_t dataType, const uint8_t *data, qint64 stride, size_t size,
+                     const QRect &crop, const QRegion &damage, qint64 pts, quint64 sequence);
+
+    std::atomic<quint64> framesRecorded{0};
+    std::atomic<quint64> bytesWritten{0};
+
+private:
+    void writeRecord(FrameRecord *record, const uint8_t *data, size_t size);
+
+    QMutex m_mutex;
+    QFile m_file;
+};
+
+#endif // FRAMERECORDER_H
@@ -0,0 +1,80 @@
+#ifndef FRAMERECORDING_H
+#define FRAMERECORDING_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Layout of the capture recordings written by FrameRecorder and replayed by
+// FrameReplayer, so handleFrame can be exercised without a compositor.
+//
+// A FrameRecordingHeader, then records one after the other. Every record
+// starts with a FrameRecord and is padded to FRAME_RECORDING_ALIGN bytes;
+// frame records carry the chunk bytes right after the FrameRecord, so a
+// mapped recording feeds the converter from aligned memory. All geometry is
+// in buffer coordinates, as the SPA metadata had it.
+
+static const uint32_t FRAME_RECORDING_MAGIC = 0x43455253; // "SREC"
+static const uint32_t FRAME_RECORDING_VERSION = 1;
+static const int FRAME_RECORDING_MAX_DAMAGE = 16;
+static const size_t FRAME_RECORDING_ALIGN = 64;
+
+enum FrameRecordType : uint32_t {
+    // negotiated format, frames after it use it
+    FrameRecordFormat = 1,
+    FrameRecordFrame = 2
+};
+
+struct FrameRecordingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordAlign;
+    uint32_t reserved;
+};
+
+struct FrameRecordRect {
+    int32_t x;
+    int32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+struct FrameRecord {
+    uint32_t type;
+    uint32_t reserved;
+    // whole record including the padding, the next one starts right after
+    uint64_t size;
+
+    // FrameRecordFormat: spa_video_info_raw and the media subtype
+    uint32_t mediaSubtype;
+    uint32_t format;
+    uint32_t flags;
+    uint32_t width;
+    uint32_t height;
+    uint32_t framerateNum;
+    uint32_t framerateDenom;
+    uint32_t maxFramerateNum;
+    uint32_t maxFramerateDenom;
+    uint32_t reserved2;
+    uint64_t modifier;
+
+    // FrameRecordFrame: spa_data type, chunk stride and size, the chunk
+    // bytes follow the record
+    uint32_t dataType;
+    int32_t stride;
+    uint64_t chunkSize;
+    // spa_meta_header pts or -1, CLOCK_MONOTONIC when recorded, and the
+    // stream sequence; gaps are frames that were dropped
+    int64_t pts;
+    int64_t recordTime;
+    uint64_t sequence;
+    FrameRecordRect crop;
+    // 0 when the producer sent none
+    uint32_t damageCount;
+    uint32_t reserved3;
+    FrameRecordRect damage[FRAME_RECORDING_MAX_DAMAGE];
+};
+
+static_assert(sizeof(FrameRecord) % FRAME_RECORDING_ALIGN == 0, "frame data has to start aligned");
+static_assert(sizeof(FrameRecordingHeader) <= FRAME_RECORDING_ALIGN, "header overlaps the first record");
+
+#endif // FRAMERECORDING_H
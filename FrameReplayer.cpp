@@ -0,0 +1,235 @@
+#include "FrameReplayer.h"
+
+#include <QDebug>
+#include <QFile>
+#include <QMutexLocker>
+#include <QStringList>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "PipewireStream.h"
+
+static QString dataTypeName(uint32_t type)
+{
+    switch (type) {
+    case SPA_DATA_MemPtr:
+        return QStringLiteral("MemPtr");
+    case SPA_DATA_MemFd:
+        return QStringLiteral("MemFd");
+    case SPA_DATA_DmaBuf:
+        return QStringLiteral("DmaBuf");
+    default:
+        return QString::number(type);
+    }
+}
+
+static spa_region spaRegion(const FrameRecordRect &rect)
+{
+    return {SPA_POINT(rect.x, rect.y), SPA_RECTANGLE(rect.width, rect.height)};
+}
+
+static void sleepUntil(qint64 ns)
+{
+    timespec deadline;
+    deadline.tv_sec = ns / 1000000000LL;
+    deadline.tv_nsec = ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr) == EINTR) {
+    }
+}
+
+FrameReplayer::~FrameReplayer()
+{
+    close();
+}
+
+bool FrameReplayer::open(const QString &path)
+{
+    close();
+
+    const int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        qWarning() << "Failed to open recording" << path << ":" << strerror(errno);
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) < 0 || size_t(info.st_size) < FRAME_RECORDING_ALIGN) {
+        qWarning() << "Recording" << path << "is too short";
+        ::close(fd);
+        return false;
+    }
+
+    void *map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        qWarning() << "Failed to map recording" << path << ":" << strerror(errno);
+        return false;
+    }
+    m_map = static_cast<uint8_t *>(map);
+    m_mapSize = info.st_size;
+
+    const FrameRecordingHeader *header = reinterpret_cast<const FrameRecordingHeader *>(m_map);
+    if (header->magic != FRAME_RECORDING_MAGIC || header->version != FRAME_RECORDING_VERSION
+            || header->recordAlign != FRAME_RECORDING_ALIGN) {
+        qWarning() << "Not a recording of this version:" << path;
+        close();
+        return false;
+    }
+
+    // index the records, a recording cut short ends at the last whole one
+    size_t offset = FRAME_RECORDING_ALIGN;
+    while (offset + sizeof(FrameRecord) <= m_mapSize) {
+        const FrameRecord *record = reinterpret_cast<const FrameRecord *>(m_map + offset);
+        if (record->size < sizeof(FrameRecord) || record->size % FRAME_RECORDING_ALIGN
+                || record->size > m_mapSize - offset
+                || (record->type == FrameRecordFrame && record->chunkSize > record->size - sizeof(FrameRecord))
+                || record->damageCount > FRAME_RECORDING_MAX_DAMAGE) {
+            qWarning() << "Recording" << path << "is damaged at offset" << offset;
+            break;
+        }
+        if (record->type == FrameRecordFrame) {
+            ++m_frames;
+        }
+        m_records.append(record);
+        offset += record->size;
+    }
+
+    qInfo() << "Loaded" << m_frames << "frames from" << path;
+    return true;
+}
+
+void FrameReplayer::close()
+{
+    if (m_map) {
+        munmap(m_map, m_mapSize);
+    }
+    m_map = nullptr;
+    m_mapSize = 0;
+    m_records.clear();
+    m_frames = 0;
+}
+
+void FrameReplayer::replay(PipewireStream *stream, bool paced, int loops)
+{
+    quint64 lastSequence = 0;
+    for (const FrameRecord *record : qAsConst(m_records)) {
+        if (record->type == FrameRecordFrame) {
+            lastSequence = qMax<quint64>(lastSequence, record->sequence);
+        }
+    }
+
+    for (int loop = 0; loop < loops; ++loop) {
+        // processFrame only takes newer frames; the jump between loops
+        // makes the first frame of a loop a full update
+        const quint64 sequenceOffset = quint64(loop) * (lastSequence + 2);
+        const qint64 loopStart = StreamStats::now();
+        qint64 firstRecordTime = -1;
+
+        for (const FrameRecord *record : qAsConst(m_records)) {
+            if (record->type == FrameRecordFormat) {
+                spa_video_info_raw info = {};
+                info.format = static_cast<spa_video_format>(record->format);
+                info.flags = record->flags;
+                info.modifier = record->modifier;
+                info.size = SPA_RECTANGLE(record->width, record->height);
+                info.framerate = SPA_FRACTION(record->framerateNum, record->framerateDenom);
+                info.max_framerate = SPA_FRACTION(record->maxFramerateNum, record->maxFramerateDenom);
+                stream->setVideoFormat(record->mediaSubtype, info);
+                continue;
+            }
+            if (record->type != FrameRecordFrame || !stream->hasVideoFormat) {
+                continue;
+            }
+
+            if (paced) {
+                if (firstRecordTime < 0) {
+                    firstRecordTime = record->recordTime;
+                }
+                sleepUntil(loopStart + record->recordTime - firstRecordTime);
+            }
+            replayFrame(stream, record, record->sequence + sequenceOffset);
+        }
+    }
+}
+
+void FrameReplayer::replayFrame(PipewireStream *stream, const FrameRecord *record, quint64 sequence)
+{
+    spa_chunk chunk = {};
+    chunk.size = record->chunkSize;
+    chunk.stride = record->stride;
+
+    spa_data data = {};
+    data.type = SPA_DATA_MemPtr;
+    data.flags = SPA_DATA_FLAG_READABLE;
+    data.fd = -1;
+    data.maxsize = record->chunkSize;
+    data.data = const_cast<FrameRecord *>(record + 1);
+    data.chunk = &chunk;
+
+    spa_meta_header header = {};
+    header.pts = record->pts;
+    header.seq = record->sequence;
+
+    spa_meta_region crop = {};
+    crop.region = spaRegion(record->crop);
+
+    // the list ends at the first region without a size
+    spa_meta_region damage[FRAME_RECORDING_MAX_DAMAGE + 1] = {};
+    for (uint32_t i = 0; i < record->damageCount; ++i) {
+        damage[i].region = spaRegion(record->damage[i]);
+    }
+
+    spa_meta metas[3] = {
+        {SPA_META_Header, sizeof(header), &header},
+        {SPA_META_VideoCrop, sizeof(crop), &crop},
+        {SPA_META_VideoDamage, sizeof(damage), damage},
+    };
+
+    spa_buffer buffer = {};
+    buffer.n_metas = 3;
+    buffer.metas = metas;
+    buffer.n_datas = 1;
+    buffer.datas = &data;
+
+    pw_buffer pwBuffer = {};
+    pwBuffer.buffer = &buffer;
+
+    // the same steps onStreamProcess takes without workers
+    const qint64 processStart = StreamStats::now();
+    const qint64 cpuStart = StreamStats::threadCpuTime();
+    QMutexLocker locker(&stream->m_processMutex);
+    ++stream->stats.framesReceived;
+    stream->handleFrame(&pwBuffer, sequence);
+    locker.unlock();
+    const qint64 elapsed = StreamStats::now() - processStart;
+    stream->stats.process.record(elapsed);
+    stream->stats.cpu.record(StreamStats::threadCpuTime() - cpuStart);
+
+    Result &result = m_results[quint64(stream->videoFormat.format) << 8 | record->dataType];
+    ++result.frames;
+    result.bytes += record->chunkSize;
+    result.nanoseconds += elapsed;
+}
+
+QString FrameReplayer::summary() const
+{
+    QStringList lines;
+    for (auto it = m_results.constBegin(); it != m_results.constEnd(); ++it) {
+        const Result &result = it.value();
+        const double seconds = qMax<qint64>(1, result.nanoseconds) / 1e9;
+        lines << QStringLiteral("replay %1/%2 frames=%3 fps=%4 ns/frame=%5 MB/s=%6")
+                     .arg(QLatin1String(FrameConverter::formatName(static_cast<spa_video_format>(it.key() >> 8))))
+                     .arg(dataTypeName(it.key() & 0xff))
+                     .arg(result.frames)
+                     .arg(result.frames / seconds, 0, 'f', 1)
+                     .arg(result.nanoseconds / qint64(qMax<quint64>(1, result.frames)))
+                     .arg(result.bytes / seconds / 1e6, 0, 'f', 1);
+    }
+    return lines.join(QLatin1Char('\n'));
+}
@@ -0,0 +1,55 @@
+#ifndef FRAMEREPLAYER_H
+#define FRAMEREPLAYER_H
+
+#include <QMap>
+#include <QString>
+#include <QVector>
+
+#include "FrameRecording.h"
+
+class PipewireStream;
+
+// Plays a recording back through PipewireStream::handleFrame, so the
+// processing path can be measured without a compositor. The recording is
+// mapped and every frame is handed over as a MemPtr buffer with the
+// recorded header, crop and damage metadata; DMA-BUF frames were recorded
+// after readback and replay like MemFd ones. The stream needs no
+// PipeWire connection.
+class FrameReplayer
+{
+public:
+    FrameReplayer() = default;
+    ~FrameReplayer();
+
+    FrameReplayer(const FrameReplayer &) = delete;
+    FrameReplayer &operator=(const FrameReplayer &) = delete;
+
+    bool open(const QString &path);
+    void close();
+    int frameCount() const { return m_frames; }
+
+    // feed every frame to the stream loops times, as fast as possible or
+    // keeping the recorded gaps between frames
+    void replay(PipewireStream *stream, bool paced, int loops = 1);
+
+    // frames/s and ns/frame per format and recorded data type
+    QString summary() const;
+
+private:
+    void replayFrame(PipewireStream *stream, const FrameRecord *record, quint64 sequence);
+
+    uint8_t *m_map = nullptr;
+    size_t m_mapSize = 0;
+    QVector<const FrameRecord *> m_records;
+    int m_frames = 0;
+
+    struct Result {
+        quint64 frames = 0;
+        quint64 bytes = 0;
+        qint64 nanoseconds = 0;
+    };
+    // keyed by format << 8 | data type
+    QMap<quint64, Result> m_results;
+};
+
+#endif // FRAMEREPLAYER_H
@@ -0,0 +1,71 @@
+#ifndef FRAMERING_H
+#define FRAMERING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Layout of the shared memory frame ring written by FrameRingWriter and
+// read by FrameRingReader. Plain C++ so consumers don't need Qt.
+//
+// The ring is a sealed memfd: a FrameRingHeader, then slotCount slots of
+// slotSize bytes, each a FrameRingSlot followed by the pixels at
+// FRAME_RING_DATA_OFFSET. Readers map it read-only, so the writer never
+// waits for them; a slot being overwritten while read is detected through
+// its version, which is odd while the writer is inside.
+
+static const uint32_t FRAME_RING_MAGIC = 0x474e5246; // "FRNG"
+static const uint32_t FRAME_RING_VERSION = 1;
+static const int FRAME_RING_MAX_DAMAGE = 16;
+// pixels start page aligned in every slot
+static const size_t FRAME_RING_DATA_OFFSET = 4096;
+
+struct FrameRingRect {
+    int32_t x;
+    int32_t y;
+    int32_t width;
+    int32_t height;
+};
+
+struct FrameRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t reserved;
+    uint64_t slotSize;
+    uint64_t slotsOffset;
+
+    // ring position of the newest complete frame, 0 before the first
+    std::atomic<uint64_t> published;
+    // bumped and woken with FUTEX_WAKE on every publish and on close
+    std::atomic<uint32_t> futex;
+    // set when the writer moved on to a new ring, e.g. for larger frames;
+    // readers reconnect then
+    std::atomic<uint32_t> closed;
+};
+
+struct FrameRingSlot {
+    // odd while being written
+    std::atomic<uint64_t> version;
+    // position in the ring, slot index is position % slotCount
+    uint64_t position;
+    // stream frame sequence, gaps are frames that were dropped
+    uint64_t sequence;
+    // spa_meta_header pts or -1, and CLOCK_MONOTONIC when published
+    int64_t pts;
+    int64_t publishTime;
+    // spa_video_format of the pixels
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    // changed rects since the previous frame; 0 means the whole frame
+    uint32_t damageCount;
+    uint32_t reserved;
+    FrameRingRect damage[FRAME_RING_MAX_DAMAGE];
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the ring needs lock-free 64bit atomics");
+static_assert(sizeof(FrameRingSlot) <= FRAME_RING_DATA_OFFSET, "slot header overlaps the pixels");
+
+#endif // FRAMERING_H
@@ -0,0 +1,189 @@
+#include "FrameRingReader.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+FrameRingReader::~FrameRingReader()
+{
+    close();
+}
+
+bool FrameRingReader::connect(const char *socketPath)
+{
+    const int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        fprintf(stderr, "FrameRingReader: socket failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath, sizeof(address.sun_path) - 1);
+    if (::connect(sock, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0) {
+        fprintf(stderr, "FrameRingReader: can't connect to %s: %s\n", socketPath, strerror(errno));
+        ::close(sock);
+        return false;
+    }
+
+    // one byte carrying the memfd
+    char byte;
+    iovec iov = {&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    const ssize_t received = recvmsg(sock, &message, MSG_CMSG_CLOEXEC);
+    ::close(sock);
+
+    const cmsghdr *cmsg = received > 0 ? CMSG_FIRSTHDR(&message) : nullptr;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "FrameRingReader: no ring received from %s\n", socketPath);
+        return false;
+    }
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+    return open(fd);
+}
+
+bool FrameRingReader::open(int fd)
+{
+    close();
+
+    struct stat info;
+    if (fstat(fd, &info) < 0 || size_t(info.st_size) < sizeof(FrameRingHeader)) {
+        fprintf(stderr, "FrameRingReader: not a frame ring\n");
+        ::close(fd);
+        return false;
+    }
+
+    // the writer seals the size, so the mapping can't be cut short
+    void *map = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "FrameRingReader: mmap failed: %s\n", strerror(errno));
+        ::close(fd);
+        return false;
+    }
+
+    const FrameRingHeader *header = static_cast<const FrameRingHeader *>(map);
+    if (header->magic != FRAME_RING_MAGIC || header->version != FRAME_RING_VERSION ||
+        header->slotsOffset + header->slotCount * header->slotSize > size_t(info.st_size)) {
+        fprintf(stderr, "FrameRingReader: unsupported frame ring\n");
+        munmap(map, info.st_size);
+        ::close(fd);
+        return false;
+    }
+
+    m_fd = fd;
+    m_size = info.st_size;
+    m_header = header;
+    m_lastPosition = 0;
+    return true;
+}
+
+void FrameRingReader::close()
+{
+    if (m_header) {
+        munmap(const_cast<FrameRingHeader *>(m_header), m_size);
+        m_header = nullptr;
+    }
+    if (m_fd >= 0) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+bool FrameRingReader::wait(int timeoutMs)
+{
+    if (!m_header) {
+        return false;
+    }
+
+    timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    for (;;) {
+        // read the futex word first, a publish after this wakes the wait below
+        const uint32_t futex = m_header->futex.load(std::memory_order_acquire);
+        if (m_header->published.load(std::memory_order_acquire) != m_lastPosition) {
+            return true;
+        }
+        if (m_header->closed.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        timespec timeout = {};
+        if (timeoutMs >= 0) {
+            timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            const long long left = (deadline.tv_sec - now.tv_sec) * 1000000000LL + (deadline.tv_nsec - now.tv_nsec);
+            if (left <= 0) {
+                return false;
+            }
+            timeout.tv_sec = left / 1000000000LL;
+            timeout.tv_nsec = left % 1000000000LL;
+        }
+
+        // shared futex, the writer is another process
+        syscall(SYS_futex, &m_header->futex, FUTEX_WAIT, futex, timeoutMs >= 0 ? &timeout : nullptr, nullptr, 0);
+    }
+}
+
+bool FrameRingReader::acquire(Frame *frame)
+{
+    if (!m_header) {
+        return false;
+    }
+
+    const uint64_t position = m_header->published.load(std::memory_order_acquire);
+    if (position == 0) {
+        return false;
+    }
+
+    const uint8_t *base = reinterpret_cast<const uint8_t *>(m_header);
+    const uint8_t *slotStart = base + m_header->slotsOffset + (position % m_header->slotCount) * m_header->slotSize;
+    const FrameRingSlot *slot = reinterpret_cast<const FrameRingSlot *>(slotStart);
+
+    const uint64_t version = slot->version.load(std::memory_order_acquire);
+    if (version & 1 || slot->position != position) {
+        // lapped by the writer already
+        return false;
+    }
+
+    m_lastPosition = position;
+    frame->slot = slot;
+    frame->data = slotStart + FRAME_RING_DATA_OFFSET;
+    frame->version = version;
+    return isIntact(*frame);
+}
+
+bool FrameRingReader::isIntact(const Frame &frame) const
+{
+    // order the caller's reads of the slot before the version check
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return frame.slot && frame.slot->version.load(std::memory_order_relaxed) == frame.version;
+}
+
+bool FrameRingReader::isClosed() const
+{
+    return m_header && m_header->closed.load(std::memory_order_acquire);
+}
@@ -0,0 +1,61 @@
+#ifndef FRAMERINGREADER_H
+#define FRAMERINGREADER_H
+
+#include "FrameRing.h"
+
+// Consumer side of the shared memory frame ring, usable without Qt.
+//
+//     FrameRingReader reader;
+//     reader.connect("/run/user/1000/screencast-42");
+//     FrameRingReader::Frame frame;
+//     while (reader.wait(-1)) {
+//         if (reader.acquire(&frame)) {
+//             consume(frame.data, frame.slot->stride);
+//             if (!reader.isIntact(frame)) {
+//                 // overwritten while reading, drop what was consumed
+//             }
+//         }
+//     }
+class FrameRingReader
+{
+public:
+    struct Frame {
+        const FrameRingSlot *slot = nullptr;
+        const uint8_t *data = nullptr;
+        // slot version when acquired
+        uint64_t version = 0;
+    };
+
+    FrameRingReader() = default;
+    ~FrameRingReader();
+
+    FrameRingReader(const FrameRingReader &) = delete;
+    FrameRingReader &operator=(const FrameRingReader &) = delete;
+
+    // get the ring's memfd from the writer's socket and map it
+    bool connect(const char *socketPath);
+    // map a ring memfd, the reader takes ownership of fd
+    bool open(int fd);
+    void close();
+    bool isOpen() const { return m_header != nullptr; }
+
+    // wait for a frame newer than the last acquired one, timeoutMs < 0
+    // waits forever. False on timeout or when the writer closed the ring
+    bool wait(int timeoutMs);
+    // the newest frame, false when there is none or it's being written
+    bool acquire(Frame *frame);
+    // whether the frame was left alone since acquire(), check after using it
+    bool isIntact(const Frame &frame) const;
+    // the writer moved on, connect() again for the new ring
+    bool isClosed() const;
+
+    const FrameRingHeader *header() const { return m_header; }
+
+private:
+    int m_fd = -1;
+    size_t m_size = 0;
+    const FrameRingHeader *m_header = nullptr;
+    uint64_t m_lastPosition = 0;
+};
+
+#endif // FRAMERINGREADER_H
@@ -0,0 +1,253 @@
+#include "FrameRingWriter.h"
+
+#include <QDebug>
+#include <QFile>
+#include <QSocketNotifier>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <new>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// glibc before 2.29 lacks it, kernels before 5.1 reject it
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+static size_t roundUpToPage(size_t size)
+{
+    const size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+static void wakeReaders(FrameRingHeader *header)
+{
+    header->futex.fetch_add(1, std::memory_order_release);
+    syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+FrameRingWriter::FrameRingWriter(int slotCount, QObject *parent)
+    : QObject(parent)
+    , m_slotCount(qMax(2, slotCount))
+{
+}
+
+FrameRingWriter::~FrameRingWriter()
+{
+    if (m_socket >= 0) {
+        ::close(m_socket);
+        unlink(QFile::encodeName(m_socketPath).constData());
+    }
+    closeRing();
+}
+
+bool FrameRingWriter::listen(const QString &socketPath)
+{
+    const QByteArray path = QFile::encodeName(socketPath);
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (size_t(path.size()) >= sizeof(address.sun_path)) {
+        qWarning() << "Frame ring socket path too long:" << socketPath;
+        return false;
+    }
+    std::memcpy(address.sun_path, path.constData(), path.size());
+
+    m_socket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (m_socket < 0) {
+        qWarning() << "Failed to create frame ring socket:" << strerror(errno);
+        return false;
+    }
+
+    unlink(path.constData());
+    if (bind(m_socket, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 || ::listen(m_socket, 8) < 0) {
+        qWarning() << "Failed to listen on" << socketPath << ":" << strerror(errno);
+        ::close(m_socket);
+        m_socket = -1;
+        return false;
+    }
+
+    m_socketPath = socketPath;
+    m_notifier = new QSocketNotifier(m_socket, QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &FrameRingWriter::acceptReader);
+    return true;
+}
+
+void FrameRingWriter::acceptReader()
+{
+    for (;;) {
+        const int reader = accept4(m_socket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (reader < 0) {
+            return;
+        }
+
+        QMutexLocker locker(&m_mutex);
+        // nothing published yet, size the ring for full HD until the first frame
+        if (m_fd < 0 && !createRing(1920 * 1080 * 4)) {
+            ::close(reader);
+            continue;
+        }
+
+        char byte = 0;
+        iovec iov = {&byte, 1};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr message = {};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &m_fd, sizeof(int));
+
+        if (sendmsg(reader, &message, MSG_NOSIGNAL) < 0) {
+            qWarning() << "Failed to send the frame ring:" << strerror(errno);
+        } else {
+            ++readersConnected;
+        }
+        ::close(reader);
+    }
+}
+
+bool FrameRingWriter::createRing(size_t frameBytes)
+{
+    const size_t slotSize = FRAME_RING_DATA_OFFSET + roundUpToPage(frameBytes);
+    const size_t slotsOffset = roundUpToPage(sizeof(FrameRingHeader));
+    const size_t size = slotsOffset + slotSize * m_slotCount;
+
+    const int fd = memfd_create("screencast-frame-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        qWarning() << "Failed to create frame ring memfd:" << strerror(errno);
+        return false;
+    }
+
+    // readers map the size they see, it must not change under them
+    if (ftruncate(fd, size) < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+        qWarning() << "Failed to size frame ring:" << strerror(errno);
+        ::close(fd);
+        return false;
+    }
+
+    void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        qWarning() << "Failed to map frame ring:" << strerror(errno);
+        ::close(fd);
+        return false;
+    }
+
+    // only the mapping above stays writable; the seals hold for every fd
+    // of the memfd, so readers can't map it writable, reopened or not
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE | F_SEAL_SEAL) < 0) {
+        qWarning() << "Failed to seal frame ring read-only, needs Linux 5.1:" << strerror(errno);
+        munmap(map, size);
+        ::close(fd);
+        return false;
+    }
+
+    closeRing();
+
+    // the memfd starts zeroed, the slots too
+    m_header = new (map) FrameRingHeader;
+    m_header->magic = FRAME_RING_MAGIC;
+    m_header->version = FRAME_RING_VERSION;
+    m_header->slotCount = m_slotCount;
+    m_header->reserved = 0;
+    m_header->slotSize = slotSize;
+    m_header->slotsOffset = slotsOffset;
+    m_header->published.store(0, std::memory_order_relaxed);
+    m_header->futex.store(0, std::memory_order_relaxed);
+    m_header->closed.store(0, std::memory_order_release);
+
+    m_fd = fd;
+    m_map = static_cast<uint8_t *>(map);
+    m_mapSize = size;
+    m_position = 0;
+    ++ringsCreated;
+    return true;
+}
+
+void FrameRingWriter::closeRing()
+{
+    if (!m_header) {
+        return;
+    }
+
+    m_header->closed.store(1, std::memory_order_release);
+    wakeReaders(m_header);
+
+    munmap(m_map, m_mapSize);
+    ::close(m_fd);
+    m_header = nullptr;
+    m_map = nullptr;
+    m_fd = -1;
+}
+
+void FrameRingWriter::publish(const uint8_t *data, qint64 stride, const QSize &size, spa_video_format format,
+                              const QRegion &damage, quint64 sequence, qint64 pts)
+{
+    const int rowBytes = size.width() * (format == SPA_VIDEO_FORMAT_RGB || format == SPA_VIDEO_FORMAT_BGR ? 3 : 4);
+    const size_t frameBytes = size_t(rowBytes) * size.height();
+
+    QMutexLocker locker(&m_mutex);
+    if (!m_header || m_header->slotSize - FRAME_RING_DATA_OFFSET < frameBytes) {
+        if (!createRing(frameBytes)) {
+            return;
+        }
+    }
+
+    const uint64_t position = ++m_position;
+    uint8_t *slotStart = m_map + m_header->slotsOffset + (position % m_header->slotCount) * m_header->slotSize;
+    FrameRingSlot *slot = reinterpret_cast<FrameRingSlot *>(slotStart);
+
+    // odd version: readers of the previous frame in this slot see it torn
+    const uint64_t version = slot->version.load(std::memory_order_relaxed);
+    slot->version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->position = position;
+    slot->sequence = sequence;
+    slot->pts = pts;
+    slot->format = format;
+    slot->width = size.width();
+    slot->height = size.height();
+    slot->stride = rowBytes;
+
+    // too many rects to list go out as their bounding rect
+    const int rects = damage.rectCount();
+    if (rects == 0 || rects > FRAME_RING_MAX_DAMAGE) {
+        const QRect bounds = damage.boundingRect();
+        slot->damageCount = rects ? 1 : 0;
+        slot->damage[0] = {bounds.x(), bounds.y(), bounds.width(), bounds.height()};
+    } else {
+        int i = 0;
+        for (const QRect &rect : damage) {
+            slot->damage[i++] = {rect.x(), rect.y(), rect.width(), rect.height()};
+        }
+        slot->damageCount = rects;
+    }
+
+    uint8_t *pixels = slotStart + FRAME_RING_DATA_OFFSET;
+    for (int y = 0; y < size.height(); ++y) {
+        std::memcpy(pixels + y * rowBytes, data + y * stride, rowBytes);
+    }
+
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    slot->publishTime = now.tv_sec * 1000000000LL + now.tv_nsec;
+
+    slot->version.store(version + 2, std::memory_order_release);
+    m_header->published.store(position, std::memory_order_release);
+    wakeReaders(m_header);
+    ++framesPublished;
+}
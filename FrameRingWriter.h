@@ -0,0 +1,60 @@
+#ifndef FRAMERINGWRITER_H
+#define FRAMERINGWRITER_H
+
+#include <QMutex>
+#include <QObject>
+#include <QRegion>
+#include <QSize>
+
+#include <atomic>
+
+#include <spa/param/video/raw.h>
+
+#include "FrameRing.h"
+
+class QSocketNotifier;
+
+// Publishes converted frames into a shared memory ring for other
+// processes, see FrameRing.h. Readers get the memfd over a unix socket and
+// use FrameRingReader. A frame larger than the slots starts a new ring and
+// marks the old one closed, readers then connect again.
+class FrameRingWriter : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit FrameRingWriter(int slotCount = 4, QObject *parent = nullptr);
+    ~FrameRingWriter();
+
+    // hand the ring to every reader connecting to socketPath
+    bool listen(const QString &socketPath);
+
+    // copy a frame into the next slot and wake the readers; any thread
+    void publish(const uint8_t *data, qint64 stride, const QSize &size, spa_video_format format,
+                 const QRegion &damage, quint64 sequence, qint64 pts);
+
+    std::atomic<quint64> framesPublished{0};
+    std::atomic<quint64> ringsCreated{0};
+    std::atomic<quint64> readersConnected{0};
+
+private:
+    bool createRing(size_t frameBytes);
+    void closeRing();
+    void acceptReader();
+
+    const int m_slotCount;
+
+    // guards the ring, publish() and acceptReader() run on different threads
+    QMutex m_mutex;
+    int m_fd = -1;
+    uint8_t *m_map = nullptr;
+    size_t m_mapSize = 0;
+    FrameRingHeader *m_header = nullptr;
+    uint64_t m_position = 0;
+
+    int m_socket = -1;
+    QString m_socketPath;
+    QSocketNotifier *m_notifier = nullptr;
+};
+
+#endif // FRAMERINGWRITER_H
@@ -0,0 +1,166 @@
+#include "FrameStitcher.h"
+
+#include <QDebug>
+#include <QTimer>
+
+#include <cstring>
+
+FrameStitcher::FrameStitcher(QObject *parent)
+    : QObject(parent)
+{
+}
+
+FrameStitcher::~FrameStitcher()
+{
+    qDeleteAll(m_outputs);
+}
+
+void FrameStitcher::setOutputGeometry(PipewireStream *stream, const QRect &geometry)
+{
+    QWriteLocker locker(&m_lock);
+
+    Output *output = m_outputs.value(stream);
+    if (!output) {
+        output = new Output;
+        m_outputs.insert(stream, output);
+    }
+    output->geometry = geometry;
+    relayout();
+}
+
+void FrameStitcher::removeOutput(PipewireStream *stream)
+{
+    QWriteLocker locker(&m_lock);
+
+    delete m_outputs.take(stream);
+    relayout();
+}
+
+void FrameStitcher::setInterval(int msec)
+{
+    if (msec <= 0) {
+        delete m_timer;
+        m_timer = nullptr;
+        return;
+    }
+
+    if (!m_timer) {
+        m_timer = new QTimer(this);
+        connect(m_timer, &QTimer::timeout, this, &FrameStitcher::emitFrame);
+    }
+    m_timer->start(msec);
+}
+
+QSize FrameStitcher::desktopSize() const
+{
+    QReadLocker locker(&m_lock);
+    return m_desktopSize;
+}
+
+bool FrameStitcher::beginWrite(PipewireStream *stream, const QSize &frameSize, Target *target)
+{
+    m_lock.lockForRead();
+
+    Output *output = m_outputs.value(stream);
+    if (output && output->frameSize != frameSize) {
+        // the first frame or a mode change moves the outputs around
+        m_lock.unlock();
+        m_lock.lockForWrite();
+        output = m_outputs.value(stream);
+        if (output && output->frameSize != frameSize) {
+            output->frameSize = frameSize;
+            relayout();
+        }
+        m_lock.unlock();
+        m_lock.lockForRead();
+        output = m_outputs.value(stream);
+    }
+
+    if (!output || output->frameSize != frameSize) {
+        m_lock.unlock();
+        return false;
+    }
+
+    target->data = m_desktop.data() + output->rect.y() * m_stride + output->rect.x() * 4;
+    target->stride = m_stride;
+    target->valid = output->valid;
+    return true;
+}
+
+void FrameStitcher::endWrite(PipewireStream *stream, const QRegion &updated)
+{
+    // only the stream itself touches its output while writing
+    Output *output = m_outputs.value(stream);
+    output->valid = true;
+
+    if (!updated.isEmpty()) {
+        QMutexLocker locker(&m_damageMutex);
+        m_damage += updated.translated(output->rect.topLeft());
+    }
+
+    m_lock.unlock();
+}
+
+void FrameStitcher::relayout()
+{
+    QRect bounds;
+    for (const Output *output : qAsConst(m_outputs)) {
+        bounds |= QRect(output->geometry.topLeft(), output->frameSize.isEmpty() ? output->geometry.size() : output->frameSize);
+    }
+
+    QHash<Output *, QRect> rects;
+    bool moved = bounds.size() != m_desktopSize;
+    for (Output *output : qAsConst(m_outputs)) {
+        const QSize size = output->frameSize.isEmpty() ? output->geometry.size() : output->frameSize;
+        const QRect rect(output->geometry.topLeft() - bounds.topLeft(), size);
+        rects.insert(output, rect);
+        moved |= rect != output->rect;
+    }
+    if (!moved) {
+        return;
+    }
+
+    // keep what the outputs already wrote, static outputs may not send
+    // another frame for a long time
+    const qint64 stride = qint64(bounds.width()) * 4;
+    std::vector<uint8_t> desktop(stride * bounds.height());
+    for (Output *output : qAsConst(m_outputs)) {
+        const QRect rect = rects.value(output);
+        if (output->valid && output->rect.size() == rect.size()) {
+            for (int y = 0; y < rect.height(); ++y) {
+                std::memcpy(desktop.data() + (rect.y() + y) * stride + rect.x() * 4,
+                            m_desktop.data() + (output->rect.y() + y) * m_stride + output->rect.x() * 4,
+                            rect.width() * 4);
+            }
+        } else {
+            output->valid = false;
+        }
+        output->rect = rect;
+    }
+
+    m_desktop.swap(desktop);
+    m_desktopSize = bounds.size();
+    m_stride = stride;
+
+    QMutexLocker locker(&m_damageMutex);
+    m_damage = QRect(QPoint(0, 0), m_desktopSize);
+}
+
+void FrameStitcher::emitFrame()
+{
+    // no stream is writing while the frame is out
+    QWriteLocker locker(&m_lock);
+
+    QMutexLocker damageLocker(&m_damageMutex);
+    const QRegion damage = m_damage;
+    m_damage = QRegion();
+    damageLocker.unlock();
+
+    if (damage.isEmpty() || m_desktopSize.isEmpty()) {
+        return;
+    }
+
+    // the converters hand out R, G, B, x bytes
+    QImage image(m_desktop.data(), m_desktopSize.width(), m_desktopSize.height(), m_stride, QImage::Format_RGBX8888);
+    emit FrameReady(&image, damage);
+}
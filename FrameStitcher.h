@@ -0,0 +1,85 @@
+#ifndef FRAMESTITCHER_H
+#define FRAMESTITCHER_H
+
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QObject>
+#include <QReadWriteLock>
+#include <QRegion>
+
+#include <vector>
+
+class PipewireStream;
+class QTimer;
+
+// One virtual desktop frame for several captured outputs. Streams convert
+// their frames straight into their part of the desktop, see
+// PipewireStream::processFrame, so the desktop always holds the latest
+// frame of every output no matter when each one delivers. The desktop is
+// emitted on a timer, only when something changed.
+//
+// Streams write their areas concurrently; emission and layout changes take
+// the lock exclusively.
+class FrameStitcher : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit FrameStitcher(QObject *parent = nullptr);
+    ~FrameStitcher();
+
+    // where the output of a stream goes on the desktop; the size is a guess
+    // until the first frame, which may be larger on scaled outputs
+    void setOutputGeometry(PipewireStream *stream, const QRect &geometry);
+    void removeOutput(PipewireStream *stream);
+
+    // emit FrameReady at most every msec milliseconds, 0 stops it
+    void setInterval(int msec);
+
+    QSize desktopSize() const;
+
+    // the area of a stream's frame in the desktop, 4 bytes per pixel
+    struct Target {
+        uint8_t *data = nullptr;
+        qint64 stride = 0;
+        // false when the area doesn't hold the stream's last frame
+        bool valid = false;
+    };
+    // lock the stream's area for writing a frameSize frame, false for
+    // streams without geometry. Every successful call needs an endWrite()
+    bool beginWrite(PipewireStream *stream, const QSize &frameSize, Target *target);
+    // updated is in frame coordinates
+    void endWrite(PipewireStream *stream, const QRegion &updated);
+
+signals:
+    // the image is only valid during the emission; damage in desktop coordinates
+    void FrameReady(QImage *image, const QRegion &damage);
+
+private:
+    struct Output {
+        QRect geometry;
+        // size of the frames, empty before the first one
+        QSize frameSize;
+        // area in the desktop buffer
+        QRect rect;
+        bool valid = false;
+    };
+    // caller holds m_lock for writing
+    void relayout();
+    void emitFrame();
+
+    mutable QReadWriteLock m_lock;
+    QHash<PipewireStream *, Output *> m_outputs;
+    std::vector<uint8_t> m_desktop;
+    QSize m_desktopSize;
+    qint64 m_stride = 0;
+
+    // written by concurrent endWrite() calls
+    QMutex m_damageMutex;
+    QRegion m_damage;
+
+    QTimer *m_timer = nullptr;
+};
+
+#endif // FRAMESTITCHER_H
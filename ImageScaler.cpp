@@ -0,0 +1,387 @@
+#include "ImageScaler.h"
+
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define HAVE_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+// Source positions are 16.16 fixed point at the centre of each destination
+// pixel; the top 7 bits of the fraction weigh the right / lower neighbour.
+// Every kernel blends per channel as (a * (128 - w) + b * w) >> 7, first
+// horizontally, then vertically, which stays within unsigned 16 bit lanes.
+
+typedef void (*RowKernel)(const uint32_t *row0, const uint32_t *row1, int fy,
+                          const int32_t *x0, const int32_t *x1, const int32_t *fx,
+                          uint32_t *dst, int count, bool swapRedBlue);
+
+typedef void (*BoxKernel)(const uint8_t *src, qint64 srcStride, int factor, uint32_t *dst, int count);
+
+static inline uint32_t finishPixel(uint32_t pixel, bool swapRedBlue)
+{
+    if (swapRedBlue) {
+        pixel = (pixel & 0xff00ff00) | ((pixel & 0xff) << 16) | ((pixel >> 16) & 0xff);
+    }
+    return pixel | 0xff000000;
+}
+
+static inline uint32_t blendPixel(uint32_t tl, uint32_t tr, uint32_t bl, uint32_t br, int fx, int fy)
+{
+    uint32_t pixel = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        const uint32_t top = (((tl >> shift) & 0xff) * (128 - fx) + ((tr >> shift) & 0xff) * fx) >> 7;
+        const uint32_t bottom = (((bl >> shift) & 0xff) * (128 - fx) + ((br >> shift) & 0xff) * fx) >> 7;
+        pixel |= ((top * (128 - fy) + bottom * fy) >> 7) << shift;
+    }
+    return pixel;
+}
+
+static void scaleRowScalar(const uint32_t *row0, const uint32_t *row1, int fy,
+                           const int32_t *x0, const int32_t *x1, const int32_t *fx,
+                           uint32_t *dst, int count, bool swapRedBlue)
+{
+    for (int i = 0; i < count; ++i) {
+        const uint32_t pixel = blendPixel(row0[x0[i]], row0[x1[i]], row1[x0[i]], row1[x1[i]], fx[i], fy);
+        dst[i] = finishPixel(pixel, swapRedBlue);
+    }
+}
+
+static void boxRowScalar(const uint8_t *src, qint64 srcStride, int factor, uint32_t *dst, int count)
+{
+    const uint32_t area = factor * factor;
+    for (int i = 0; i < count; ++i) {
+        const uint8_t *block = src + i * factor * 4;
+        uint32_t pixel = 0;
+        for (int c = 0; c < 4; ++c) {
+            uint32_t sum = 0;
+            for (int y = 0; y < factor; ++y) {
+                for (int x = 0; x < factor; ++x) {
+                    sum += block[y * srcStride + x * 4 + c];
+                }
+            }
+            pixel |= ((sum + area / 2) / area) << (c * 8);
+        }
+        dst[i] = pixel;
+    }
+}
+
+#if HAVE_X86_KERNELS
+__attribute__((target("avx2")))
+static inline __m256i lerpAvx2(__m256i a, __m256i b, __m256i weight, __m256i inverse)
+{
+    return _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(a, inverse), _mm256_mullo_epi16(b, weight)), 7);
+}
+
+// eight pixels at a time, the four neighbours are gathered
+__attribute__((target("avx2")))
+static void scaleRowAvx2(const uint32_t *row0, const uint32_t *row1, int fy,
+                         const int32_t *x0, const int32_t *x1, const int32_t *fx,
+                         uint32_t *dst, int count, bool swapRedBlue)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i full = _mm256_set1_epi16(128);
+    const __m256i weightY = _mm256_set1_epi16(fy);
+    const __m256i inverseY = _mm256_sub_epi16(full, weightY);
+    const __m256i alpha = _mm256_set1_epi32(int(0xff000000));
+    const __m256i swapMask = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                              2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    const int *top = reinterpret_cast<const int *>(row0);
+    const int *bottom = reinterpret_cast<const int *>(row1);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i left = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(x0 + i));
+        const __m256i right = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(x1 + i));
+        const __m256i tl = _mm256_i32gather_epi32(top, left, 4);
+        const __m256i tr = _mm256_i32gather_epi32(top, right, 4);
+        const __m256i bl = _mm256_i32gather_epi32(bottom, left, 4);
+        const __m256i br = _mm256_i32gather_epi32(bottom, right, 4);
+
+        // unpacking to 16 bit splits each lane into pixels 0,1 and 2,3;
+        // the weights are spread the same way
+        const __m256i weights = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(fx + i));
+        const __m256i weights16 = _mm256_or_si256(weights, _mm256_slli_epi32(weights, 16));
+        const __m256i weightLow = _mm256_unpacklo_epi32(weights16, weights16);
+        const __m256i weightHigh = _mm256_unpackhi_epi32(weights16, weights16);
+        const __m256i inverseLow = _mm256_sub_epi16(full, weightLow);
+        const __m256i inverseHigh = _mm256_sub_epi16(full, weightHigh);
+
+        const __m256i topLow = lerpAvx2(_mm256_unpacklo_epi8(tl, zero), _mm256_unpacklo_epi8(tr, zero), weightLow, inverseLow);
+        const __m256i bottomLow = lerpAvx2(_mm256_unpacklo_epi8(bl, zero), _mm256_unpacklo_epi8(br, zero), weightLow, inverseLow);
+        const __m256i topHigh = lerpAvx2(_mm256_unpackhi_epi8(tl, zero), _mm256_unpackhi_epi8(tr, zero), weightHigh, inverseHigh);
+        const __m256i bottomHigh = lerpAvx2(_mm256_unpackhi_epi8(bl, zero), _mm256_unpackhi_epi8(br, zero), weightHigh, inverseHigh);
+
+        __m256i pixels = _mm256_packus_epi16(lerpAvx2(topLow, bottomLow, weightY, inverseY),
+                                             lerpAvx2(topHigh, bottomHigh, weightY, inverseY));
+        if (swapRedBlue) {
+            pixels = _mm256_shuffle_epi8(pixels, swapMask);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_or_si256(pixels, alpha));
+    }
+
+    scaleRowScalar(row0, row1, fy, x0 + i, x1 + i, fx + i, dst + i, count - i, swapRedBlue);
+}
+
+// four source pixels of factor rows summed per channel, 16 bit lanes hold
+// pixels 0,1 | 2,3
+__attribute__((target("avx2")))
+static inline __m256i columnSumAvx2(const uint8_t *src, qint64 srcStride, int factor)
+{
+    __m256i sum = _mm256_setzero_si256();
+    for (int y = 0; y < factor; ++y) {
+        sum = _mm256_add_epi16(sum, _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + y * srcStride))));
+    }
+    return sum;
+}
+
+// four destination pixels at a time from 8 or 16 source pixels per row
+__attribute__((target("avx2")))
+static void boxRowAvx2(const uint8_t *src, qint64 srcStride, int factor, uint32_t *dst, int count)
+{
+    int i = 0;
+    if (factor == 2) {
+        const __m256i round = _mm256_set1_epi16(2);
+        for (; i + 4 <= count; i += 4) {
+            const uint8_t *block = src + i * 8;
+            const __m256i a = columnSumAvx2(block, srcStride, 2);
+            const __m256i b = columnSumAvx2(block + 16, srcStride, 2);
+            // neighbours added, pixels in the order 0 2 | 1 3
+            __m256i sum = _mm256_add_epi16(_mm256_unpacklo_epi64(a, b), _mm256_unpackhi_epi64(a, b));
+            sum = _mm256_permute4x64_epi64(sum, _MM_SHUFFLE(3, 1, 2, 0));
+            sum = _mm256_srli_epi16(_mm256_add_epi16(sum, round), 2);
+            const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(sum, sum), _MM_SHUFFLE(3, 1, 2, 0));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm256_castsi256_si128(packed));
+        }
+    } else if (factor == 4) {
+        const __m256i round = _mm256_set1_epi16(8);
+        for (; i + 4 <= count; i += 4) {
+            const uint8_t *block = src + i * 16;
+            const __m256i a = columnSumAvx2(block, srcStride, 4);
+            const __m256i b = columnSumAvx2(block + 16, srcStride, 4);
+            const __m256i c = columnSumAvx2(block + 32, srcStride, 4);
+            const __m256i d = columnSumAvx2(block + 48, srcStride, 4);
+            // pairs 01 45 | 23 67 and 89 CD | AB EF, then the lanes line up
+            const __m256i pairs0 = _mm256_add_epi16(_mm256_unpacklo_epi64(a, b), _mm256_unpackhi_epi64(a, b));
+            const __m256i pairs1 = _mm256_add_epi16(_mm256_unpacklo_epi64(c, d), _mm256_unpackhi_epi64(c, d));
+            __m256i sum = _mm256_add_epi16(_mm256_permute2x128_si256(pairs0, pairs1, 0x20),
+                                           _mm256_permute2x128_si256(pairs0, pairs1, 0x31));
+            sum = _mm256_srli_epi16(_mm256_add_epi16(sum, round), 4);
+            const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(sum, sum), _MM_SHUFFLE(3, 1, 2, 0));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm256_castsi256_si128(packed));
+        }
+    }
+
+    boxRowScalar(src + i * factor * 4, srcStride, factor, dst + i, count - i);
+}
+#endif /* HAVE_X86_KERNELS */
+
+#if HAVE_NEON_KERNELS
+static inline uint16x8_t lerpNeon(uint16x8_t a, uint16x8_t b, uint16x8_t weight, uint16x8_t inverse)
+{
+    return vshrq_n_u16(vaddq_u16(vmulq_u16(a, inverse), vmulq_u16(b, weight)), 7);
+}
+
+static inline uint16x8_t pairWeights(const int32_t *fx)
+{
+    return vcombine_u16(vdup_n_u16(fx[0]), vdup_n_u16(fx[1]));
+}
+
+// four pixels at a time, NEON has no gather so the neighbours are loaded
+// lane by lane
+static void scaleRowNeon(const uint32_t *row0, const uint32_t *row1, int fy,
+                         const int32_t *x0, const int32_t *x1, const int32_t *fx,
+                         uint32_t *dst, int count, bool swapRedBlue)
+{
+    const uint16x8_t full = vdupq_n_u16(128);
+    const uint16x8_t weightY = vdupq_n_u16(fy);
+    const uint16x8_t inverseY = vsubq_u16(full, weightY);
+
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        uint32x4_t tl = vdupq_n_u32(0), tr = tl, bl = tl, br = tl;
+        tl = vld1q_lane_u32(row0 + x0[i], tl, 0);
+        tl = vld1q_lane_u32(row0 + x0[i + 1], tl, 1);
+        tl = vld1q_lane_u32(row0 + x0[i + 2], tl, 2);
+        tl = vld1q_lane_u32(row0 + x0[i + 3], tl, 3);
+        tr = vld1q_lane_u32(row0 + x1[i], tr, 0);
+        tr = vld1q_lane_u32(row0 + x1[i + 1], tr, 1);
+        tr = vld1q_lane_u32(row0 + x1[i + 2], tr, 2);
+        tr = vld1q_lane_u32(row0 + x1[i + 3], tr, 3);
+        bl = vld1q_lane_u32(row1 + x0[i], bl, 0);
+        bl = vld1q_lane_u32(row1 + x0[i + 1], bl, 1);
+        bl = vld1q_lane_u32(row1 + x0[i + 2], bl, 2);
+        bl = vld1q_lane_u32(row1 + x0[i + 3], bl, 3);
+        br = vld1q_lane_u32(row1 + x1[i], br, 0);
+        br = vld1q_lane_u32(row1 + x1[i + 1], br, 1);
+        br = vld1q_lane_u32(row1 + x1[i + 2], br, 2);
+        br = vld1q_lane_u32(row1 + x1[i + 3], br, 3);
+
+        const uint16x8_t weightLow = pairWeights(fx + i);
+        const uint16x8_t weightHigh = pairWeights(fx + i + 2);
+        const uint16x8_t inverseLow = vsubq_u16(full, weightLow);
+        const uint16x8_t inverseHigh = vsubq_u16(full, weightHigh);
+
+        const uint8x16_t tl8 = vreinterpretq_u8_u32(tl);
+        const uint8x16_t tr8 = vreinterpretq_u8_u32(tr);
+        const uint8x16_t bl8 = vreinterpretq_u8_u32(bl);
+        const uint8x16_t br8 = vreinterpretq_u8_u32(br);
+
+        const uint16x8_t topLow = lerpNeon(vmovl_u8(vget_low_u8(tl8)), vmovl_u8(vget_low_u8(tr8)), weightLow, inverseLow);
+        const uint16x8_t bottomLow = lerpNeon(vmovl_u8(vget_low_u8(bl8)), vmovl_u8(vget_low_u8(br8)), weightLow, inverseLow);
+        const uint16x8_t topHigh = lerpNeon(vmovl_u8(vget_high_u8(tl8)), vmovl_u8(vget_high_u8(tr8)), weightHigh, inverseHigh);
+        const uint16x8_t bottomHigh = lerpNeon(vmovl_u8(vget_high_u8(bl8)), vmovl_u8(vget_high_u8(br8)), weightHigh, inverseHigh);
+
+        uint32x4_t pixels = vreinterpretq_u32_u8(vcombine_u8(vmovn_u16(lerpNeon(topLow, bottomLow, weightY, inverseY)),
+                                                             vmovn_u16(lerpNeon(topHigh, bottomHigh, weightY, inverseY))));
+        if (swapRedBlue) {
+            pixels = vorrq_u32(vandq_u32(pixels, vdupq_n_u32(0xff00ff00)),
+                               vorrq_u32(vshlq_n_u32(vandq_u32(pixels, vdupq_n_u32(0xff)), 16),
+                                         vandq_u32(vshrq_n_u32(pixels, 16), vdupq_n_u32(0xff))));
+        }
+        vst1q_u32(dst + i, vorrq_u32(pixels, vdupq_n_u32(0xff000000)));
+    }
+
+    scaleRowScalar(row0, row1, fy, x0 + i, x1 + i, fx + i, dst + i, count - i, swapRedBlue);
+}
+
+// four destination pixels at a time; vld2/vld4 split the source pixels by
+// their position in the block, so the block sums are plain lane adds
+static void boxRowNeon(const uint8_t *src, qint64 srcStride, int factor, uint32_t *dst, int count)
+{
+    int i = 0;
+    if (factor == 2) {
+        for (; i + 4 <= count; i += 4) {
+            uint16x8_t low = vdupq_n_u16(0);
+            uint16x8_t high = vdupq_n_u16(0);
+            for (int y = 0; y < 2; ++y) {
+                const uint32x4x2_t block = vld2q_u32(reinterpret_cast<const uint32_t *>(src + y * srcStride + i * 8));
+                for (int x = 0; x < 2; ++x) {
+                    const uint8x16_t pixels = vreinterpretq_u8_u32(block.val[x]);
+                    low = vaddw_u8(low, vget_low_u8(pixels));
+                    high = vaddw_u8(high, vget_high_u8(pixels));
+                }
+            }
+            vst1q_u8(reinterpret_cast<uint8_t *>(dst + i), vcombine_u8(vrshrn_n_u16(low, 2), vrshrn_n_u16(high, 2)));
+        }
+    } else if (factor == 4) {
+        for (; i + 4 <= count; i += 4) {
+            uint16x8_t low = vdupq_n_u16(0);
+            uint16x8_t high = vdupq_n_u16(0);
+            for (int y = 0; y < 4; ++y) {
+                const uint32x4x4_t block = vld4q_u32(reinterpret_cast<const uint32_t *>(src + y * srcStride + i * 16));
+                for (int x = 0; x < 4; ++x) {
+                    const uint8x16_t pixels = vreinterpretq_u8_u32(block.val[x]);
+                    low = vaddw_u8(low, vget_low_u8(pixels));
+                    high = vaddw_u8(high, vget_high_u8(pixels));
+                }
+            }
+            vst1q_u8(reinterpret_cast<uint8_t *>(dst + i), vcombine_u8(vrshrn_n_u16(low, 4), vrshrn_n_u16(high, 4)));
+        }
+    }
+
+    boxRowScalar(src + i * factor * 4, srcStride, factor, dst + i, count - i);
+}
+#endif /* HAVE_NEON_KERNELS */
+
+static RowKernel selectRowKernel()
+{
+#if HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx2")) {
+        return scaleRowAvx2;
+    }
+#endif /* HAVE_X86_KERNELS */
+#if HAVE_NEON_KERNELS
+    return scaleRowNeon;
+#endif /* HAVE_NEON_KERNELS */
+    return scaleRowScalar;
+}
+
+static BoxKernel selectBoxKernel()
+{
+#if HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx2")) {
+        return boxRowAvx2;
+    }
+#endif /* HAVE_X86_KERNELS */
+#if HAVE_NEON_KERNELS
+    return boxRowNeon;
+#endif /* HAVE_NEON_KERNELS */
+    return boxRowScalar;
+}
+
+static void scaleWith(RowKernel kernel, const uint8_t *src, qint64 srcStride, const QSize &srcSize, bool swapRedBlue,
+                      uint8_t *dst, qint64 dstStride, const QSize &dstSize, const QRect &dstRect)
+{
+    const QRect rect = dstRect & QRect(QPoint(0, 0), dstSize);
+    if (rect.isEmpty() || srcSize.isEmpty()) {
+        return;
+    }
+
+    // the same columns are sampled on every row
+    std::vector<int32_t> x0(rect.width());
+    std::vector<int32_t> x1(rect.width());
+    std::vector<int32_t> fx(rect.width());
+    for (int i = 0; i < rect.width(); ++i) {
+        const int32_t position = ImageScaler::sourcePosition(rect.x() + i, srcSize.width(), dstSize.width());
+        x0[i] = position >> 16;
+        x1[i] = qMin(x0[i] + 1, srcSize.width() - 1);
+        fx[i] = (position >> 9) & 0x7f;
+    }
+
+    for (int y = rect.top(); y <= rect.bottom(); ++y) {
+        const int32_t position = ImageScaler::sourcePosition(y, srcSize.height(), dstSize.height());
+        const int y0 = position >> 16;
+        const int y1 = qMin(y0 + 1, srcSize.height() - 1);
+        kernel(reinterpret_cast<const uint32_t *>(src + y0 * srcStride),
+               reinterpret_cast<const uint32_t *>(src + y1 * srcStride),
+               (position >> 9) & 0x7f, x0.data(), x1.data(), fx.data(),
+               reinterpret_cast<uint32_t *>(dst + y * dstStride) + rect.x(), rect.width(), swapRedBlue);
+    }
+}
+
+static void boxDownscaleWith(BoxKernel kernel, const uint8_t *src, qint64 srcStride, int factor,
+                             uint8_t *dst, qint64 dstStride, const QRect &dstRect)
+{
+    for (int y = dstRect.top(); y <= dstRect.bottom(); ++y) {
+        kernel(src + qint64(y) * factor * srcStride + qint64(dstRect.x()) * factor * 4, srcStride, factor,
+               reinterpret_cast<uint32_t *>(dst + y * dstStride) + dstRect.x(), dstRect.width());
+    }
+}
+
+int32_t ImageScaler::sourcePosition(int d, int srcLength, int dstLength)
+{
+    const qint64 step = (qint64(srcLength) << 16) / dstLength;
+    const qint64 position = d * step + step / 2 - 0x8000;
+    return int32_t(qBound<qint64>(0, position, qint64(srcLength - 1) << 16));
+}
+
+void ImageScaler::scale(const uint8_t *src, qint64 srcStride, const QSize &srcSize, bool swapRedBlue,
+                        uint8_t *dst, qint64 dstStride, const QSize &dstSize, const QRect &dstRect)
+{
+    static const RowKernel kernel = selectRowKernel();
+    scaleWith(kernel, src, srcStride, srcSize, swapRedBlue, dst, dstStride, dstSize, dstRect);
+}
+
+void ImageScaler::scaleScalar(const uint8_t *src, qint64 srcStride, const QSize &srcSize, bool swapRedBlue,
+                              uint8_t *dst, qint64 dstStride, const QSize &dstSize, const QRect &dstRect)
+{
+    scaleWith(scaleRowScalar, src, srcStride, srcSize, swapRedBlue, dst, dstStride, dstSize, dstRect);
+}
+
+void ImageScaler::boxDownscale(const uint8_t *src, qint64 srcStride, int factor,
+                               uint8_t *dst, qint64 dstStride, const QRect &dstRect)
+{
+    // 16 bit sums in the SIMD kernels
+    static const BoxKernel kernel = selectBoxKernel();
+    boxDownscaleWith(factor == 2 || factor == 4 ? kernel : boxRowScalar, src, srcStride, factor, dst, dstStride, dstRect);
+}
+
+void ImageScaler::boxDownscaleScalar(const uint8_t *src, qint64 srcStride, int factor,
+                                     uint8_t *dst, qint64 dstStride, const QRect &dstRect)
+{
+    boxDownscaleWith(boxRowScalar, src, srcStride, factor, dst, dstStride, dstRect);
+}
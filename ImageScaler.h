@@ -0,0 +1,36 @@
+#ifndef IMAGESCALER_H
+#define IMAGESCALER_H
+
+#include <QRect>
+#include <QSize>
+
+// Scaling of 32 bit frames: bilinear at any size, for the preview, and box
+// averages at integer factors, for FramePyramid. Only the pixels inside
+// dstRect are computed, so a damaged part can be redrawn alone. Bilinear
+// weights have 7 bits; the AVX2/NEON kernels compute the same pixels as
+// the scalar ones.
+class ImageScaler
+{
+public:
+    // Scale a srcSize frame at src onto a dstSize surface at dst.
+    // swapRedBlue reads R, G, B, x sources, otherwise B, G, R, x as in
+    // ARGB32; the alpha byte is set opaque.
+    static void scale(const uint8_t *src, qint64 srcStride, const QSize &srcSize, bool swapRedBlue,
+                      uint8_t *dst, qint64 dstStride, const QSize &dstSize, const QRect &dstRect);
+    static void scaleScalar(const uint8_t *src, qint64 srcStride, const QSize &srcSize, bool swapRedBlue,
+                            uint8_t *dst, qint64 dstStride, const QSize &dstSize, const QRect &dstRect);
+
+    // 16.16 source position sampled for destination pixel d; the pixel
+    // reads source pixels pos >> 16 and the one after it, when there is one
+    static int32_t sourcePosition(int d, int srcLength, int dstLength);
+
+    // Average factor x factor blocks, destination pixel (x, y) covers the
+    // source from (x, y) * factor. All four bytes are averaged, rounding
+    // to nearest; factors 2 and 4 have SIMD kernels.
+    static void boxDownscale(const uint8_t *src, qint64 srcStride, int factor,
+                             uint8_t *dst, qint64 dstStride, const QRect &dstRect);
+    static void boxDownscaleScalar(const uint8_t *src, qint64 srcStride, int factor,
+                                   uint8_t *dst, qint64 dstStride, const QRect &dstRect);
+};
+
+#endif // IMAGESCALER_H
@@ -0,0 +1,926 @@
+#include "MicroBench.h"
+
+#include <QByteArray>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QImage>
+#include <QRect>
+#include <QVector>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include <epoxy/egl.h>
+#include <epoxy/gl.h>
+
+#include "BandPool.h"
+#include "DmaBufImage.h"
+#include "FrameConverter.h"
+#include "FramePool.h"
+#include "FramePyramid.h"
+#include "FrameRingReader.h"
+#include "FrameRingWriter.h"
+#include "ImageScaler.h"
+#include "PboReadback.h"
+#include "StreamStats.h"
+#include "TileHasher.h"
+#include "YuvConverter.h"
+
+namespace {
+
+const spa_video_format packedFormats[] = {SPA_VIDEO_FORMAT_RGBx, SPA_VIDEO_FORMAT_RGBA, SPA_VIDEO_FORMAT_BGRx,
+                                          SPA_VIDEO_FORMAT_BGRA, SPA_VIDEO_FORMAT_RGB, SPA_VIDEO_FORMAT_BGR};
+
+const FrameConverter::Isa simdIsas[] = {FrameConverter::SSSE3, FrameConverter::AVX2, FrameConverter::NEON};
+
+// CLOCK_MONOTONIC in ns, the clock PipeWire timestamps are taken from
+qint64 now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// the same noise on every run
+void fillNoise(std::vector<uint8_t> &buffer, uint32_t seed)
+{
+    for (uint8_t &byte : buffer) {
+        seed = seed * 1664525 + 1013904223;
+        byte = seed >> 24;
+    }
+}
+
+double megapixelsPerSecond(qint64 pixels, qint64 ns)
+{
+    return ns > 0 ? pixels * 1000.0 / ns : 0;
+}
+
+// index of the first differing byte, -1 when there is none
+qint64 firstDifference(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b)
+{
+    if (std::memcmp(a.data(), b.data(), a.size()) == 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (a[i] != b[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+} // namespace
+
+bool MicroBench::converters(const QSize &size, int frames)
+{
+    const QRect frameRect(QPoint(0, 0), size);
+    bool ok = true;
+
+    for (spa_video_format format : packedFormats) {
+        const int bpp = FrameConverter::bytesPerPixel(format);
+        // source rows are padded like PipeWire's, the destination is packed
+        const qint64 srcStride = (qint64(size.width()) * bpp + 63) & ~63;
+        const qint64 dstStride = qint64(size.width()) * bpp;
+        std::vector<uint8_t> src(srcStride * size.height());
+        fillNoise(src, format);
+
+        // the whole frame, a crop at odd offsets and every width up to a
+        // few SIMD blocks, so each kernel's tail handling runs too
+        QVector<QRect> crops = {frameRect, QRect(3, 1, size.width() - 7, size.height() - 2)};
+        for (int width = 1; width <= 67; ++width) {
+            crops.append(QRect(width % 5, width % 3, width, 3) & frameRect);
+        }
+
+        for (FrameConverter::Isa isa : simdIsas) {
+            if (!FrameConverter::isSupported(isa)) {
+                continue;
+            }
+            const FrameConverter reference(format, FrameConverter::Scalar);
+            const FrameConverter converter(format, isa);
+
+            std::vector<uint8_t> expected(dstStride * size.height());
+            std::vector<uint8_t> actual(expected.size());
+            for (const QRect &crop : qAsConst(crops)) {
+                if (crop.isEmpty()) {
+                    continue;
+                }
+                // bytes outside the crop must stay as they were, so overruns
+                // show up as a difference too; the crops overlap, a pixel a
+                // kernel skips could still hold the one of an earlier crop
+                std::memset(expected.data(), 0xcd, expected.size());
+                std::memset(actual.data(), 0xcd, actual.size());
+                const uint8_t *from = src.data() + crop.y() * srcStride + crop.x() * bpp;
+                const qint64 to = crop.y() * dstStride + crop.x() * bpp;
+                reference.convert(from, srcStride, expected.data() + to, dstStride, crop.width(), crop.height());
+                converter.convert(from, srcStride, actual.data() + to, dstStride, crop.width(), crop.height());
+
+                const qint64 difference = firstDifference(expected, actual);
+                if (difference >= 0) {
+                    qWarning() << "convert" << FrameConverter::formatName(format) << FrameConverter::isaName(isa)
+                               << "differs from scalar for crop" << crop << "at byte" << difference;
+                    ok = false;
+                    break;
+                }
+            }
+        }
+
+        for (FrameConverter::Isa isa : {FrameConverter::Scalar, FrameConverter::SSSE3, FrameConverter::AVX2, FrameConverter::NEON}) {
+            if (!FrameConverter::isSupported(isa)) {
+                continue;
+            }
+            const FrameConverter converter(format, isa);
+            std::vector<uint8_t> dst(dstStride * size.height());
+            converter.convert(src.data(), srcStride, dst.data(), dstStride, size.width(), size.height());
+
+            const qint64 start = now();
+            for (int i = 0; i < frames; ++i) {
+                converter.convert(src.data(), srcStride, dst.data(), dstStride, size.width(), size.height());
+            }
+            const qint64 elapsed = (now() - start) / qMax(1, frames);
+            qInfo().noquote() << QStringLiteral("convert %1 %2 %3x%4: %5 us/frame %6 MP/s")
+                                     .arg(QLatin1String(FrameConverter::formatName(format)), QLatin1String(FrameConverter::isaName(isa)))
+                                     .arg(size.width()).arg(size.height())
+                                     .arg(elapsed / 1000.0, 0, 'f', 1)
+                                     .arg(megapixelsPerSecond(qint64(size.width()) * size.height(), elapsed), 0, 'f', 0);
+        }
+    }
+
+    qInfo() << "convert kernels" << (ok ? "match" : "differ from") << "the scalar reference";
+    return ok;
+}
+
+bool MicroBench::readback(const QSize &size, int frames)
+{
+    EGLDisplay display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr) || !eglBindAPI(EGL_OPENGL_API)) {
+        qWarning() << "No surfaceless EGL display for the readback benchmark";
+        return false;
+    }
+    EGLContext context = eglCreateContext(display, nullptr, EGL_NO_CONTEXT, nullptr);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        qWarning() << "Couldn't create an EGL context for the readback benchmark";
+        eglTerminate(display);
+        return false;
+    }
+    qInfo() << "readback on" << reinterpret_cast<const char *>(glGetString(GL_RENDERER));
+
+    const qint64 stride = qint64(size.width()) * 4;
+    std::vector<uint8_t> pixels(stride * size.height());
+    fillNoise(pixels, 1);
+    GLuint texture = 0;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size.width(), size.height(), 0, GL_BGRA, GL_UNSIGNED_BYTE, pixels.data());
+
+    bool ok = true;
+    std::vector<uint8_t> frame(pixels.size());
+    for (int depth = 1; depth <= 4; ++depth) {
+        PboReadback readback;
+        readback.setDepth(depth);
+        QVector<qint64> started(frames);
+        int delivered = 0;
+        LatencyHistogram latency;
+
+        // like PipewireStream::handleFrame, with processFrame as a copy
+        auto deliver = [&] {
+            PboReadback::Frame done;
+            const uint8_t *data = readback.mapOldest(&done);
+            if (data) {
+                std::memcpy(frame.data(), data, frame.size());
+                latency.record(now() - started[delivered]);
+            } else {
+                ok = false;
+            }
+            readback.finishOldest();
+            ++delivered;
+        };
+
+        const qint64 start = now();
+        for (int i = 0; i < frames; ++i) {
+            PboReadback::Frame pending;
+            pending.stride = stride;
+            started[i] = now();
+            readback.start(texture, GL_BGRA, pending, size.height());
+            while (readback.pending() && readback.oldestReady()) {
+                deliver();
+            }
+            if (readback.isFull()) {
+                deliver();
+            }
+        }
+        while (readback.pending()) {
+            deliver();
+        }
+        const qint64 elapsed = now() - start;
+        readback.reset();
+
+        qInfo().noquote() << QStringLiteral("readback %1x%2 depth=%3: %4 frames/s latency mean=%5 p50=%6 p99=%7 max=%8 us")
+                                 .arg(size.width()).arg(size.height()).arg(depth)
+                                 .arg(elapsed > 0 ? frames * 1e9 / elapsed : 0, 0, 'f', 1)
+                                 .arg(latency.mean() / 1000).arg(latency.percentile(50) / 1000)
+                                 .arg(latency.percentile(99) / 1000).arg(latency.max() / 1000);
+    }
+
+    // the copied frame has to be the texture
+    if (std::memcmp(frame.data(), pixels.data(), frame.size()) != 0) {
+        qWarning() << "readback differs from the uploaded texture";
+        ok = false;
+    }
+
+    glDeleteTextures(1, &texture);
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(display, context);
+    eglTerminate(display);
+    return ok;
+}
+
+bool MicroBench::dmaBufImport(const QSize &size, int frames)
+{
+    EGLDisplay display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr) || !eglBindAPI(EGL_OPENGL_API)) {
+        qWarning() << "No surfaceless EGL display for the DMA-BUF import check";
+        return false;
+    }
+    // the DMA-BUF is exported from a texture, no compositor needed
+    const QByteArray extensions(eglQueryString(display, EGL_EXTENSIONS));
+    if (!extensions.contains("EGL_EXT_image_dma_buf_import") || !extensions.contains("EGL_MESA_image_dma_buf_export")) {
+        qWarning() << "The EGL display can't export and import DMA-BUFs";
+        eglTerminate(display);
+        return false;
+    }
+    EGLContext context = eglCreateContext(display, nullptr, EGL_NO_CONTEXT, nullptr);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        qWarning() << "Couldn't create an EGL context for the DMA-BUF import check";
+        eglTerminate(display);
+        return false;
+    }
+    qInfo() << "DMA-BUF import on" << reinterpret_cast<const char *>(glGetString(GL_RENDERER));
+
+    const qint64 stride = qint64(size.width()) * 4;
+    std::vector<uint8_t> pixels(stride * size.height());
+    fillNoise(pixels, 2);
+    GLuint source = 0;
+    glGenTextures(1, &source);
+    glBindTexture(GL_TEXTURE_2D, source);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size.width(), size.height(), 0, GL_BGRA, GL_UNSIGNED_BYTE, pixels.data());
+
+    int fourcc = 0;
+    int planeCount = 0;
+    EGLuint64KHR modifier = DRM_FORMAT_MOD_INVALID;
+    int fds[4] = {-1, -1, -1, -1};
+    EGLint strides[4] = {};
+    EGLint offsets[4] = {};
+    EGLImageKHR exported = eglCreateImageKHR(display, context, EGL_GL_TEXTURE_2D_KHR,
+                                             reinterpret_cast<EGLClientBuffer>(quintptr(source)), nullptr);
+    bool ok = exported != EGL_NO_IMAGE_KHR
+              && eglExportDMABUFImageQueryMESA(display, exported, &fourcc, &planeCount, &modifier)
+              && planeCount >= 1 && planeCount <= 4
+              && eglExportDMABUFImageMESA(display, exported, fds, strides, offsets);
+    if (!ok) {
+        qWarning() << "Couldn't export a texture as DMA-BUF";
+    }
+
+    DmaBufImage::Plane planes[4];
+    for (int i = 0; i < planeCount && i < 4; ++i) {
+        planes[i].fd = fds[i];
+        planes[i].offset = uint32_t(offsets[i]);
+        planes[i].stride = uint32_t(strides[i]);
+    }
+
+    // imported and read back like PipewireStream::importDmaBuf and
+    // completeReadback; false when the driver refuses the modifier
+    GLuint texture = 0;
+    glGenTextures(1, &texture);
+    PboReadback readback;
+    readback.setDepth(1);
+    auto importAndRead = [&](uint64_t importModifier, std::vector<uint8_t> *frame) {
+        EGLImageKHR image = DmaBufImage::create(display, size, uint32_t(fourcc), importModifier, planes, planeCount);
+        if (image == EGL_NO_IMAGE_KHR) {
+            return false;
+        }
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+        PboReadback::Frame pending;
+        pending.stride = stride;
+        readback.start(texture, GL_BGRA, pending, size.height());
+        PboReadback::Frame done;
+        const uint8_t *data = readback.mapOldest(&done);
+        if (data) {
+            std::memcpy(frame->data(), data, frame->size());
+        }
+        readback.finishOldest();
+        eglDestroyImageKHR(display, image);
+        return data != nullptr;
+    };
+
+    std::vector<uint8_t> frame(pixels.size());
+    if (ok && !importAndRead(modifier, &frame)) {
+        qWarning() << "Import with the exported modifier" << QString::number(modifier, 16) << "failed";
+        ok = false;
+    } else if (ok && std::memcmp(frame.data(), pixels.data(), frame.size()) != 0) {
+        qWarning() << "The imported DMA-BUF differs from the exported texture";
+        ok = false;
+    }
+
+    // a modifier nobody allocates has to fail, that is what makes the
+    // stream drop a modifier and renegotiate
+    const uint64_t unknownModifier = fourcc_mod_code(NONE, 0xdead);
+    if (ok && extensions.contains("EGL_EXT_image_dma_buf_import_modifiers") && importAndRead(unknownModifier, &frame)) {
+        qWarning() << "Import with the unknown modifier" << QString::number(unknownModifier, 16) << "succeeded";
+        ok = false;
+    }
+
+    // what a new buffer costs before the import cache holds it
+    if (ok) {
+        const qint64 start = now();
+        for (int i = 0; i < frames; ++i) {
+            EGLImageKHR image = DmaBufImage::create(display, size, uint32_t(fourcc), modifier, planes, planeCount);
+            glBindTexture(GL_TEXTURE_2D, texture);
+            glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+            eglDestroyImageKHR(display, image);
+        }
+        glFinish();
+        const qint64 elapsed = now() - start;
+        qInfo().noquote() << QStringLiteral("DMA-BUF import %1x%2 fourcc=%3 modifier=%4 planes=%5: %6 us/import")
+                                 .arg(size.width()).arg(size.height())
+                                 .arg(uint32_t(fourcc), 8, 16, QLatin1Char('0')).arg(QString::number(modifier, 16)).arg(planeCount)
+                                 .arg(elapsed / 1000.0 / qMax(1, frames), 0, 'f', 1);
+    }
+
+    readback.reset();
+    for (int fd : fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (exported != EGL_NO_IMAGE_KHR) {
+        eglDestroyImageKHR(display, exported);
+    }
+    glDeleteTextures(1, &texture);
+    glDeleteTextures(1, &source);
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(display, context);
+    eglTerminate(display);
+
+    qInfo() << "DMA-BUF import" << (ok ? "matches" : "differs from") << "the exported texture";
+    return ok;
+}
+
+bool MicroBench::tileHash(const QSize &size, int frames)
+{
+    const int bpp = 4;
+    const qint64 stride = (qint64(size.width()) * bpp + 63) & ~63;
+    const QRect frameRect(QPoint(0, 0), size);
+    bool ok = true;
+
+    // every row length up to a few stripes past a whole tile, for the tails
+    std::vector<uint8_t> tile(qint64(TileHasher::TILE_SIZE + 2) * 4 * TileHasher::TILE_SIZE);
+    fillNoise(tile, 9);
+    for (int rowBytes = 1; rowBytes <= (TileHasher::TILE_SIZE + 2) * 4 && ok; ++rowBytes) {
+        for (int rows : {1, 3, TileHasher::TILE_SIZE}) {
+            const qint64 tileStride = (TileHasher::TILE_SIZE + 2) * 4;
+            if (TileHasher::hashTile(tile.data(), tileStride, rowBytes, rows)
+                != TileHasher::hashTileScalar(tile.data(), tileStride, rowBytes, rows)) {
+                qWarning() << "tile hash differs from scalar for" << rowBytes << "bytes x" << rows << "rows";
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    // a changed byte has to show up as exactly its tile
+    std::vector<uint8_t> first(stride * size.height());
+    fillNoise(first, 10);
+    std::vector<uint8_t> second = first;
+    const QPoint changedPixel(size.width() * 2 / 3, size.height() / 3);
+    second[changedPixel.y() * stride + changedPixel.x() * bpp + 1] ^= 1;
+    const QRect changedTile = QRect(changedPixel.x() / TileHasher::TILE_SIZE * TileHasher::TILE_SIZE,
+                                    changedPixel.y() / TileHasher::TILE_SIZE * TileHasher::TILE_SIZE,
+                                    TileHasher::TILE_SIZE, TileHasher::TILE_SIZE) & frameRect;
+    TileHasher hasher;
+    hasher.resize(size);
+    hasher.update(first.data(), stride, size, bpp);
+    const QRegion changed = hasher.update(second.data(), stride, size, bpp);
+    if (changed != QRegion(changedTile)) {
+        qWarning() << "tile hash reported" << changed << "instead of" << changedTile;
+        ok = false;
+    }
+
+    // a block moved by one stripe (8 pixels) over a flat background has
+    // to change its tile, however the stripes of a row are summed up
+    const QRect movedTile = QRect(0, 0, TileHasher::TILE_SIZE, TileHasher::TILE_SIZE) & frameRect;
+    if (movedTile.width() >= 32 && movedTile.height() >= 32) {
+        auto drawBlock = [&](std::vector<uint8_t> &frame, int blockX) {
+            for (int y = movedTile.top(); y <= movedTile.bottom(); ++y) {
+                uint8_t *row = frame.data() + y * stride;
+                std::memset(row, 0x20, movedTile.width() * bpp);
+                if (y >= 16 && y < 32) {
+                    std::memset(row + blockX * bpp, 0xff, 16 * bpp);
+                }
+            }
+        };
+        std::vector<uint8_t> before = first;
+        std::vector<uint8_t> after = first;
+        drawBlock(before, 8);
+        drawBlock(after, 16);
+        hasher.invalidate();
+        hasher.update(before.data(), stride, size, bpp);
+        const QRegion moved = hasher.update(after.data(), stride, size, bpp);
+        if (moved != QRegion(movedTile)) {
+            qWarning() << "tile hash reported" << moved << "for a block moved by 8 pixels in" << movedTile;
+            ok = false;
+        }
+    }
+
+    // mostly static: a 32x32 block blinking like a text cursor; fully
+    // changing: two unrelated frames in turn, like a video
+    std::vector<uint8_t> blinking = first;
+    const QRect block = QRect(size.width() / 2, size.height() / 2, 32, 32) & frameRect;
+    for (int y = block.top(); y <= block.bottom(); ++y) {
+        std::memset(blinking.data() + y * stride + block.x() * bpp, 0xff, block.width() * bpp);
+    }
+    std::vector<uint8_t> other(first.size());
+    fillNoise(other, 11);
+
+    const FrameConverter converter(SPA_VIDEO_FORMAT_BGRx);
+    const qint64 dstStride = qint64(size.width()) * bpp;
+    std::vector<uint8_t> dst(dstStride * size.height());
+    const qint64 tiles = qint64((size.width() + TileHasher::TILE_SIZE - 1) / TileHasher::TILE_SIZE)
+                         * ((size.height() + TileHasher::TILE_SIZE - 1) / TileHasher::TILE_SIZE);
+
+    qint64 start = now();
+    for (int i = 0; i < frames; ++i) {
+        converter.convert(first.data(), stride, dst.data(), dstStride, size.width(), size.height());
+    }
+    const qint64 full = (now() - start) / qMax(1, frames);
+    qInfo().noquote() << QStringLiteral("tile hash %1x%2: full convert %3 us/frame")
+                             .arg(size.width()).arg(size.height()).arg(full / 1000.0, 0, 'f', 1);
+
+    const std::pair<const char *, const std::vector<uint8_t> *> sequences[] = {{"static", &blinking}, {"dynamic", &other}};
+    for (const auto &sequence : sequences) {
+        hasher.invalidate();
+        hasher.update(first.data(), stride, size, bpp);
+        qint64 hashing = 0;
+        qint64 changedTiles = 0;
+        start = now();
+        for (int i = 0; i < frames; ++i) {
+            const uint8_t *src = i % 2 ? first.data() : sequence.second->data();
+            const qint64 hashStart = now();
+            const QRegion updated = hasher.update(src, stride, size, bpp);
+            hashing += now() - hashStart;
+            for (const QRect &rect : updated) {
+                changedTiles += qint64(rect.width() + TileHasher::TILE_SIZE - 1) / TileHasher::TILE_SIZE
+                                * ((rect.height() + TileHasher::TILE_SIZE - 1) / TileHasher::TILE_SIZE);
+                converter.convert(src + rect.y() * stride + rect.x() * bpp, stride,
+                                  dst.data() + rect.y() * dstStride + rect.x() * bpp, dstStride, rect.width(), rect.height());
+            }
+        }
+        const qint64 elapsed = (now() - start) / qMax(1, frames);
+        qInfo().noquote() << QStringLiteral("tile hash %1x%2 %3: hash %4 us/frame, hash+convert %5 us/frame, "
+                                            "%6% of tiles changed")
+                                 .arg(size.width()).arg(size.height()).arg(QLatin1String(sequence.first))
+                                 .arg(hashing / qMax(1, frames) / 1000.0, 0, 'f', 1)
+                                 .arg(elapsed / 1000.0, 0, 'f', 1)
+                                 .arg(tiles > 0 ? changedTiles * 100.0 / (tiles * qMax(1, frames)) : 0, 0, 'f', 1);
+    }
+
+    qInfo() << "tile hash" << (ok ? "matches" : "differs from") << "the scalar reference";
+    return ok;
+}
+
+bool MicroBench::bandPool(const QSize &size, int frames, int maxThreads)
+{
+    const int bpp = 4;
+    const int bandHeight = 64;
+    const qint64 srcStride = (qint64(size.width()) * bpp + 63) & ~63;
+    const qint64 dstStride = qint64(size.width()) * bpp;
+    std::vector<uint8_t> src(srcStride * size.height());
+    fillNoise(src, 12);
+
+    const FrameConverter converter(SPA_VIDEO_FORMAT_BGRx);
+    std::vector<uint8_t> expected(dstStride * size.height());
+    converter.convert(src.data(), srcStride, expected.data(), dstStride, size.width(), size.height());
+
+    bool ok = true;
+    qint64 single = 0;
+    std::vector<uint8_t> dst(expected.size());
+    for (int threads = 1; threads <= qMax(1, maxThreads); ++threads) {
+        // the caller converts bands too, like PipewireStream's conversionThreads
+        BandPool pool(threads - 1);
+        auto convertBand = [&](int y, int rows) {
+            converter.convert(src.data() + y * srcStride, srcStride, dst.data() + y * dstStride, dstStride, size.width(), rows);
+        };
+
+        std::memset(dst.data(), 0xcd, dst.size());
+        pool.run(size.height(), bandHeight, convertBand);
+        if (firstDifference(expected, dst) >= 0) {
+            qWarning() << "band conversion with" << threads << "threads differs from converting in one pass";
+            ok = false;
+        }
+
+        const qint64 start = now();
+        for (int i = 0; i < frames; ++i) {
+            pool.run(size.height(), bandHeight, convertBand);
+        }
+        const qint64 elapsed = (now() - start) / qMax(1, frames);
+        if (threads == 1) {
+            single = elapsed;
+        }
+        qInfo().noquote() << QStringLiteral("band pool %1x%2 threads=%3: %4 us/frame %5 MP/s speedup %6x")
+                                 .arg(size.width()).arg(size.height()).arg(threads)
+                                 .arg(elapsed / 1000.0, 0, 'f', 1)
+                                 .arg(megapixelsPerSecond(qint64(size.width()) * size.height(), elapsed), 0, 'f', 0)
+                                 .arg(elapsed > 0 ? double(single) / elapsed : 0, 0, 'f', 2);
+    }
+
+    qInfo() << "band conversion" << (ok ? "matches" : "differs from") << "the single threaded one";
+    return ok;
+}
+
+bool MicroBench::yuv(const QSize &size, int frames)
+{
+    const QRect frameRect(QPoint(0, 0), size);
+    bool ok = true;
+
+    // the whole frame, an odd sized crop at odd offsets and every width up
+    // to a few SIMD blocks on odd row counts
+    QVector<QRect> crops = {frameRect, QRect(3, 1, (size.width() - 5) | 1, (size.height() - 3) | 1) & frameRect};
+    for (int width = 1; width <= 67; ++width) {
+        crops.append(QRect(width % 5, width % 3, width, 3 - width % 2) & frameRect);
+    }
+
+    for (spa_video_format format : packedFormats) {
+        const int bpp = FrameConverter::bytesPerPixel(format);
+        const qint64 srcStride = (qint64(size.width()) * bpp + 63) & ~63;
+        std::vector<uint8_t> src(srcStride * size.height());
+        fillNoise(src, format);
+
+        for (YuvConverter::Layout layout : {YuvConverter::I420, YuvConverter::NV12}) {
+            for (YuvConverter::Matrix matrix : {YuvConverter::BT601, YuvConverter::BT709}) {
+                for (YuvConverter::Range range : {YuvConverter::LimitedRange, YuvConverter::FullRange}) {
+                    const YuvConverter reference(format, matrix, range, FrameConverter::Scalar);
+                    const char *name = layout == YuvConverter::I420 ? "I420" : "NV12";
+                    const char *matrixName = matrix == YuvConverter::BT601 ? "BT.601" : "BT.709";
+                    const char *rangeName = range == YuvConverter::FullRange ? "full" : "limited";
+
+                    for (FrameConverter::Isa isa : {FrameConverter::AVX2, FrameConverter::NEON}) {
+                        if (!FrameConverter::isSupported(isa)) {
+                            continue;
+                        }
+                        const YuvConverter converter(format, matrix, range, isa);
+                        for (const QRect &crop : qAsConst(crops)) {
+                            if (crop.isEmpty()) {
+                                continue;
+                            }
+                            // planes are filled first, so a skipped or
+                            // overrun sample differs too
+                            std::vector<uint8_t> expected(YuvConverter::packedSize(crop.size()), 0xcd);
+                            std::vector<uint8_t> actual(expected.size(), 0xcd);
+                            uint8_t *planes[3];
+                            qint64 strides[3];
+                            YuvConverter::packedPlanes(expected.data(), crop.size(), layout, planes, strides);
+                            reference.convert(src.data(), srcStride, crop, layout, planes, strides);
+                            YuvConverter::packedPlanes(actual.data(), crop.size(), layout, planes, strides);
+                            converter.convert(src.data(), srcStride, crop, layout, planes, strides);
+
+                            const qint64 difference = firstDifference(expected, actual);
+                            if (difference >= 0) {
+                                qWarning() << "yuv" << FrameConverter::formatName(format) << name << matrixName << rangeName
+                                           << FrameConverter::isaName(isa) << "differs from scalar for crop" << crop
+                                           << "at byte" << difference;
+                                ok = false;
+                                break;
+                            }
+                        }
+                    }
+
+                    // SSSE3 has no YUV kernel of its own
+                    QString timings;
+                    for (FrameConverter::Isa isa : {FrameConverter::Scalar, FrameConverter::AVX2, FrameConverter::NEON}) {
+                        if (!FrameConverter::isSupported(isa)) {
+                            continue;
+                        }
+                        const YuvConverter converter(format, matrix, range, isa);
+                        std::vector<uint8_t> dst(YuvConverter::packedSize(size));
+                        uint8_t *planes[3];
+                        qint64 strides[3];
+                        YuvConverter::packedPlanes(dst.data(), size, layout, planes, strides);
+
+                        const qint64 start = now();
+                        for (int i = 0; i < frames; ++i) {
+                            converter.convert(src.data(), srcStride, frameRect, layout, planes, strides);
+                        }
+                        const qint64 elapsed = (now() - start) / qMax(1, frames);
+                        timings += QStringLiteral(" %1 %2 MP/s")
+                                       .arg(QLatin1String(FrameConverter::isaName(isa)))
+                                       .arg(megapixelsPerSecond(qint64(size.width()) * size.height(), elapsed), 0, 'f', 0);
+                    }
+                    qInfo().noquote() << QStringLiteral("yuv %1 %2 %3 %4 %5x%6:")
+                                             .arg(QLatin1String(FrameConverter::formatName(format)), QLatin1String(name))
+                                             .arg(QLatin1String(matrixName), QLatin1String(rangeName))
+                                             .arg(size.width()).arg(size.height())
+                                         + timings;
+                }
+            }
+        }
+    }
+
+    qInfo() << "yuv kernels" << (ok ? "match" : "differ from") << "the scalar reference";
+    return ok;
+}
+
+bool MicroBench::framePool(const QSize &size, int frames)
+{
+    // the size of frame i while a window is dragged back and forth between
+    // half and full size
+    auto stormSize = [&](int i) {
+        const int step = i % 128 < 64 ? i % 64 : 63 - i % 64;
+        return QSize(qMax(1, size.width() / 2 + step * size.width() / 128),
+                     qMax(1, size.height() / 2 + step * size.height() / 128));
+    };
+    auto frameBytes = [](const QSize &frameSize) {
+        return size_t(frameSize.width()) * frameSize.height() * 4;
+    };
+    auto report = [&](const char *name, qint64 allocating, qint64 elapsed) {
+        qInfo().noquote() << QStringLiteral("pool %1x%2 resize storm %3: %4 allocations/s, %5 us/frame with writing")
+                                 .arg(size.width()).arg(size.height()).arg(QLatin1String(name))
+                                 .arg(allocating > 0 ? frames * 1e9 / allocating : 0, 0, 'f', 0)
+                                 .arg(elapsed / qMax(1, frames) / 1000.0, 0, 'f', 1);
+    };
+
+    // what handleFrame did before the pool: a new block per size
+    {
+        uint8_t *previous = nullptr;
+        uint8_t *current = nullptr;
+        qint64 allocating = 0;
+        const qint64 start = now();
+        for (int i = 0; i < frames; ++i) {
+            const size_t bytes = frameBytes(stormSize(i));
+            const qint64 allocStart = now();
+            std::free(previous);
+            previous = current;
+            current = static_cast<uint8_t *>(std::malloc(bytes));
+            allocating += now() - allocStart;
+            if (!current) {
+                qWarning() << "malloc failed for" << bytes << "bytes";
+                std::free(previous);
+                return false;
+            }
+            std::memset(current, i, bytes);
+        }
+        const qint64 elapsed = now() - start;
+        std::free(previous);
+        std::free(current);
+        report("malloc", allocating, elapsed);
+    }
+
+    bool ok = true;
+    const size_t page = sysconf(_SC_PAGESIZE);
+    for (bool hugePages : {false, true}) {
+        FramePool::Settings settings;
+        settings.hugePages = hugePages;
+        std::shared_ptr<FramePool> pool = FramePool::create(settings);
+
+        FrameBufferHandle previous;
+        FrameBufferHandle current;
+        qint64 allocating = 0;
+        const qint64 start = now();
+        for (int i = 0; i < frames; ++i) {
+            const size_t bytes = frameBytes(stormSize(i));
+            const qint64 allocStart = now();
+            previous = std::move(current);
+            current = pool->acquire(bytes);
+            allocating += now() - allocStart;
+            if (!current || current->size() < bytes || reinterpret_cast<quintptr>(current->data()) % page != 0) {
+                qWarning() << "pool returned an unusable buffer for" << bytes << "bytes";
+                ok = false;
+                break;
+            }
+            std::memset(current->data(), i, bytes);
+        }
+        const qint64 elapsed = now() - start;
+        previous.reset();
+        current.reset();
+        report(hugePages ? "pool with huge pages" : "pool", allocating, elapsed);
+        qInfo().noquote() << pool->summary();
+    }
+    return ok;
+}
+
+bool MicroBench::pyramid(const QVector<FramePyramid::Level> &levels, const QSize &size, int frames)
+{
+    const int bpp = 4;
+    const qint64 stride = qint64(size.width()) * bpp;
+    std::vector<uint8_t> pixels(stride * size.height());
+    fillNoise(pixels, 15);
+    const QImage frame(pixels.data(), size.width(), size.height(), stride, QImage::Format_RGB32);
+
+    const int bandHeight = 64;
+    FramePyramid pyramid(levels, FramePool::instance());
+    auto runPyramid = [&](const QRegion &updated) {
+        pyramid.begin(size, updated, bandHeight);
+        for (int y = 0; y < size.height(); y += bandHeight) {
+            pyramid.scaleBand(pixels.data(), stride, y, qMin(bandHeight, size.height() - y));
+        }
+        pyramid.finish(pixels.data(), stride);
+    };
+
+    // every level against the scalar scaler run on the whole frame at once
+    bool ok = true;
+    auto checkLevels = [&](const char *pass) {
+        for (int level = 0; level < pyramid.levelCount() && ok; ++level) {
+            const FramePyramid::Output &output = pyramid.output(level);
+            if (output.size.isEmpty() || !output.buffer) {
+                continue;
+            }
+            const qint64 levelStride = qint64(output.size.width()) * bpp;
+            const QRect levelRect(QPoint(0, 0), output.size);
+            std::vector<uint8_t> expected(levelStride * output.size.height());
+            if (levels[level].filter == FramePyramid::BoxFilter) {
+                ImageScaler::boxDownscaleScalar(pixels.data(), stride, levels[level].divisor, expected.data(), levelStride, levelRect);
+            } else {
+                ImageScaler::scaleScalar(pixels.data(), stride, size, false, expected.data(), levelStride, output.size, levelRect);
+            }
+            std::vector<uint8_t> actual(expected.size());
+            for (int y = 0; y < output.size.height(); ++y) {
+                std::memcpy(actual.data() + y * levelStride, output.buffer->data() + y * output.stride, levelStride);
+            }
+            const qint64 difference = firstDifference(expected, actual);
+            if (difference >= 0) {
+                qWarning().noquote() << QStringLiteral("pyramid level %1 (%2x%3) after %4 differs at x=%5 y=%6")
+                                            .arg(level).arg(output.size.width()).arg(output.size.height())
+                                            .arg(QLatin1String(pass))
+                                            .arg(difference % levelStride / bpp).arg(difference / levelStride);
+                ok = false;
+            }
+        }
+    };
+
+    runPyramid(frame.rect());
+    checkLevels("a full frame");
+    // the bands of rows below redo their part only, the rest is kept
+    for (int y = 0; y < size.height(); y += bandHeight) {
+        runPyramid(QRect(0, y, size.width(), bandHeight));
+    }
+    checkLevels("band updates");
+    if (!ok) {
+        return false;
+    }
+
+    qint64 start = now();
+    for (int i = 0; i < frames; ++i) {
+        runPyramid(frame.rect());
+    }
+    const qint64 full = (now() - start) / qMax(1, frames);
+
+    // a band of rows changing per frame, like a scrolling terminal
+    start = now();
+    for (int i = 0; i < frames; ++i) {
+        runPyramid(QRect(0, (i * bandHeight) % size.height(), size.width(), bandHeight));
+    }
+    const qint64 partial = (now() - start) / qMax(1, frames);
+
+    qint64 smooth = 0;
+    qint64 fast = 0;
+    for (int level = 0; level < pyramid.levelCount(); ++level) {
+        const QSize levelSize = pyramid.output(level).size;
+        if (levelSize.isEmpty()) {
+            continue;
+        }
+        start = now();
+        for (int i = 0; i < frames; ++i) {
+            const QImage scaled = frame.scaled(levelSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        }
+        smooth += (now() - start) / qMax(1, frames);
+        start = now();
+        for (int i = 0; i < frames; ++i) {
+            const QImage scaled = frame.scaled(levelSize, Qt::IgnoreAspectRatio, Qt::FastTransformation);
+        }
+        fast += (now() - start) / qMax(1, frames);
+    }
+
+    qInfo().noquote() << QStringLiteral("pyramid %1x%2 levels=%3 us/frame: pyramid=%4 pyramid-band=%5 "
+                                        "QImage::scaled smooth=%6 fast=%7")
+                             .arg(size.width()).arg(size.height()).arg(pyramid.levelCount())
+                             .arg(full / 1000).arg(partial / 1000).arg(smooth / 1000).arg(fast / 1000);
+    qInfo() << "pyramid matches the scalar scaler";
+    return true;
+}
+
+namespace {
+
+// the consumer side of ring(), in the forked child: no Qt from here on, a
+// lock Qt's logging held in another thread at fork time stays locked
+bool readRing(const char *socketPath, int frames)
+{
+    FrameRingReader reader;
+    if (!reader.connect(socketPath)) {
+        return false;
+    }
+
+    // the writer sealed the memfd, making the mapping writable must fail
+    const FrameRingHeader *header = reader.header();
+    const size_t mapSize = header->slotsOffset + header->slotCount * header->slotSize;
+    if (mprotect(const_cast<FrameRingHeader *>(header), mapSize, PROT_READ | PROT_WRITE) == 0) {
+        fprintf(stderr, "ring reader could make its mapping writable\n");
+        return false;
+    }
+
+    LatencyHistogram acquired;
+    LatencyHistogram consumed;
+    quint64 received = 0;
+    quint64 torn = 0;
+    quint64 checksum = 0;
+    FrameRingReader::Frame frame;
+    while (reader.wait(2000)) {
+        // frame 0 only sized the ring before the reader connected
+        if (!reader.acquire(&frame) || frame.slot->sequence == 0) {
+            continue;
+        }
+        const qint64 acquireTime = now();
+        // a page per row is enough to fault the frame in
+        for (uint32_t y = 0; y < frame.slot->height; ++y) {
+            checksum += frame.data[y * frame.slot->stride];
+        }
+        if (!reader.isIntact(frame)) {
+            ++torn;
+            continue;
+        }
+        ++received;
+        acquired.record(acquireTime - frame.slot->publishTime);
+        consumed.record(now() - frame.slot->publishTime);
+        if (frame.slot->sequence >= quint64(frames)) {
+            break;
+        }
+    }
+
+    fprintf(stderr, "ring reader: %llu of %d frames, %llu torn, latency us acquire p50=%lld p99=%lld max=%lld "
+                    "read p50=%lld p99=%lld (checksum %llu)\n",
+            static_cast<unsigned long long>(received), frames, static_cast<unsigned long long>(torn),
+            static_cast<long long>(acquired.percentile(50) / 1000), static_cast<long long>(acquired.percentile(99) / 1000),
+            static_cast<long long>(acquired.max() / 1000), static_cast<long long>(consumed.percentile(50) / 1000),
+            static_cast<long long>(consumed.percentile(99) / 1000), static_cast<unsigned long long>(checksum));
+    return received > 0;
+}
+
+} // namespace
+
+bool MicroBench::ring(const QSize &size, int frames, int intervalUs)
+{
+    const qint64 stride = qint64(size.width()) * 4;
+    std::vector<uint8_t> pixels(stride * size.height());
+    fillNoise(pixels, 13);
+
+    // the first frame sizes the ring, so the reader keeps the one it gets
+    FrameRingWriter writer;
+    writer.publish(pixels.data(), stride, size, SPA_VIDEO_FORMAT_BGRx, QRegion(), 0, -1);
+    if (!writer.ringsCreated) {
+        return false;
+    }
+    const QString socketPath = QStringLiteral("%1/screencast-ring-bench-%2").arg(QDir::tempPath()).arg(getpid());
+    if (!writer.listen(socketPath)) {
+        return false;
+    }
+    const QByteArray path = QFile::encodeName(socketPath);
+
+    const pid_t reader = fork();
+    if (reader < 0) {
+        qWarning() << "fork failed for the ring reader:" << strerror(errno);
+        return false;
+    }
+    if (reader == 0) {
+        _exit(readRing(path.constData(), frames) ? 0 : 1);
+    }
+
+    const qint64 deadline = now() + 5000000000LL;
+    while (!writer.readersConnected && now() < deadline) {
+        QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+    }
+    // let the reader map the ring and start waiting
+    usleep(100000);
+
+    LatencyHistogram publishing;
+    const QRegion damage(QRect(QPoint(0, 0), size));
+    for (int i = 1; i <= frames; ++i) {
+        const qint64 start = now();
+        writer.publish(pixels.data(), stride, size, SPA_VIDEO_FORMAT_BGRx, damage, i, -1);
+        publishing.record(now() - start);
+        usleep(intervalUs);
+    }
+
+    int status = 0;
+    waitpid(reader, &status, 0);
+    qInfo().noquote() << QStringLiteral("ring writer %1x%2: %3 frames every %4 us, publish p50=%5 p99=%6 us")
+                             .arg(size.width()).arg(size.height()).arg(frames).arg(intervalUs)
+                             .arg(publishing.percentile(50) / 1000).arg(publishing.percentile(99) / 1000);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
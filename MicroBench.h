@@ -0,0 +1,52 @@
+#ifndef MICROBENCH_H
+#define MICROBENCH_H
+
+#include <QSize>
+#include <QVector>
+
+#include "FramePyramid.h"
+
+// Benchmarks of single frame processing stages on synthetic frames, run
+// from main with the SCREENCAST_*_BENCH variables. Each one first checks
+// the fast path against its reference and returns false on a mismatch,
+// then logs the timings of frames iterations.
+class MicroBench
+{
+public:
+    // every FrameConverter kernel the CPU runs against the scalar one, for
+    // all packed formats, odd widths and crops
+    static bool converters(const QSize &size, int frames);
+    // PboReadback of a texture at depths 1 to 4, delivered the way
+    // PipewireStream does: frame latency and throughput. Needs an EGL
+    // display, a surfaceless one works without a GPU
+    static bool readback(const QSize &size, int frames);
+    // a texture exported as DMA-BUF and imported again through DmaBufImage
+    // with its modifier, read back and compared; a made up modifier has to
+    // be refused. Needs EGL_MESA_image_dma_buf_export and
+    // EGL_EXT_image_dma_buf_import, which a render node provides
+    static bool dmaBufImport(const QSize &size, int frames);
+    // TileHasher's kernel against the scalar hash, then hashing plus
+    // converting the changed tiles against converting every frame, for a
+    // mostly static and a fully changing sequence
+    static bool tileHash(const QSize &size, int frames);
+    // a frame converted in bands by a BandPool of 1 to maxThreads threads,
+    // each result checked against the single threaded conversion
+    static bool bandPool(const QSize &size, int frames, int maxThreads);
+    // every YuvConverter kernel the CPU runs against the scalar one for all
+    // packed formats, both layouts, matrices and ranges, odd crops included
+    static bool yuv(const QSize &size, int frames);
+    // a window resize storm up to size, every frame a new size written in
+    // full while the previous one is still held: FramePool against malloc
+    static bool framePool(const QSize &size, int frames);
+    // FramePyramid's levels, after a full frame and after band updates,
+    // against the scalar ImageScaler run on the whole frame; then the
+    // pyramid in one banded pass against a QImage::scaled() per level
+    static bool pyramid(const QVector<FramePyramid::Level> &levels, const QSize &size, int frames);
+    // frames published into a FrameRingWriter at intervalUs and read by a
+    // FrameRingReader in a child process: publish to acquire latency, and
+    // that the reader can't map the ring writable. Needs the event loop of
+    // a QCoreApplication for the reader to connect
+    static bool ring(const QSize &size, int frames, int intervalUs);
+};
+
+#endif // MICROBENCH_H
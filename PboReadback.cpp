@@ -0,0 +1,139 @@
+#include "PboReadback.h"
+
+#include <QDebug>
+
+// upper bound for a single fence wait, a GPU that takes longer is hung
+static const GLuint64 FENCE_TIMEOUT_NS = 1000 * 1000 * 1000;
+
+void PboReadback::setDepth(int depth)
+{
+    depth = qMax(1, depth);
+    if (depth == m_slots.size()) {
+        return;
+    }
+
+    reset();
+    m_slots.resize(depth);
+    for (Slot &slot : m_slots) {
+        glGenBuffers(1, &slot.pbo);
+    }
+}
+
+void PboReadback::start(GLuint texture, GLenum format, const Frame &frame, int height)
+{
+    Q_ASSERT(!isFull());
+
+    Slot &slot = m_slots[m_head];
+    const qint64 size = frame.stride * height;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    if (slot.size != size) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+        slot.size = size;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    // with a pack buffer bound the pointer is an offset into it
+    glGetTexImage(GL_TEXTURE_2D, 0, format, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    // make sure the copy is submitted before we wait on it from a later frame
+    glFlush();
+
+    slot.frame = frame;
+    m_head = (m_head + 1) % m_slots.size();
+    ++m_pending;
+}
+
+bool PboReadback::oldestReady() const
+{
+    Q_ASSERT(m_pending > 0);
+
+    const Slot &slot = m_slots[(m_head - m_pending + m_slots.size()) % m_slots.size()];
+    if (!slot.fence) {
+        return true;
+    }
+    const GLenum result = glClientWaitSync(slot.fence, 0, 0);
+    return result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED;
+}
+
+const uint8_t *PboReadback::mapOldest(Frame *frame)
+{
+    Q_ASSERT(m_pending > 0);
+
+    Slot &slot = m_slots[(m_head - m_pending + m_slots.size()) % m_slots.size()];
+    *frame = slot.frame;
+
+    if (slot.fence) {
+        const GLenum result = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_TIMEOUT_NS);
+        glDeleteSync(slot.fence);
+        slot.fence = nullptr;
+
+        if (result == GL_TIMEOUT_EXPIRED || result == GL_WAIT_FAILED) {
+            qWarning() << "Readback fence did not signal";
+            return nullptr;
+        }
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    auto data = static_cast<const uint8_t *>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, slot.size, GL_MAP_READ_BIT));
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    slot.mapped = data;
+
+    return data;
+}
+
+void PboReadback::finishOldest()
+{
+    Q_ASSERT(m_pending > 0);
+
+    Slot &slot = m_slots[(m_head - m_pending + m_slots.size()) % m_slots.size()];
+    if (slot.mapped) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        slot.mapped = false;
+    }
+    if (slot.fence) {
+        glDeleteSync(slot.fence);
+        slot.fence = nullptr;
+    }
+    slot.frame = Frame();
+    --m_pending;
+}
+
+bool PboReadback::discard(pw_buffer *buffer)
+{
+    bool found = false;
+    for (int i = m_pending; i > 0; --i) {
+        Slot &slot = m_slots[(m_head - i + m_slots.size()) % m_slots.size()];
+        if (slot.frame.buffer == buffer) {
+            // keep the ring in order, the slot is skipped when it comes up
+            slot.frame.buffer = nullptr;
+            found = true;
+        }
+    }
+    return found;
+}
+
+void PboReadback::reset()
+{
+    for (Slot &slot : m_slots) {
+        if (slot.mapped) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+        if (slot.fence) {
+            glDeleteSync(slot.fence);
+        }
+        if (slot.pbo) {
+            glDeleteBuffers(1, &slot.pbo);
+        }
+    }
+    m_slots.clear();
+    m_head = 0;
+    m_pending = 0;
+}
@@ -0,0 +1,63 @@
+#ifndef PBOREADBACK_H
+#define PBOREADBACK_H
+
+#include <QRect>
+#include <QRegion>
+#include <QVector>
+
+#include <epoxy/gl.h>
+
+struct pw_buffer;
+
+// Ring of pixel pack buffers for asynchronous texture readback.
+// glGetTexImage into a PBO returns immediately; a fence marks when the copy
+// is done, so frame N can be read back while frame N+1 is being imported.
+// With a depth of D frames come out at most D - 1 frames late. All calls
+// need the GL context current.
+class PboReadback
+{
+public:
+    // what is needed to process a frame once its pixels arrived
+    struct Frame {
+        pw_buffer *buffer = nullptr;
+        QRect crop;
+        QRegion damage;
+        quint64 sequence = 0;
+        qint64 pts = -1;
+        qint64 stride = 0;
+    };
+
+    void setDepth(int depth);
+    int depth() const { return m_slots.size(); }
+    int pending() const { return m_pending; }
+    bool isFull() const { return !m_slots.isEmpty() && m_pending == m_slots.size(); }
+
+    // queue readback of `texture` into the next free slot, the ring must not be full
+    void start(GLuint texture, GLenum format, const Frame &frame, int height);
+
+    // the oldest readback is done, mapOldest() won't wait
+    bool oldestReady() const;
+    // wait for the oldest readback and map it, valid until finishOldest()
+    const uint8_t *mapOldest(Frame *frame);
+    void finishOldest();
+
+    // forget in-flight readbacks of a buffer that is going away
+    bool discard(pw_buffer *buffer);
+    // delete all GL objects
+    void reset();
+
+private:
+    struct Slot {
+        GLuint pbo = 0;
+        GLsync fence = nullptr;
+        qint64 size = 0;
+        bool mapped = false;
+        Frame frame;
+    };
+
+    QVector<Slot> m_slots;
+    int m_head = 0; // next slot to start
+    int m_pending = 0;
+};
+
+#endif // PBOREADBACK_H
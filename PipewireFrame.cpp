@@ -0,0 +1,73 @@
+#include "PipewireFrame.h"
+
+#include "FrameConverter.h"
+
+PipewireFrame::PipewireFrame(const uint8_t *data, qint64 stride, const QSize &size, const QRect &crop,
+                             spa_video_format format, std::function<void()> release)
+    : m_data(data)
+    , m_stride(stride)
+    , m_size(size)
+    , m_crop(crop)
+    , m_format(format)
+    , m_release(std::move(release))
+{
+}
+
+PipewireFrame::~PipewireFrame()
+{
+    if (m_release) {
+        m_release();
+    }
+}
+
+int PipewireFrame::bytesPerPixel() const
+{
+    return FrameConverter::bytesPerPixel(m_format);
+}
+
+const uint8_t *PipewireFrame::cropData() const
+{
+    return m_data + m_crop.y() * m_stride + m_crop.x() * bytesPerPixel();
+}
+
+QImage::Format PipewireFrame::imageFormat(spa_video_format format)
+{
+    // SPA formats name the byte order in memory, QImage 32bit formats are
+    // native-endian words
+    switch (format) {
+    case SPA_VIDEO_FORMAT_RGBx:
+        return QImage::Format_RGBX8888;
+    case SPA_VIDEO_FORMAT_RGBA:
+        return QImage::Format_RGBA8888;
+    case SPA_VIDEO_FORMAT_BGRx:
+        return Q_BYTE_ORDER == Q_LITTLE_ENDIAN ? QImage::Format_RGB32 : QImage::Format_Invalid;
+    case SPA_VIDEO_FORMAT_BGRA:
+        return Q_BYTE_ORDER == Q_LITTLE_ENDIAN ? QImage::Format_ARGB32 : QImage::Format_Invalid;
+    case SPA_VIDEO_FORMAT_RGB:
+        return QImage::Format_RGB888;
+    case SPA_VIDEO_FORMAT_BGR:
+        return QImage::Format_BGR888;
+    default:
+        return QImage::Format_Invalid;
+    }
+}
+
+static void releaseImageFrame(void *info)
+{
+    delete static_cast<PipewireFrameHandle *>(info);
+}
+
+QImage toImage(const PipewireFrameHandle &frame)
+{
+    if (!frame) {
+        return QImage();
+    }
+
+    const QImage::Format format = PipewireFrame::imageFormat(frame->format());
+    if (format == QImage::Format_Invalid) {
+        return QImage();
+    }
+
+    return QImage(frame->cropData(), frame->crop().width(), frame->crop().height(), frame->stride(), format,
+                  releaseImageFrame, new PipewireFrameHandle(frame));
+}
@@ -0,0 +1,63 @@
+#ifndef PIPEWIREFRAME_H
+#define PIPEWIREFRAME_H
+
+#include <QImage>
+#include <QMetaType>
+#include <QRect>
+#include <QRegion>
+#include <QSharedPointer>
+
+#include <functional>
+
+#include <spa/param/video/raw.h>
+
+// A frame that points straight into a mapped PipeWire buffer.
+// The buffer is handed back to the stream when the last handle is dropped,
+// so consumers holding on to frames hold on to the stream's buffer pool too.
+class PipewireFrame
+{
+public:
+    PipewireFrame(const uint8_t *data, qint64 stride, const QSize &size, const QRect &crop,
+                  spa_video_format format, std::function<void()> release);
+    ~PipewireFrame();
+
+    PipewireFrame(const PipewireFrame &) = delete;
+    PipewireFrame &operator=(const PipewireFrame &) = delete;
+
+    // first byte of the buffer, row 0 of the full stream size
+    const uint8_t *data() const { return m_data; }
+    qint64 stride() const { return m_stride; }
+    QSize size() const { return m_size; }
+    // visible part of the buffer as announced by SPA_META_VideoCrop
+    QRect crop() const { return m_crop; }
+    spa_video_format format() const { return m_format; }
+    int bytesPerPixel() const;
+
+    // first byte of the visible region
+    const uint8_t *cropData() const;
+
+    // presentation timestamp from spa_meta_header, -1 when unknown
+    qint64 pts = -1;
+    // changed area relative to crop(), the whole crop when unknown
+    QRegion damage;
+
+    static QImage::Format imageFormat(spa_video_format format);
+
+private:
+    const uint8_t *m_data;
+    qint64 m_stride;
+    QSize m_size;
+    QRect m_crop;
+    spa_video_format m_format;
+    std::function<void()> m_release;
+};
+
+typedef QSharedPointer<PipewireFrame> PipewireFrameHandle;
+
+// Wrap the visible region in a QImage without copying; the image keeps the
+// frame referenced for as long as it (or any implicit copy of it) lives.
+QImage toImage(const PipewireFrameHandle &frame);
+
+Q_DECLARE_METATYPE(PipewireFrameHandle)
+
+#endif // PIPEWIREFRAME_H
@@ -0,0 +1,333 @@
+#include "PipewireSource.h"
+
+#include <QDebug>
+#include <QRect>
+
+#include <cstring>
+
+static const int MAX_DAMAGE_REGIONS = 16;
+
+PipewireSource::PipewireSource(pw_core *core, const QString &name)
+{
+    m_streamEvents.version = PW_VERSION_STREAM_EVENTS;
+    m_streamEvents.state_changed = &onStreamStateChanged;
+    m_streamEvents.param_changed = &onStreamParamChanged;
+    m_streamEvents.add_buffer = &onStreamAddBuffer;
+    m_streamEvents.remove_buffer = &onStreamRemoveBuffer;
+    m_streamEvents.process = &onStreamProcess;
+
+    const QByteArray nodeName = name.toUtf8();
+    pw_properties *props = pw_properties_new(PW_KEY_MEDIA_TYPE, "Video",
+                                             PW_KEY_MEDIA_CATEGORY, "Capture",
+                                             PW_KEY_MEDIA_ROLE, "Screen",
+                                             PW_KEY_MEDIA_CLASS, "Video/Source",
+                                             PW_KEY_NODE_NAME, nodeName.constData(),
+                                             PW_KEY_NODE_DESCRIPTION, nodeName.constData(),
+                                             nullptr);
+
+    m_stream = pw_stream_new(core, nodeName.constData(), props);
+    if (!m_stream) {
+        qWarning() << "Failed to create PipeWire source stream" << name;
+        return;
+    }
+    pw_stream_add_listener(m_stream, &m_streamListener, &m_streamEvents, this);
+}
+
+PipewireSource::~PipewireSource()
+{
+    if (m_stream) {
+        pw_stream_destroy(m_stream);
+    }
+    qDeleteAll(m_buffers);
+}
+
+uint32_t PipewireSource::nodeId() const
+{
+    return m_stream ? pw_stream_get_node_id(m_stream) : SPA_ID_INVALID;
+}
+
+QString PipewireSource::summary() const
+{
+    return QStringLiteral("source node=%1 published=%2 skipped=%3 copied=%4KiB")
+        .arg(nodeId())
+        .arg(framesPublished.load())
+        .arg(framesSkipped.load())
+        .arg(bytesCopied.load() / 1024);
+}
+
+const spa_pod *PipewireSource::buildFormat(spa_pod_builder *builder) const
+{
+    const spa_rectangle size = SPA_RECTANGLE(uint32_t(m_size.width()), uint32_t(m_size.height()));
+    const spa_fraction framerate = SPA_FRACTION(0, 1);
+
+    // frames go out when they arrive, the compositor's limit is all we know
+    return reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(builder,
+                SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
+                SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+                SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
+                SPA_FORMAT_VIDEO_format, SPA_POD_Id(m_format),
+                SPA_FORMAT_VIDEO_size, SPA_POD_Rectangle(&size),
+                SPA_FORMAT_VIDEO_framerate, SPA_POD_Fraction(&framerate),
+                SPA_FORMAT_VIDEO_maxFramerate, SPA_POD_Fraction(&m_maxFramerate)));
+}
+
+void PipewireSource::setFormat(spa_video_format format, const QSize &size, const spa_fraction &maxFramerate)
+{
+    if (!m_stream) {
+        return;
+    }
+    if (format == m_format && size == m_size && maxFramerate.num == m_maxFramerate.num
+            && maxFramerate.denom == m_maxFramerate.denom) {
+        return;
+    }
+
+    m_format = format;
+    m_size = size;
+    m_maxFramerate = maxFramerate;
+
+    uint8_t buffer[1024];
+    auto builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    const spa_pod *params[1] = {buildFormat(&builder)};
+
+    if (m_connected) {
+        pw_stream_update_params(m_stream, params, 1);
+        return;
+    }
+
+    // we drive the graph, consumers run whenever publish() triggers it
+    const auto flags = static_cast<pw_stream_flags>(PW_STREAM_FLAG_DRIVER | PW_STREAM_FLAG_MAP_BUFFERS);
+    if (pw_stream_connect(m_stream, PW_DIRECTION_OUTPUT, PW_ID_ANY, flags, params, 1) != 0) {
+        qWarning() << "Failed to connect PipeWire source stream";
+        return;
+    }
+    m_connected = true;
+}
+
+void PipewireSource::onStreamStateChanged(void *data, pw_stream_state old, pw_stream_state state, const char *error_message)
+{
+    Q_UNUSED(old);
+    auto d = static_cast<PipewireSource *>(data);
+
+    switch (state) {
+    case PW_STREAM_STATE_ERROR:
+        qWarning() << "pipewire source stream error: " << error_message;
+        break;
+    case PW_STREAM_STATE_PAUSED:
+        qInfo() << "Re-exporting frames as PipeWire node" << d->nodeId();
+        break;
+    case PW_STREAM_STATE_STREAMING:
+    case PW_STREAM_STATE_UNCONNECTED:
+    case PW_STREAM_STATE_CONNECTING:
+        break;
+    }
+}
+
+void PipewireSource::onStreamParamChanged(void *data, uint32_t id, const spa_pod *format)
+{
+    auto d = static_cast<PipewireSource *>(data);
+
+    if (id != SPA_PARAM_Format) {
+        return;
+    }
+
+    QMutexLocker locker(&d->m_mutex);
+    d->m_negotiated = false;
+    if (!format) {
+        return;
+    }
+
+    spa_video_info_raw info = {};
+    spa_format_video_raw_parse(format, &info);
+
+    d->m_bytesPerPixel = info.format == SPA_VIDEO_FORMAT_RGB || info.format == SPA_VIDEO_FORMAT_BGR ? 3 : 4;
+    d->m_stride = SPA_ROUND_UP_N(qint64(info.size.width) * d->m_bytesPerPixel, 4);
+    const int32_t size = d->m_stride * info.size.height;
+    const int32_t stride = d->m_stride;
+    d->m_bufferSize = QSize(info.size.width, info.size.height);
+    d->m_frameSize = QSize();
+    d->m_negotiated = true;
+    locker.unlock();
+
+    uint8_t buffer[1024];
+    auto builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+
+    // MemFd by default, so consumers in other processes map our buffers
+    // instead of getting copies
+    const struct spa_pod *params[4];
+    params[0] = reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(&builder,
+                SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+                SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(4, 2, MAX_BUFFERS),
+                SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(1),
+                SPA_PARAM_BUFFERS_size, SPA_POD_Int(size),
+                SPA_PARAM_BUFFERS_stride, SPA_POD_Int(stride),
+                SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(d->dataTypes)));
+    params[1] = reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(&builder,
+                SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+                SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
+                SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_header))));
+    params[2] = reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(&builder,
+                SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+                SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoCrop),
+                SPA_PARAM_META_size, SPA_POD_Int(sizeof(struct spa_meta_region))));
+    params[3] = reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(&builder,
+                SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+                SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage),
+                SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(sizeof(struct spa_meta_region) * MAX_DAMAGE_REGIONS,
+                                                              sizeof(struct spa_meta_region) * 1,
+                                                              sizeof(struct spa_meta_region) * MAX_DAMAGE_REGIONS)));
+    pw_stream_update_params(d->m_stream, params, 4);
+}
+
+void PipewireSource::onStreamAddBuffer(void *data, pw_buffer *buffer)
+{
+    auto d = static_cast<PipewireSource *>(data);
+    QMutexLocker locker(&d->m_mutex);
+
+    // a new buffer holds nothing yet
+    auto sourceBuffer = new Buffer;
+    sourceBuffer->stale = QRect(QPoint(0, 0), d->m_frameSize);
+    buffer->user_data = sourceBuffer;
+    d->m_buffers.append(sourceBuffer);
+}
+
+void PipewireSource::onStreamRemoveBuffer(void *data, pw_buffer *buffer)
+{
+    auto d = static_cast<PipewireSource *>(data);
+    QMutexLocker locker(&d->m_mutex);
+
+    auto sourceBuffer = static_cast<Buffer *>(buffer->user_data);
+    d->m_buffers.removeOne(sourceBuffer);
+    delete sourceBuffer;
+    buffer->user_data = nullptr;
+
+    // a filled buffer that wasn't sent yet goes away with the others;
+    // process runs on this thread, so nothing pops meanwhile
+    QList<pw_buffer *> filled;
+    pw_buffer *pending;
+    while (d->m_filled.pop(pending)) {
+        if (pending != buffer) {
+            filled.append(pending);
+        }
+    }
+    for (pw_buffer *pending : qAsConst(filled)) {
+        d->m_filled.push(pending);
+    }
+}
+
+void PipewireSource::onStreamProcess(void *data)
+{
+    auto d = static_cast<PipewireSource *>(data);
+
+    // every frame filled since the last cycle goes out, oldest first
+    pw_buffer *buffer;
+    while (d->m_filled.pop(buffer)) {
+        pw_stream_queue_buffer(d->m_stream, buffer);
+        ++d->framesPublished;
+    }
+}
+
+void PipewireSource::publish(const uint8_t *data, qint64 stride, const QSize &size, const QRegion &damage,
+                             quint64 sequence, qint64 pts)
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_negotiated || m_buffers.isEmpty()) {
+        return;
+    }
+
+    // a cropped frame sits in the top left corner, VideoCrop tells consumers
+    const QSize frameSize = size.boundedTo(m_bufferSize);
+    const QRect frameRect(QPoint(0, 0), frameSize);
+    if (frameSize != m_frameSize) {
+        m_frameSize = frameSize;
+        for (Buffer *buffer : qAsConst(m_buffers)) {
+            buffer->stale = frameRect;
+        }
+    }
+    const QRegion changed = damage & frameRect;
+    for (Buffer *buffer : qAsConst(m_buffers)) {
+        buffer->stale += changed;
+    }
+
+    pw_buffer *pwBuffer = pw_stream_dequeue_buffer(m_stream);
+    if (!pwBuffer) {
+        ++framesSkipped;
+        return;
+    }
+
+    auto buffer = static_cast<Buffer *>(pwBuffer->user_data);
+    spa_buffer *spaBuffer = pwBuffer->buffer;
+    spa_data &spaData = spaBuffer->datas[0];
+    if (!buffer || !spaData.data) {
+        // nothing to fill, it goes out empty with the next cycle
+        spaData.chunk->size = 0;
+        m_filled.push(pwBuffer);
+        return;
+    }
+
+    // the buffer already holds an older frame, bring it up to date
+    uint8_t *dst = static_cast<uint8_t *>(spaData.data);
+    quint64 copied = 0;
+    for (const QRect &rect : buffer->stale) {
+        const qint64 rowBytes = qint64(rect.width()) * m_bytesPerPixel;
+        const qint64 offset = qint64(rect.x()) * m_bytesPerPixel;
+        for (int y = rect.top(); y <= rect.bottom(); ++y) {
+            std::memcpy(dst + y * m_stride + offset, data + y * stride + offset, rowBytes);
+        }
+        copied += rowBytes * rect.height();
+    }
+    buffer->stale = QRegion();
+    bytesCopied += copied;
+
+    spaData.chunk->offset = 0;
+    spaData.chunk->size = m_stride * m_bufferSize.height();
+    spaData.chunk->stride = m_stride;
+    spaData.chunk->flags = SPA_CHUNK_FLAG_NONE;
+
+    auto header = static_cast<spa_meta_header *>(spa_buffer_find_meta_data(spaBuffer, SPA_META_Header, sizeof(spa_meta_header)));
+    if (header) {
+        header->flags = 0;
+        header->offset = 0;
+        header->pts = pts;
+        header->dts_offset = 0;
+        header->seq = sequence;
+    }
+
+    auto crop = static_cast<spa_meta_region *>(spa_buffer_find_meta_data(spaBuffer, SPA_META_VideoCrop, sizeof(spa_meta_region)));
+    if (crop) {
+        crop->region.position = SPA_POINT(0, 0);
+        crop->region.size = SPA_RECTANGLE(uint32_t(frameSize.width()), uint32_t(frameSize.height()));
+    }
+
+    // the change since the previous frame, as consumers expect it; too many
+    // rects go out as their bounding rect
+    spa_meta *damageMeta = spa_buffer_find_meta(spaBuffer, SPA_META_VideoDamage);
+    if (damageMeta) {
+        auto regions = static_cast<spa_meta_region *>(damageMeta->data);
+        const int capacity = damageMeta->size / sizeof(spa_meta_region);
+        int count = 0;
+        if (changed.rectCount() > capacity) {
+            const QRect bounds = changed.boundingRect();
+            regions[count++].region = {SPA_POINT(bounds.x(), bounds.y()),
+                                       SPA_RECTANGLE(uint32_t(bounds.width()), uint32_t(bounds.height()))};
+        } else {
+            for (const QRect &rect : changed) {
+                regions[count++].region = {SPA_POINT(rect.x(), rect.y()),
+                                           SPA_RECTANGLE(uint32_t(rect.width()), uint32_t(rect.height()))};
+            }
+        }
+        // the list ends at the first region without a size
+        if (count < capacity) {
+            regions[count] = {};
+        }
+    }
+
+    if (!m_filled.push(pwBuffer)) {
+        qWarning() << "Filled source buffer queue overflow";
+        return;
+    }
+    locker.unlock();
+
+    // queueing from here would have PipeWire start the cycle implicitly,
+    // which it deprecates for driver streams
+    pw_stream_trigger_process(m_stream);
+}
@@ -0,0 +1,102 @@
+#ifndef PIPEWIRESOURCE_H
+#define PIPEWIRESOURCE_H
+
+#include <QList>
+#include <QMutex>
+#include <QRegion>
+#include <QSize>
+#include <QString>
+
+#include <atomic>
+
+#include <spa/param/video/format-utils.h>
+
+#include <pipewire/pipewire.h>
+
+#include "BoundedQueue.h"
+
+// Re-exports captured frames as a PipeWire Video/Source node, so a recorder,
+// a streamer and an OCR job can share one screencast session. PipeWire
+// allocates the buffers as MemFd and every linked consumer maps the same
+// memory, the only copy is ours into the buffer. Each buffer remembers what
+// changed since it was last filled, so only that is copied again.
+// MemPtr buffers can be offered instead, e.g. to benchmark consumers.
+// The stream drives the graph: publishing triggers a graph cycle and the
+// filled buffer is queued in that cycle's process callback.
+class PipewireSource
+{
+public:
+    // creates the stream, the loop of core has to be locked
+    PipewireSource(pw_core *core, const QString &name);
+    // the loop has to be locked
+    ~PipewireSource();
+
+    bool isValid() const { return m_stream; }
+
+    // buffer types offered to the consumers, a mask of 1 << SPA_DATA_*;
+    // set before setFormat()
+    int dataTypes = 1 << SPA_DATA_MemFd;
+    // SPA_ID_INVALID until the node is registered
+    uint32_t nodeId() const;
+
+    // offer frames of this format and size, connects the stream the first
+    // time and renegotiates afterwards; on the loop thread
+    void setFormat(spa_video_format format, const QSize &size, const spa_fraction &maxFramerate);
+
+    // copy a frame into the next free buffer and trigger a graph cycle
+    // that sends it, damage is the change since the last published frame;
+    // any thread
+    void publish(const uint8_t *data, qint64 stride, const QSize &size, const QRegion &damage,
+                 quint64 sequence, qint64 pts);
+
+    std::atomic<quint64> framesPublished{0};
+    // no free buffer, the consumers still hold all of them
+    std::atomic<quint64> framesSkipped{0};
+    std::atomic<quint64> bytesCopied{0};
+    QString summary() const;
+
+    static void onStreamParamChanged(void *data, uint32_t id, const struct spa_pod *format);
+    static void onStreamStateChanged(void *data, pw_stream_state old, pw_stream_state state, const char *error_message);
+    static void onStreamAddBuffer(void *data, pw_buffer *buffer);
+    static void onStreamRemoveBuffer(void *data, pw_buffer *buffer);
+    static void onStreamProcess(void *data);
+
+private:
+    // pw_buffer user data
+    struct Buffer {
+        // changed since the buffer was last filled
+        QRegion stale;
+    };
+
+    const spa_pod *buildFormat(spa_pod_builder *builder) const;
+
+    // the most buffers the stream asks PipeWire for
+    static const int MAX_BUFFERS = 16;
+
+    pw_stream *m_stream = nullptr;
+    spa_hook m_streamListener = {};
+    pw_stream_events m_streamEvents = {};
+    bool m_connected = false;
+
+    // offered format, set on the loop thread
+    spa_video_format m_format = SPA_VIDEO_FORMAT_UNKNOWN;
+    QSize m_size;
+    spa_fraction m_maxFramerate = {0, 1};
+
+    // guards what publish() shares with the stream callbacks
+    QMutex m_mutex;
+    // negotiated with the consumers, no frames go out before
+    bool m_negotiated = false;
+    int m_bytesPerPixel = 4;
+    qint64 m_stride = 0;
+    QSize m_bufferSize;
+    QList<Buffer *> m_buffers;
+    // size of the last published frame, a new size makes every buffer stale
+    QSize m_frameSize;
+
+    // filled by publish(), queued by the next process callback; a buffer is
+    // in it at most once, so a push never fails
+    BoundedQueue<pw_buffer *> m_filled{MAX_BUFFERS};
+};
+
+#endif // PIPEWIRESOURCE_H
@@ -1,7 +1,7 @@
 #include "PipewireStream.h"
 #include <QDebug>
 
-#include <QDateTime>
+#include <QTimer>
 #include <cstring>
 #include <sys/mman.h>
 
@@ -33,8 +33,29 @@ const char * formatGLError(GLenum err)
 #endif /* HAVE_DMA_BUF */
 
 
-static const int BYTES_PER_PIXEL = 4;
 static const uint MIN_SUPPORTED_XDP_KDE_SC_VERSION = 1;
+static const int MAX_DAMAGE_REGIONS = 16;
+// cursor bitmaps up to MAX_CURSOR_SIZE square fit in SPA_META_Cursor
+static const int DEFAULT_CURSOR_SIZE = 64;
+static const int MAX_CURSOR_SIZE = 256;
+
+static int cursorMetaSize(int width, int height)
+{
+    return sizeof(struct spa_meta_cursor) + sizeof(struct spa_meta_bitmap) + width * height * 4;
+}
+
+// planes of a raw format, encoded formats are one block
+static int planeCount(spa_video_format format)
+{
+    switch (format) {
+    case SPA_VIDEO_FORMAT_NV12:
+        return 2;
+    case SPA_VIDEO_FORMAT_I420:
+        return 3;
+    default:
+        return 1;
+    }
+}
 
 PipewireStream::PipewireStream(QObject *parent)
     : QObject(parent)
@@ -46,20 +67,22 @@ PipewireStream::PipewireStream(QObject *parent)
     pwStreamEvents.state_changed = &onStreamStateChanged;
     pwStreamEvents.param_changed = &onStreamParamChanged;
     pwStreamEvents.process = &onStreamProcess;
+    pwStreamEvents.add_buffer = &onStreamAddBuffer;
+    pwStreamEvents.remove_buffer = &onStreamRemoveBuffer;
+
+    qRegisterMetaType<PipewireFrameHandle>("PipewireFrameHandle");
 
 #if HAVE_DMA_BUF
     m_drmFd = open("/dev/dri/renderD128", O_RDWR);
 
     if (m_drmFd < 0) {
         qWarning() << "Failed to open drm render node: " << strerror(errno);
-        return;
-    }
-
-    m_gbmDevice = gbm_create_device(m_drmFd);
+    } else {
+        m_gbmDevice = gbm_create_device(m_drmFd);
 
-    if (!m_gbmDevice) {
-        qWarning() << "Cannot create GBM device: " << strerror(errno);
-        return;
+        if (!m_gbmDevice) {
+            qWarning() << "Cannot create GBM device: " << strerror(errno);
+        }
     }
 
     // Get the list of client extensions
@@ -76,13 +99,22 @@ PipewireStream::PipewireStream(QObject *parent)
 
     // Use eglGetPlatformDisplayEXT() to get the display pointer
     // if the implementation supports it.
-    if (!m_egl.extensions.contains(QByteArrayLiteral("EGL_EXT_platform_base")) ||
-            !m_egl.extensions.contains(QByteArrayLiteral("EGL_MESA_platform_gbm"))) {
+    if (!m_egl.extensions.contains(QByteArrayLiteral("EGL_EXT_platform_base"))) {
         qWarning() << "One of required EGL extensions is missing";
         return;
     }
 
-    m_egl.display = eglGetPlatformDisplayEXT(EGL_PLATFORM_GBM_MESA, m_gbmDevice, nullptr);
+    if (m_gbmDevice && m_egl.extensions.contains(QByteArrayLiteral("EGL_MESA_platform_gbm"))) {
+        m_egl.display = eglGetPlatformDisplayEXT(EGL_PLATFORM_GBM_MESA, m_gbmDevice, nullptr);
+        m_egl.ownsDisplay = true;
+    } else if (m_egl.extensions.contains(QByteArrayLiteral("EGL_MESA_platform_surfaceless"))) {
+        // no usable render node, e.g. llvmpipe on a machine without GPU
+        qDebug() << "Using surfaceless EGL platform";
+        m_egl.display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    } else {
+        qWarning() << "One of required EGL extensions is missing";
+        return;
+    }
 
     if (m_egl.display == EGL_NO_DISPLAY) {
         qWarning() << "Error during obtaining EGL display: " << formatGLError(eglGetError());
@@ -107,6 +139,17 @@ PipewireStream::PipewireStream(QObject *parent)
         return;
     }
 
+    const QList<QByteArray> displayExtensions = QByteArray(eglQueryString(m_egl.display, EGL_EXTENSIONS)).split(' ');
+    m_egl.dmaBufImport = displayExtensions.contains(QByteArrayLiteral("EGL_EXT_image_dma_buf_import"));
+    if (m_egl.dmaBufImport && displayExtensions.contains(QByteArrayLiteral("EGL_EXT_image_dma_buf_import_modifiers"))) {
+        queryDmaBufModifiers();
+    }
+
+    if (!m_egl.dmaBufImport && !m_gbmDevice) {
+        qWarning() << "Neither EGL_EXT_image_dma_buf_import nor GBM is available";
+        return;
+    }
+
     qDebug() << "Egl initialization succeeded";
     qDebug() << QStringLiteral("EGL version: %1.%2").arg(major).arg(minor);
 
@@ -116,15 +159,38 @@ PipewireStream::PipewireStream(QObject *parent)
 
 PipewireStream::~PipewireStream()
 {
-    if (pwMainLoop) {
+    if (pwMainLoop && m_ownsLoop) {
         pw_thread_loop_stop(pwMainLoop);
+    } else if (pwMainLoop) {
+        // the loop keeps serving other streams, holding its lock keeps our
+        // callbacks from running
+        pw_thread_loop_lock(pwMainLoop);
     }
 
+    // after the loop, a blocked onStreamProcess needs the workers to return
+    stopWorkers();
+
+    if (stitcher) {
+        stitcher->removeOutput(this);
+    }
+
+    m_source.reset();
+
+    // handles consumers still hold must not reach the stream anymore, what
+    // they returned so far goes back before the buffers are freed
+    for (const auto &token : qAsConst(m_bufferTokens)) {
+        token->invalidate();
+    }
+    m_bufferTokens.clear();
+
     if (pwStream) {
+        queueBuffersBack();
+        // the imports and mappings are dropped below, not buffer by buffer
+        spa_hook_remove(&streamListener);
         pw_stream_destroy(pwStream);
     }
 
-    if (pwCore) {
+    if (pwCore && m_ownsLoop) {
         pw_core_disconnect(pwCore);
     }
 
@@ -132,9 +198,55 @@ PipewireStream::~PipewireStream()
         pw_context_destroy(pwContext);
     }
 
-    if (pwMainLoop) {
+    if (m_returnEvent) {
+        pw_loop_destroy_source(pw_thread_loop_get_loop(pwMainLoop), m_returnEvent);
+    }
+
+    if (m_renegotiateEvent) {
+        pw_loop_destroy_source(pw_thread_loop_get_loop(pwMainLoop), m_renegotiateEvent);
+    }
+
+#if HAVE_DMA_BUF
+    if (m_readbackEvent) {
+        pw_loop_destroy_source(pw_thread_loop_get_loop(pwMainLoop), m_readbackEvent);
+    }
+
+    if (m_readbackTimer) {
+        pw_loop_destroy_source(pw_thread_loop_get_loop(pwMainLoop), m_readbackTimer);
+    }
+#endif /* HAVE_DMA_BUF */
+
+    if (pwMainLoop && m_ownsLoop) {
         pw_thread_loop_destroy(pwMainLoop);
+    } else if (pwMainLoop) {
+        pw_thread_loop_unlock(pwMainLoop);
+    }
+
+#if HAVE_DMA_BUF
+    if (!m_dmaBufImports.isEmpty() || m_readback.depth()) {
+        eglMakeCurrent(m_egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, m_egl.context);
+        m_readback.reset();
+        for (const DmaBufImport &import : qAsConst(m_dmaBufImports)) {
+            destroyDmaBufImport(import);
+        }
+        m_dmaBufImports.clear();
+        eglMakeCurrent(m_egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    }
+
+    // whatever the constructor got before it gave up
+    if (m_egl.context != EGL_NO_CONTEXT) {
+        eglDestroyContext(m_egl.display, m_egl.context);
+    }
+    if (m_egl.ownsDisplay && m_egl.display != EGL_NO_DISPLAY) {
+        eglTerminate(m_egl.display);
     }
+    if (m_gbmDevice) {
+        gbm_device_destroy(m_gbmDevice);
+    }
+    if (m_drmFd >= 0) {
+        close(m_drmFd);
+    }
+#endif /* HAVE_DMA_BUF */
 }
 
 void PipewireStream::onCoreError(void *data, uint32_t id, int seq, int res, const char *message)
@@ -151,35 +263,97 @@ void PipewireStream::onStreamParamChanged(void *data, uint32_t id, const spa_pod
         return;
     }
 
-    d->videoFormat = new spa_video_info_raw();
-    spa_format_video_raw_parse(format, d->videoFormat);
-    auto width = d->videoFormat->size.width;
-    auto height = d->videoFormat->size.height;
-    auto stride = SPA_ROUND_UP_N(width * BYTES_PER_PIXEL, 4);
-    auto size = height * stride;
-    d->streamSize = QSize(width, height);
+#if HAVE_DMA_BUF
+    // the compositor still has to pick the modifier, it sends the format
+    // again once it is fixed
+    const spa_pod_prop *modifierProp = spa_pod_find_prop(format, nullptr, SPA_FORMAT_VIDEO_modifier);
+    if (modifierProp && (modifierProp->flags & SPA_POD_PROP_FLAG_DONT_FIXATE)) {
+        return;
+    }
+#endif /* HAVE_DMA_BUF */
+
+    uint32_t mediaType = 0;
+    uint32_t mediaSubtype = 0;
+    spa_format_parse(format, &mediaType, &mediaSubtype);
+
+    spa_video_info_raw info = {};
+    if (mediaSubtype == SPA_MEDIA_SUBTYPE_h264) {
+        spa_video_info_h264 h264 = {};
+        spa_format_video_h264_parse(format, &h264);
+        info.format = SPA_VIDEO_FORMAT_ENCODED;
+        info.size = h264.size;
+    } else if (mediaSubtype == SPA_MEDIA_SUBTYPE_mjpg) {
+        spa_video_info_mjpg mjpg = {};
+        spa_format_video_mjpg_parse(format, &mjpg);
+        info.format = SPA_VIDEO_FORMAT_ENCODED;
+        info.size = mjpg.size;
+    } else {
+        spa_format_video_raw_parse(format, &info);
+    }
+    d->setVideoFormat(mediaSubtype, info);
+
+    auto width = info.size.width;
+    auto height = info.size.height;
+    const int planes = planeCount(info.format);
+    int32_t stride;
+    int32_t size;
+    if (info.format == SPA_VIDEO_FORMAT_ENCODED) {
+        // no stride, leave room for a poorly compressed keyframe
+        stride = 0;
+        size = qMax<int32_t>(width * height * 3 / 2, 1 << 20);
+    } else if (planes > 1) {
+        // luma stride, chroma rows are half as many (and as long for I420);
+        // the size covers all planes so one block can hold them all
+        stride = SPA_ROUND_UP_N(width, 4);
+        size = stride * height + stride * ((height + 1) / 2);
+    } else {
+        stride = SPA_ROUND_UP_N(width * d->converter.bytesPerPixel(), 4);
+        size = height * stride;
+    }
+
+    // frames are forwarded as received, only packed RGB reaches processFrame
+    if (d->m_source && planes == 1 && info.format != SPA_VIDEO_FORMAT_ENCODED) {
+        d->m_source->setFormat(info.format, d->streamSize, info.max_framerate);
+    }
 
     uint8_t buffer[1024];
     auto builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 
     // setup buffers and meta header for new format
-    const struct spa_pod *params[3];
+    const struct spa_pod *params[5];
 
 #if HAVE_DMA_BUF
-    const auto bufferTypes = d->m_eglInitialized ? (1 << SPA_DATA_DmaBuf) | (1 << SPA_DATA_MemFd) | (1 << SPA_DATA_MemPtr) :
-                                                   (1 << SPA_DATA_MemFd) | (1 << SPA_DATA_MemPtr);
+    // DMA-BUF import only handles packed RGB
+    const bool dmaBuf = d->m_eglInitialized && planes == 1 && d->videoFormat.format != SPA_VIDEO_FORMAT_ENCODED;
+    const bool modifier = d->videoFormat.flags & SPA_VIDEO_FLAG_MODIFIER;
+    const auto bufferTypes = dmaBuf ? (1 << SPA_DATA_DmaBuf) | (1 << SPA_DATA_MemFd) | (1 << SPA_DATA_MemPtr) :
+                                      (1 << SPA_DATA_MemFd) | (1 << SPA_DATA_MemPtr);
 #else
     const auto bufferTypes = (1 << SPA_DATA_MemFd) | (1 << SPA_DATA_MemPtr);
 #endif /* HAVE_DMA_BUF */
 
-    params[0] = reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(&builder,
-                SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
-                SPA_PARAM_BUFFERS_size, SPA_POD_Int(size),
-                SPA_PARAM_BUFFERS_stride, SPA_POD_Int(stride),
-                SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(8, 1, 32),
-                SPA_PARAM_BUFFERS_blocks, SPA_POD_Int(1),
-                SPA_PARAM_BUFFERS_align, SPA_POD_Int(16),
-                SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(bufferTypes)));
+#if HAVE_DMA_BUF
+    if (modifier) {
+        // a fixed modifier means DMA-BUF only; the compositor allocates, so
+        // size and stride are its business, and the modifier may add planes
+        // (e.g. compression metadata)
+        params[0] = reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(&builder,
+                    SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+                    SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(8, 1, MAX_BUFFERS),
+                    SPA_PARAM_BUFFERS_blocks, SPA_POD_CHOICE_RANGE_Int(4, 1, 4),
+                    SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(1 << SPA_DATA_DmaBuf)));
+    } else
+#endif /* HAVE_DMA_BUF */
+    {
+        params[0] = reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(&builder,
+                    SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+                    SPA_PARAM_BUFFERS_size, SPA_POD_Int(size),
+                    SPA_PARAM_BUFFERS_stride, SPA_POD_Int(stride),
+                    SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(8, 1, MAX_BUFFERS),
+                    SPA_PARAM_BUFFERS_blocks, SPA_POD_CHOICE_RANGE_Int(planes, 1, planes),
+                    SPA_PARAM_BUFFERS_align, SPA_POD_Int(16),
+                    SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(bufferTypes)));
+    }
     params[1] = reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(&builder,
                 SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
                 SPA_PARAM_META_type, SPA_POD_Id(SPA_META_Header),
@@ -188,7 +362,47 @@ void PipewireStream::onStreamParamChanged(void *data, uint32_t id, const spa_pod
                 SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type,
                 SPA_POD_Id(SPA_META_VideoCrop), SPA_PARAM_META_size,
                 SPA_POD_Int(sizeof(struct spa_meta_region))));
-    pw_stream_update_params(d->pwStream, params, 3);
+    params[3] = reinterpret_cast<spa_pod*>(spa_pod_builder_add_object(&builder,
+                SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type,
+                SPA_POD_Id(SPA_META_VideoDamage), SPA_PARAM_META_size,
+                SPA_POD_CHOICE_RANGE_Int(sizeof(struct spa_meta_region) * MAX_DAMAGE_REGIONS,
+                                         sizeof(struct spa_meta_region) * 1,
+                                         sizeof(struct spa_meta_region) * MAX_DAMAGE_REGIONS)));
+    int paramCount = 4;
+    if (d->cursorMode == CursorMetadata) {
+        params[paramCount++] = reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(&builder,
+                SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta, SPA_PARAM_META_type,
+                SPA_POD_Id(SPA_META_Cursor), SPA_PARAM_META_size,
+                SPA_POD_CHOICE_RANGE_Int(cursorMetaSize(DEFAULT_CURSOR_SIZE, DEFAULT_CURSOR_SIZE),
+                                         cursorMetaSize(1, 1),
+                                         cursorMetaSize(MAX_CURSOR_SIZE, MAX_CURSOR_SIZE))));
+    }
+    pw_stream_update_params(d->pwStream, params, paramCount);
+}
+
+void PipewireStream::setVideoFormat(uint32_t subtype, const spa_video_info_raw &info)
+{
+    // frames in the handoff queue belong to the old format
+    waitForWorkers();
+    QMutexLocker locker(&m_processMutex);
+
+    mediaSubtype = subtype;
+    videoFormat = info;
+    hasVideoFormat = true;
+    converter.setFormat(videoFormat.format);
+    qInfo() << "Using" << FrameConverter::isaName(converter.isa()) << "conversion kernels";
+
+    streamSize = QSize(info.size.width, info.size.height);
+    // the size downscaling is relative to
+    if (m_rateLimits.scale == 100) {
+        m_nativeSize = streamSize;
+    }
+    m_fbValid = false;
+    m_tileHasher.resize(streamSize);
+
+    if (recorder) {
+        recorder->recordFormat(subtype, info);
+    }
 }
 
 void PipewireStream::onStreamStateChanged(void *data, pw_stream_state old, pw_stream_state state, const char *error_message)
@@ -211,30 +425,137 @@ void PipewireStream::onStreamStateChanged(void *data, pw_stream_state old, pw_st
 
 void PipewireStream::onStreamProcess(void *data)
 {
-    qWarning() << "onStreamProcess";
     auto d = static_cast<PipewireStream *>(data);
 
     pw_buffer* next_buffer;
     pw_buffer* buffer = nullptr;
 
+    const qint64 dequeueStart = StreamStats::now();
     next_buffer = pw_stream_dequeue_buffer(d->pwStream);
     while (next_buffer) {
-        buffer = next_buffer;
-        next_buffer = pw_stream_dequeue_buffer(d->pwStream);
-
-        if (next_buffer) {
-            pw_stream_queue_buffer(d->pwStream, buffer);
+        ++d->stats.framesReceived;
+        // the cursor is taken from every buffer; one without data goes
+        // straight back and doesn't replace an older frame
+        d->updateCursor(next_buffer->buffer);
+        if (!hasFrameContent(next_buffer->buffer)) {
+            if (d->cursorMode == CursorMetadata && hasCursor(next_buffer->buffer)) {
+                ++d->stats.cursorOnlyFrames;
+            } else {
+                ++d->stats.nullChunks;
+            }
+            pw_stream_queue_buffer(d->pwStream, next_buffer);
+        } else {
+            if (buffer) {
+                pw_stream_queue_buffer(d->pwStream, buffer);
+                ++d->stats.framesDropped;
+            }
+            buffer = next_buffer;
+            ++d->m_frameSequence;
         }
+        next_buffer = pw_stream_dequeue_buffer(d->pwStream);
     }
+    const qint64 dequeueEnd = StreamStats::now();
 
     if (!buffer) {
         return;
     }
 
+    d->stats.dequeue.record(dequeueEnd - dequeueStart);
+
+    struct spa_meta_header *header = static_cast<struct spa_meta_header*>(
+        spa_buffer_find_meta_data(buffer->buffer, SPA_META_Header, sizeof(*header)));
+    if (header && header->pts > 0) {
+        // only meaningful when the producer stamps frames with CLOCK_MONOTONIC
+        d->stats.frameAge.record(dequeueEnd - header->pts);
+    }
+
+    if (!d->m_workers.isEmpty()) {
+        d->enqueueFrame({buffer, d->m_frameSequence});
+        return;
+    }
+
+    if (d->deliveryMode == ZeroCopyDelivery && d->deliverFrame(buffer)) {
+        // requeued once the last frame handle is dropped
+        return;
+    }
+
+    const qint64 processStart = StreamStats::now();
+    const qint64 cpuStart = StreamStats::threadCpuTime();
+    QMutexLocker locker(&d->m_processMutex);
+    if (!d->handleFrame(buffer, d->m_frameSequence)) {
+        pw_stream_queue_buffer(d->pwStream, buffer);
+    }
+    d->stats.process.record(StreamStats::now() - processStart);
+    d->stats.cpu.record(StreamStats::threadCpuTime() - cpuStart);
+}
+
+void PipewireStream::onStreamAddBuffer(void *data, pw_buffer *buffer)
+{
+    auto d = static_cast<PipewireStream *>(data);
+    auto spaBuffer = buffer->buffer;
+    QMutexLocker locker(&d->m_processMutex);
+
+    auto token = std::make_shared<BufferToken>();
+    token->stream = d;
+    token->buffer = buffer;
+    d->m_bufferTokens.insert(buffer, token);
+
+    // the buffer pool is fixed until the next renegotiation, so map MemFd
+    // buffers once here instead of on every frame
+    for (uint32_t i = 0; i < spaBuffer->n_datas; ++i) {
+        const spa_data &spaData = spaBuffer->datas[i];
+        if (spaData.type != SPA_DATA_MemFd || !(spaData.flags & SPA_DATA_FLAG_MAPPABLE)) {
+            continue;
+        }
+
+        const size_t mapSize = spaData.maxsize + spaData.mapoffset;
+        uint8_t *map = static_cast<uint8_t*>(mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE, spaData.fd, 0));
+        if (map == MAP_FAILED) {
+            qWarning() << "Failed to mmap the memory: " << strerror(errno);
+            continue;
+        }
+
+        // planes usually share one fd, keep the mapping that covers them all
+        auto cached = d->memFdMappings.value(spaData.fd);
+        if (cached && cached->size >= mapSize) {
+            munmap(map, mapSize);
+            continue;
+        }
+        d->memFdMappings.insert(spaData.fd, QSharedPointer<MemFdMapping>::create(map, mapSize));
+    }
+}
 
-    d->handleFrame(buffer);
+void PipewireStream::onStreamRemoveBuffer(void *data, pw_buffer *buffer)
+{
+    auto d = static_cast<PipewireStream *>(data);
+    auto spaBuffer = buffer->buffer;
+
+    // nothing may touch the buffer once it is gone: let the workers finish,
+    // cut off the handles consumers still hold and give back what was
+    // returned meanwhile
+    d->waitForWorkers();
+    QMutexLocker locker(&d->m_processMutex);
+    if (auto token = d->m_bufferTokens.take(buffer)) {
+        token->invalidate();
+    }
+    d->queueBuffersBack(buffer);
 
-    pw_stream_queue_buffer(d->pwStream, buffer);
+    // frames still referencing the mapping keep it alive
+    for (uint32_t i = 0; i < spaBuffer->n_datas; ++i) {
+        if (spaBuffer->datas[i].type == SPA_DATA_MemFd) {
+            d->memFdMappings.remove(spaBuffer->datas[i].fd);
+        }
+#if HAVE_DMA_BUF
+        if (spaBuffer->datas[i].type == SPA_DATA_DmaBuf) {
+            d->m_readback.discard(buffer);
+        }
+        if (spaBuffer->datas[i].type == SPA_DATA_DmaBuf && d->m_dmaBufImports.contains(spaBuffer->datas[i].fd)) {
+            eglMakeCurrent(d->m_egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, d->m_egl.context);
+            d->destroyDmaBufImport(d->m_dmaBufImports.take(spaBuffer->datas[i].fd));
+            eglMakeCurrent(d->m_egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        }
+#endif /* HAVE_DMA_BUF */
+    }
 }
 
 void PipewireStream::initPw()
@@ -261,9 +582,7 @@ void PipewireStream::initPw()
 
     pw_core_add_listener(pwCore, &coreListener, &pwCoreEvents, this);
 
-    pwStream = createReceivingStream();
-    if (!pwStream) {
-        qWarning() << "Failed to create PipeWire stream";
+    if (!connectStream()) {
         return;
     }
 
@@ -275,23 +594,127 @@ void PipewireStream::initPw()
     pw_thread_loop_unlock(pwMainLoop);
 }
 
-pw_stream *PipewireStream::createReceivingStream()
+void PipewireStream::initPw(pw_thread_loop *loop, pw_core *core)
 {
-    spa_rectangle pwMinScreenBounds = SPA_RECTANGLE(1, 1);
-    spa_rectangle pwMaxScreenBounds = SPA_RECTANGLE(UINT32_MAX, UINT32_MAX);
+    qInfo() << "Connecting stream" << pwStreamNodeId << "through a shared PipeWire loop";
 
-    spa_fraction pwFramerateMin = SPA_FRACTION(0, 1);
-    spa_fraction pwFramerateMax = SPA_FRACTION(60, 1);
+    m_ownsLoop = false;
+    pwMainLoop = loop;
+    pwCore = core;
+
+    pw_thread_loop_lock(pwMainLoop);
+    connectStream();
+    pw_thread_loop_unlock(pwMainLoop);
+}
+
+bool PipewireStream::connectStream()
+{
+    m_returnEvent = pw_loop_add_event(pw_thread_loop_get_loop(pwMainLoop), &onBuffersReturned, this);
+    m_renegotiateEvent = pw_loop_add_event(pw_thread_loop_get_loop(pwMainLoop), &onRenegotiate, this);
+#if HAVE_DMA_BUF
+    m_readbackEvent = pw_loop_add_event(pw_thread_loop_get_loop(pwMainLoop), &onReadbackPending, this);
+    m_readbackTimer = pw_loop_add_timer(pw_thread_loop_get_loop(pwMainLoop), &onReadbackTimeout, this);
+#endif /* HAVE_DMA_BUF */
+    startWorkers();
+
+    pwStream = createReceivingStream();
+    if (!pwStream) {
+        qWarning() << "Failed to create PipeWire stream";
+        isValid = false;
+        return false;
+    }
+
+    // connected once the first format is known
+    if (!sourceName.isEmpty()) {
+        m_source.reset(new PipewireSource(pwCore, sourceName));
+    }
+    return true;
+}
 
+pw_stream *PipewireStream::createReceivingStream()
+{
     pw_properties* reuseProps = pw_properties_new_string("pipewire.client.reuse=1");
 
     auto stream = pw_stream_new(pwCore, "krfb-fb-consume-stream", reuseProps);
 
-    uint8_t buffer[1024] = {};
-    const spa_pod *params[1];
+    uint8_t buffer[4096] = {};
     auto builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    QVector<const spa_pod *> params = buildFormatParams(&builder);
+
+    pw_stream_add_listener(stream, &streamListener, &pwStreamEvents, this);
+
+    if (pw_stream_connect(stream, PW_DIRECTION_INPUT, pwStreamNodeId, PW_STREAM_FLAG_AUTOCONNECT, params.data(), params.size()) != 0) {
+        isValid = false;
+    }
+
+    return stream;
+}
 
-    params[0] = reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(&builder,
+QVector<const spa_pod *> PipewireStream::buildFormatParams(spa_pod_builder *builder)
+{
+    QMutexLocker locker(&m_processMutex);
+    const RateLimits limits = m_rateLimits;
+    const QSize maxSize = m_nativeSize.isValid() && limits.scale < 100 ?
+                          QSize(qMax(1, m_nativeSize.width() * limits.scale / 100),
+                                qMax(1, m_nativeSize.height() * limits.scale / 100)) :
+                          QSize();
+#if HAVE_DMA_BUF
+    // modifiers can be dropped by a failed import on a worker
+    const QHash<uint32_t, QVector<uint64_t>> modifiers = m_egl.modifiers;
+#endif /* HAVE_DMA_BUF */
+    locker.unlock();
+
+    // a downscaled size is only an upper bound, compositors that can't scale
+    // keep sending the native size
+    spa_rectangle pwMinScreenBounds = SPA_RECTANGLE(1, 1);
+    spa_rectangle pwMaxScreenBounds = maxSize.isValid() ? SPA_RECTANGLE(uint32_t(maxSize.width()), uint32_t(maxSize.height())) :
+                                                          SPA_RECTANGLE(UINT32_MAX, UINT32_MAX);
+
+    spa_fraction pwFramerateMin = SPA_FRACTION(0, 1);
+    spa_fraction pwFramerateMax = SPA_FRACTION(uint32_t(limits.framerate), 1);
+
+    QVector<const spa_pod *> params;
+
+#if HAVE_DMA_BUF
+
+    // one format with the modifiers EGL imports; DONT_FIXATE lets the
+    // compositor pick one it can allocate, it answers with the fixed format
+    auto addModifierFormat = [&](uint32_t format, const QVector<uint64_t> &formatModifiers) {
+        spa_pod_frame formatFrame;
+        spa_pod_builder_push_object(builder, &formatFrame, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+        spa_pod_builder_add(builder, SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video), 0);
+        spa_pod_builder_add(builder, SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw), 0);
+        spa_pod_builder_add(builder, SPA_FORMAT_VIDEO_format, SPA_POD_Id(format), 0);
+        spa_pod_frame modifierFrame;
+        spa_pod_builder_prop(builder, SPA_FORMAT_VIDEO_modifier, SPA_POD_PROP_FLAG_MANDATORY | SPA_POD_PROP_FLAG_DONT_FIXATE);
+        spa_pod_builder_push_choice(builder, &modifierFrame, SPA_CHOICE_Enum, 0);
+        // the first value of an enum is its default
+        spa_pod_builder_long(builder, formatModifiers.first());
+        for (uint64_t modifier : formatModifiers) {
+            spa_pod_builder_long(builder, modifier);
+        }
+        spa_pod_builder_pop(builder, &modifierFrame);
+        spa_pod_builder_add(builder,
+                            SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle(&pwMaxScreenBounds, &pwMinScreenBounds, &pwMaxScreenBounds),
+                            SPA_FORMAT_VIDEO_framerate, SPA_POD_Fraction(&pwFramerateMin),
+                            SPA_FORMAT_VIDEO_maxFramerate, SPA_POD_CHOICE_RANGE_Fraction(&pwFramerateMax, &pwFramerateMin, &pwFramerateMax),
+                            0);
+        params.append(static_cast<const spa_pod *>(spa_pod_builder_pop(builder, &formatFrame)));
+    };
+#endif /* HAVE_DMA_BUF */
+
+    // one EnumFormat per entry, the compositor picks the first it can produce
+    for (StreamFormat preferred : qAsConst(formatPreference)) {
+        switch (preferred) {
+        case PackedRgbFormat:
+#if HAVE_DMA_BUF
+            for (auto it = modifiers.constBegin(); it != modifiers.constEnd(); ++it) {
+                if (!it.value().isEmpty()) {
+                    addModifierFormat(it.key(), it.value());
+                }
+            }
+#endif /* HAVE_DMA_BUF */
+            params.append(reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(builder,
                 SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
                 SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
                 SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
@@ -301,89 +724,115 @@ pw_stream *PipewireStream::createReceivingStream()
                                                     SPA_VIDEO_FORMAT_RGB, SPA_VIDEO_FORMAT_BGR),
                 SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle(&pwMaxScreenBounds, &pwMinScreenBounds, &pwMaxScreenBounds),
                 SPA_FORMAT_VIDEO_framerate, SPA_POD_Fraction(&pwFramerateMin),
-                SPA_FORMAT_VIDEO_maxFramerate, SPA_POD_CHOICE_RANGE_Fraction(&pwFramerateMax, &pwFramerateMin, &pwFramerateMax)));
-
-    pw_stream_add_listener(stream, &streamListener, &pwStreamEvents, this);
-
-    if (pw_stream_connect(stream, PW_DIRECTION_INPUT, pwStreamNodeId, PW_STREAM_FLAG_AUTOCONNECT, params, 1) != 0) {
-        isValid = false;
+                SPA_FORMAT_VIDEO_maxFramerate, SPA_POD_CHOICE_RANGE_Fraction(&pwFramerateMax, &pwFramerateMin, &pwFramerateMax))));
+            break;
+        case Nv12Format:
+        case I420Format:
+            // nothing but the encoder takes these, there is no RGB image to show
+            if (!encoder) {
+                break;
+            }
+            params.append(reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(builder,
+                SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
+                SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+                SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
+                SPA_FORMAT_VIDEO_format, SPA_POD_Id(preferred == Nv12Format ? SPA_VIDEO_FORMAT_NV12 : SPA_VIDEO_FORMAT_I420),
+                SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle(&pwMaxScreenBounds, &pwMinScreenBounds, &pwMaxScreenBounds),
+                SPA_FORMAT_VIDEO_framerate, SPA_POD_Fraction(&pwFramerateMin),
+                SPA_FORMAT_VIDEO_maxFramerate, SPA_POD_CHOICE_RANGE_Fraction(&pwFramerateMax, &pwFramerateMin, &pwFramerateMax))));
+            break;
+        case H264Format:
+        case MjpegFormat:
+            params.append(reinterpret_cast<spa_pod *>(spa_pod_builder_add_object(builder,
+                SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
+                SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
+                SPA_FORMAT_mediaSubtype, SPA_POD_Id(preferred == H264Format ? SPA_MEDIA_SUBTYPE_h264 : SPA_MEDIA_SUBTYPE_mjpg),
+                SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle(&pwMaxScreenBounds, &pwMinScreenBounds, &pwMaxScreenBounds),
+                SPA_FORMAT_VIDEO_framerate, SPA_POD_Fraction(&pwFramerateMin),
+                SPA_FORMAT_VIDEO_maxFramerate, SPA_POD_CHOICE_RANGE_Fraction(&pwFramerateMax, &pwFramerateMin, &pwFramerateMax))));
+            break;
+        }
     }
 
-    return stream;
+    return params;
 }
 
-void PipewireStream::handleFrame(pw_buffer *pwBuffer)
+bool PipewireStream::handleFrame(pw_buffer *pwBuffer, quint64 sequence)
 {
-      qWarning()  << "handleFrame buffer" << QDateTime::currentDateTime();
     auto spaBuffer = pwBuffer->buffer;
-    uint8_t *src = nullptr;
 
-    if (spaBuffer->datas[0].chunk->size == 0) {
-        qWarning()  << "discarding null buffer";
-        return;
+    // onStreamProcess filters these, recordings replay straight into here
+    if (!hasFrameContent(spaBuffer)) {
+        ++stats.nullChunks;
+        return false;
     }
 
-    std::function<void()> cleanup;
-    const qint64 srcStride = spaBuffer->datas[0].chunk->stride;
-    if (spaBuffer->datas->type == SPA_DATA_MemFd) {
-        uint8_t *map = static_cast<uint8_t*>(mmap(
-            nullptr, spaBuffer->datas->maxsize + spaBuffer->datas->mapoffset,
-            PROT_READ, MAP_PRIVATE, spaBuffer->datas->fd, 0));
+    if (videoFormat.format == SPA_VIDEO_FORMAT_ENCODED) {
+        processPacket(spaBuffer);
+        return false;
+    }
 
-        if (map == MAP_FAILED) {
-            qWarning() << "Failed to mmap the memory: " << strerror(errno);
-            return;
-        }
-        src = SPA_MEMBER(map, spaBuffer->datas[0].mapoffset, uint8_t);
+    QRect crop;
+    if (!frameCrop(spaBuffer, &crop)) {
+        return false;
+    }
+
+    qint64 pts = -1;
+    struct spa_meta_header *header = static_cast<struct spa_meta_header*>(
+        spa_buffer_find_meta_data(spaBuffer, SPA_META_Header, sizeof(*header)));
+    if (header) {
+        pts = header->pts;
+    }
 
-        cleanup = [map, spaBuffer] {
-            munmap(map, spaBuffer->datas->maxsize + spaBuffer->datas->mapoffset);
-        };
-    } else if (spaBuffer->datas[0].type == SPA_DATA_MemPtr) {
-        src = static_cast<uint8_t*>(spaBuffer->datas[0].data);
+    if (planeCount(videoFormat.format) > 1) {
+        processYuvFrame(spaBuffer, crop, pts);
+        return false;
+    }
+
+    QRegion damage;
+    frameDamage(spaBuffer, crop, &damage);
+
+    const qint64 srcStride = spaBuffer->datas[0].chunk->stride;
+    if (spaBuffer->datas->type == SPA_DATA_MemFd || spaBuffer->datas->type == SPA_DATA_MemPtr) {
+        QSharedPointer<MemFdMapping> mapping;
+        const uint8_t *src = mapData(spaBuffer->datas[0], &mapping);
+        if (!src) {
+            return false;
+        }
+        if (recorder) {
+            recorder->recordFrame(spaBuffer->datas->type, src, srcStride, spaBuffer->datas[0].chunk->size,
+                                  crop, damage, pts, sequence);
+        }
+        processFrame(src, srcStride, crop, damage, sequence, pts);
     }
 #if HAVE_DMA_BUF
     else if (spaBuffer->datas->type == SPA_DATA_DmaBuf) {
         if (!m_eglInitialized) {
             // Shouldn't reach this
             qWarning() << "Failed to process DMA buffer.";
-            return;
-        }
-
-        gbm_import_fd_data importInfo = {static_cast<int>(spaBuffer->datas->fd), static_cast<uint32_t>(streamSize.width()),
-                                         static_cast<uint32_t>(streamSize.height()), static_cast<uint32_t>(spaBuffer->datas[0].chunk->stride), GBM_BO_FORMAT_ARGB8888};
-        gbm_bo *imported = gbm_bo_import(m_gbmDevice, GBM_BO_IMPORT_FD, &importInfo, GBM_BO_USE_SCANOUT);
-        if (!imported) {
-            qWarning() << "Failed to process buffer: Cannot import passed GBM fd - " << strerror(errno);
-            return;
+            return false;
         }
 
         // bind context to render thread
+        const qint64 importStart = StreamStats::now();
         eglMakeCurrent(m_egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, m_egl.context);
 
-        // create EGL image from imported BO
-        EGLImageKHR image = eglCreateImageKHR(m_egl.display, nullptr, EGL_NATIVE_PIXMAP_KHR, imported, nullptr);
-
-        if (image == EGL_NO_IMAGE_KHR) {
-            qWarning() << "Failed to record frame: Error creating EGLImageKHR - " << formatGLError(glGetError());
-            gbm_bo_destroy(imported);
-            return;
+        // a readback holds its buffer, one has to stay with the compositor
+        const int depth = qBound(1, readbackDepth, m_bufferTokens.size() - 1);
+        if (m_readback.depth() != depth) {
+            // deliver what is in flight before resizing the ring
+            completeReadbacks(true);
+            m_readback.setDepth(depth);
         }
 
-        // create GL 2D texture for framebuffer
-        GLuint texture;
-        glGenTextures(1, &texture);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glBindTexture(GL_TEXTURE_2D, texture);
-        glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
-
-        src = static_cast<uint8_t*>(malloc(srcStride * streamSize.height()));
+        const DmaBufImport *import = importDmaBuf(spaBuffer);
+        if (!import) {
+            eglMakeCurrent(m_egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+            return false;
+        }
 
         GLenum glFormat = GL_BGRA;
-        switch (videoFormat->format) {
+        switch (videoFormat.format) {
             case SPA_VIDEO_FORMAT_RGBx:
                 glFormat = GL_RGBA;
                 break;
@@ -403,114 +852,1021 @@ void PipewireStream::handleFrame(pw_buffer *pwBuffer)
                 glFormat = GL_BGRA;
                 break;
         }
-        glGetTexImage(GL_TEXTURE_2D, 0, glFormat, GL_UNSIGNED_BYTE, src);
 
-        if (!src) {
-            qWarning() << "Failed to get image from DMA buffer.";
-            gbm_bo_destroy(imported);
-            return;
+        // read back tightly packed rows, the buffer stays with us until the
+        // copy finished so the compositor can't overwrite it meanwhile
+        PboReadback::Frame frame;
+        frame.buffer = pwBuffer;
+        frame.crop = crop;
+        frame.damage = damage;
+        frame.sequence = sequence;
+        frame.pts = pts;
+        frame.stride = SPA_ROUND_UP_N(streamSize.width() * converter.bytesPerPixel(), 4);
+        m_readback.start(import->texture, glFormat, frame, streamSize.height());
+
+        const GLenum error = glGetError();
+        if (error != GL_NO_ERROR) {
+            qWarning() << "Failed to get image from DMA buffer: " << formatGLError(error);
         }
+        stats.map.record(StreamStats::now() - importStart);
 
-        cleanup = [src] {
-            free(src);
-        };
-
-        glDeleteTextures(1, &texture);
-        eglDestroyImageKHR(m_egl.display, image);
+        // deliver what the GPU finished, and the oldest frame once every
+        // slot is in use
+        completeReadbacks(false);
+        if (m_readback.isFull()) {
+            completeReadback();
+        }
+        // a damage driven compositor may send nothing for a while, the rest
+        // is delivered after a frame period then
+        if (m_readback.pending()) {
+            pw_loop_signal_event(pw_thread_loop_get_loop(pwMainLoop), m_readbackEvent);
+        }
 
-        gbm_bo_destroy(imported);
+        // release the context so buffers can be dropped from other threads
+        eglMakeCurrent(m_egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        return true;
     }
 #endif /* HAVE_DMA_BUF */
 
-    struct spa_meta_region* videoMetadata =
-    static_cast<struct spa_meta_region*>(spa_buffer_find_meta_data(
-        spaBuffer, SPA_META_VideoCrop, sizeof(*videoMetadata)));
+    return false;
+}
 
-    if (videoMetadata && (videoMetadata->region.size.width > static_cast<uint32_t>(streamSize.width()) ||
-                          videoMetadata->region.size.height > static_cast<uint32_t>(streamSize.height()))) {
-        qWarning() << "Stream metadata sizes are wrong!";
-        return;
-    }
+static void releaseImageBuffer(void *info)
+{
+    delete static_cast<FrameBufferHandle *>(info);
+}
 
-    // Use video metadata when video size from metadata is set and smaller than
-    // video stream size, so we need to adjust it.
-    bool videoFullWidth = true;
-    bool videoFullHeight = true;
-    if (videoMetadata && videoMetadata->region.size.width != 0 &&
-        videoMetadata->region.size.height != 0) {
-        if (videoMetadata->region.size.width < static_cast<uint32_t>(streamSize.width())) {
-            videoFullWidth = false;
-        } else if (videoMetadata->region.size.height < static_cast<uint32_t>(streamSize.height())) {
-            videoFullHeight = false;
-        }
+void PipewireStream::processFrame(const uint8_t *src, qint64 srcStride, const QRect &crop, const QRegion &damage, quint64 sequence, qint64 pts)
+{
+    // workers may finish out of order, never go back to an older frame
+    if (sequence <= m_lastSequence) {
+        return;
     }
+    // damage only describes the change from the frame right before
+    const bool contiguous = sequence == m_lastSequence + 1;
+    m_lastSequence = sequence;
 
     QSize prevVideoSize = videoSize;
-    if (!videoFullHeight || !videoFullWidth) {
-        videoSize = QSize(videoMetadata->region.size.width, videoMetadata->region.size.height);
-    } else {
-        videoSize = streamSize;
+    videoSize = crop.size();
+    const int bpp = converter.bytesPerPixel();
+
+    // the stitched desktop takes the place of fb, 24 bit frames can't go there
+    FrameStitcher::Target target;
+    const bool stitched = stitcher && bpp == 4 && stitcher->beginWrite(this, videoSize, &target);
+    if (stitched != m_stitched) {
+        m_stitched = stitched;
+        m_fbValid = false;
     }
 
-    if (!fb || videoSize != prevVideoSize) {
-        if (fb) {
-            free(fb);
+    uint8_t *dst = nullptr;
+    qint64 dstStride = 0;
+    if (stitched) {
+        dst = target.data;
+        dstStride = target.stride;
+        if (!target.valid) {
+            m_fbValid = false;
         }
-        fb = static_cast<char*>(malloc(videoSize.width() * videoSize.height() * BYTES_PER_PIXEL));
+    } else {
+        const size_t fbSize = size_t(videoSize.width()) * videoSize.height() * bpp;
+        if (!fb || videoSize != prevVideoSize || fb->size() < fbSize) {
+            // the old buffer goes back to the pool unless a consumer holds it
+            fb = framePool->acquire(fbSize);
+            m_fbValid = false;
+
+            if (!fb) {
+                qWarning() << "Failed to allocate buffer";
+                isValid = false;
+                return;
+            }
 
-        if (!fb) {
-            qWarning() << "Failed to allocate buffer";
-            isValid = false;
-            return;
+            //Q_EMIT q->frameBufferChanged();
+        } else if (fb.use_count() > 1) {
+            // a consumer kept the last image, continue in a copy of it so
+            // damage still applies
+            FrameBufferHandle fresh = framePool->acquire(fbSize);
+            if (!fresh) {
+                qWarning() << "Failed to allocate buffer";
+                isValid = false;
+                return;
+            }
+            if (m_fbValid) {
+                std::memcpy(fresh->data(), fb->data(), fbSize);
+            }
+            fb = fresh;
         }
 
-        //Q_EMIT q->frameBufferChanged();
+        dst = fb->data();
+        dstStride = videoSize.width() * bpp;
+        Q_ASSERT(dstStride <= srcStride);
     }
 
-    const qint32 dstStride = videoSize.width() * BYTES_PER_PIXEL;
-    Q_ASSERT(dstStride <= srcStride);
+    src += srcStride * crop.y() + crop.x() * bpp;
+
+    // fb still holds the previous frame, so only what changed needs converting
+    const QRect frameRect(QPoint(0, 0), videoSize);
+    QRegion updated;
+    if (m_fbValid && contiguous && !damage.isEmpty()) {
+        updated = damage & frameRect;
+        // the hashes no longer describe fb
+        m_tileHasher.invalidate();
+    } else if (tileHashing) {
+        // no usable damage, compare against the hashes of the frame in fb
+        if (!m_fbValid) {
+            m_tileHasher.invalidate();
+        }
+        const qint64 hashStart = StreamStats::now();
+        updated = m_tileHasher.update(src, srcStride, videoSize, bpp);
+        stats.hash.record(StreamStats::now() - hashStart);
+    } else {
+        updated = frameRect;
+        m_tileHasher.invalidate();
+    }
 
-    if (!videoFullHeight && (videoMetadata->region.position.y + videoSize.height() <=  streamSize.height())) {
-        src += srcStride * videoMetadata->region.position.y;
+    if (m_fbValid && updated.isEmpty()) {
+        ++stats.unchangedFrames;
+        if (stitched) {
+            stitcher->endWrite(this, QRegion());
+        }
+        return;
     }
 
-    const int xOffset = !videoFullWidth && (videoMetadata->region.position.x + videoSize.width() <= streamSize.width())
-                            ? videoMetadata->region.position.x * BYTES_PER_PIXEL : 0;
+    // copy, crop and swizzle in a single pass per row
+    const qint64 convertStart = StreamStats::now();
+    auto convertRect = [&](const QRect &rect) {
+        converter.convert(src + rect.y() * srcStride + rect.x() * bpp, srcStride,
+                          dst + rect.y() * dstStride + rect.x() * bpp, dstStride,
+                          rect.width(), rect.height());
+    };
+
+    qint64 updatedPixels = 0;
+    for (const QRect &rect : updated) {
+        updatedPixels += qint64(rect.width()) * rect.height();
+    }
 
-    char *dst = fb;
-    for (int i = 0; i < videoSize.height(); ++i) {
-        // Adjust source content based on crop video position if needed
-        src += xOffset;
-        std::memcpy(dst, src, dstStride);
+    // the pyramid levels are scaled from each band right after converting it
+    FramePyramid *pyramid = m_pyramid && !stitched && bpp == 4 ? m_pyramid.get() : nullptr;
+    if (pyramid) {
+        pyramid->begin(videoSize, updated, qMax(1, conversionBandHeight));
+    }
 
-        if (videoFormat->format == SPA_VIDEO_FORMAT_BGRA || videoFormat->format == SPA_VIDEO_FORMAT_BGRx) {
-            for (int j = 0; j < dstStride; j += 4) {
-                std::swap(dst[j], dst[j + 2]);
+    // a band of whole rows, converting its slice of the update
+    auto convertBand = [&](int y, int rows) {
+        const QRect band(0, y, videoSize.width(), rows);
+        for (const QRect &rect : updated) {
+            const QRect slice = rect & band;
+            if (!slice.isEmpty()) {
+                convertRect(slice);
             }
         }
+        if (pyramid) {
+            pyramid->scaleBand(dst, dstStride, y, rows);
+        }
+    };
+
+    if (m_bandPool && updatedPixels >= minParallelPixels) {
+        m_bandPool->run(videoSize.height(), conversionBandHeight, convertBand);
+    } else if (pyramid) {
+        const int bandHeight = qMax(1, conversionBandHeight);
+        for (int y = 0; y < videoSize.height(); y += bandHeight) {
+            convertBand(y, qMin(bandHeight, videoSize.height() - y));
+        }
+    } else {
+        for (const QRect &rect : updated) {
+            convertRect(rect);
+        }
+    }
+    if (pyramid) {
+        pyramid->finish(dst, dstStride);
+    }
+    stats.convert.record(StreamStats::now() - convertStart);
+    m_fbValid = true;
+
+    if (frameRing) {
+        frameRing->publish(dst, dstStride, videoSize, FrameConverter::outputFormat(videoFormat.format), updated, sequence, pts);
+    }
+
+    if (stitched) {
+        // the stitcher emits the desktop on its own cadence
+        stitcher->endWrite(this, updated);
+    }
 
-        src += srcStride - xOffset;
-        dst += dstStride;
+    if (m_source) {
+        m_source->publish(src, srcStride, videoSize, updated, sequence, pts);
     }
 
-    if (spaBuffer->datas->type == SPA_DATA_MemFd ||
-        spaBuffer->datas->type == SPA_DATA_DmaBuf) {
-        cleanup();
+    if (encoder) {
+        // frames without a header are stamped on arrival
+        encoder->submit(src, srcStride, videoSize, videoFormat.format, pts >= 0 ? pts : StreamStats::now());
     }
 
-    if (videoFormat->format != SPA_VIDEO_FORMAT_RGB) {
-        const QImage::Format format = videoFormat->format == SPA_VIDEO_FORMAT_BGR  ? QImage::Format_BGR888
-                                    : videoFormat->format == SPA_VIDEO_FORMAT_RGBx ? QImage::Format_RGBX8888
+    if (!stitched && videoFormat.format != SPA_VIDEO_FORMAT_RGB) {
+        const QImage::Format format = videoFormat.format == SPA_VIDEO_FORMAT_BGR  ? QImage::Format_BGR888
+                                    : videoFormat.format == SPA_VIDEO_FORMAT_RGBx ? QImage::Format_RGBX8888
                                                                                    : QImage::Format_RGB32;
 
-        QImage img((uchar*)fb, videoSize.width(), videoSize.height(), dstStride, format);
-       // img.convertTo(QImage::Format_RGB888);
-        static int i = 0;
-        QString filename = QString("/home/uos/Pictures/output/output%1.png").arg(i++);
-        qWarning() << "savefile" <<filename; //img.save(filename);
-        emit ImageReady(&img);
+        // consumers may keep a copy of the image, it holds the buffer
+        QImage img(fb->data(), videoSize.width(), videoSize.height(), dstStride, format,
+                   releaseImageBuffer, new FrameBufferHandle(fb));
+        const qint64 emitStart = StreamStats::now();
+        emit ImageReady(&img, updated);
+        if (pyramid) {
+            for (int i = 0; i < pyramid->levelCount(); ++i) {
+                const FramePyramid::Output &level = pyramid->output(i);
+                if (!level.buffer || level.damage.isEmpty()) {
+                    continue;
+                }
+                QImage levelImg(level.buffer->data(), level.size.width(), level.size.height(), level.stride, format,
+                                releaseImageBuffer, new FrameBufferHandle(level.buffer));
+                emit LevelReady(i, &levelImg, level.damage);
+            }
+        }
+        stats.emission.record(StreamStats::now() - emitStart);
     }
+}
 
-    //q->tiles.append(QRect(0, 0, videoSize.width(), videoSize.height()));
+
+const uint8_t *PipewireStream::mapData(const spa_data &data, QSharedPointer<MemFdMapping> *mapping)
+{
+    if (data.type == SPA_DATA_MemFd) {
+        const qint64 mapStart = StreamStats::now();
+        *mapping = mapMemFd(data);
+        stats.map.record(StreamStats::now() - mapStart);
+        if (!*mapping) {
+            return nullptr;
+        }
+        return SPA_MEMBER((*mapping)->map, data.mapoffset + data.chunk->offset, uint8_t);
+    }
+    if (data.type == SPA_DATA_MemPtr) {
+        return SPA_MEMBER(data.data, data.chunk->offset, uint8_t);
+    }
+    return nullptr;
 }
 
+void PipewireStream::processYuvFrame(spa_buffer *spaBuffer, const QRect &crop, qint64 pts)
+{
+    const bool nv12 = videoFormat.format == SPA_VIDEO_FORMAT_NV12;
+    const uint32_t planes = nv12 ? 2 : 3;
+    // buildFormatParams only offers these with an encoder attached
+    if (!encoder) {
+        ++stats.yuvDrops;
+        return;
+    }
+
+    // bytes and rows each plane needs at the negotiated size
+    const int chromaRows = (streamSize.height() + 1) / 2;
+    const qint64 rowBytes[3] = {streamSize.width(), nv12 ? (streamSize.width() + 1) / 2 * 2 : (streamSize.width() + 1) / 2,
+                                (streamSize.width() + 1) / 2};
+    const int rows[3] = {streamSize.height(), chromaRows, chromaRows};
+
+    QSharedPointer<MemFdMapping> mappings[3];
+    const uint8_t *data[3] = {};
+    qint64 strides[3] = {};
+
+    if (spaBuffer->n_datas >= planes) {
+        // one block per plane, each with its own stride
+        for (uint32_t i = 0; i < planes; ++i) {
+            const spa_data &plane = spaBuffer->datas[i];
+            strides[i] = plane.chunk->stride;
+            if (strides[i] < rowBytes[i] || strides[i] * (rows[i] - 1) + rowBytes[i] > plane.chunk->size) {
+                ++stats.nullChunks;
+                return;
+            }
+            data[i] = mapData(plane, &mappings[i]);
+            if (!data[i]) {
+                return;
+            }
+        }
+    } else {
+        // planes follow each other in a single block, with only the luma
+        // stride given: chroma rows are as long (NV12) or half as long
+        // (I420), like the buffers sized in onStreamParamChanged
+        const spa_data &block = spaBuffer->datas[0];
+        strides[0] = block.chunk->stride > 0 ? block.chunk->stride : SPA_ROUND_UP_N(streamSize.width(), 4);
+        strides[1] = nv12 ? strides[0] : strides[0] / 2;
+        strides[2] = nv12 ? 0 : strides[1];
+        qint64 size = 0;
+        for (uint32_t i = 0; i < planes; ++i) {
+            if (strides[i] < rowBytes[i]) {
+                size = -1;
+                break;
+            }
+            size += strides[i] * rows[i];
+        }
+        if (size < 0 || size > block.chunk->size) {
+            ++stats.nullChunks;
+            return;
+        }
+
+        data[0] = mapData(block, &mappings[0]);
+        if (!data[0]) {
+            return;
+        }
+        data[1] = data[0] + strides[0] * rows[0];
+        if (!nv12) {
+            data[2] = data[1] + strides[1] * rows[1];
+        }
+    }
+
+    // the frame is already what an encoder wants
+    encoder->submitYuv(data, strides, crop, nv12 ? YuvConverter::NV12 : YuvConverter::I420,
+                       pts >= 0 ? pts : StreamStats::now());
+}
+
+void PipewireStream::processPacket(spa_buffer *spaBuffer)
+{
+    QSharedPointer<MemFdMapping> mapping;
+    const uint8_t *data = mapData(spaBuffer->datas[0], &mapping);
+    if (!data) {
+        return;
+    }
+
+    qint64 pts = -1;
+    struct spa_meta_header *header = static_cast<struct spa_meta_header*>(
+        spa_buffer_find_meta_data(spaBuffer, SPA_META_Header, sizeof(*header)));
+    if (header) {
+        pts = header->pts;
+    }
+
+    const QByteArray packet(reinterpret_cast<const char *>(data), spaBuffer->datas[0].chunk->size);
+    const qint64 emitStart = StreamStats::now();
+    emit PacketReady(packet, pts);
+    stats.emission.record(StreamStats::now() - emitStart);
+}
+
+bool PipewireStream::frameDamage(spa_buffer *spaBuffer, const QRect &crop, QRegion *damage)
+{
+    spa_meta *meta = spa_buffer_find_meta(spaBuffer, SPA_META_VideoDamage);
+    if (!meta) {
+        return false;
+    }
+
+    // the list ends at the first region without a size; translate what is
+    // left into the cropped frame
+    const QRect frameRect(QPoint(0, 0), crop.size());
+    spa_meta_region *region;
+    spa_meta_for_each(region, meta) {
+        if (!spa_meta_region_is_valid(region)) {
+            break;
+        }
+        *damage += QRect(region->region.position.x - crop.x(), region->region.position.y - crop.y(),
+                         region->region.size.width, region->region.size.height) & frameRect;
+    }
+
+    // no regions tells us nothing, treat it as a full update
+    return !damage->isEmpty();
+}
+
+bool PipewireStream::hasFrameContent(spa_buffer *spaBuffer)
+{
+    // compositors send cursor updates in buffers without or with corrupted data
+    const spa_chunk *chunk = spaBuffer->datas[0].chunk;
+    return chunk->size != 0 && !(chunk->flags & SPA_CHUNK_FLAG_CORRUPTED);
+}
+
+bool PipewireStream::hasCursor(spa_buffer *spaBuffer)
+{
+    spa_meta *meta = spa_buffer_find_meta(spaBuffer, SPA_META_Cursor);
+    return meta && meta->size >= sizeof(spa_meta_cursor)
+        && spa_meta_cursor_is_valid(static_cast<const spa_meta_cursor *>(meta->data));
+}
+
+void PipewireStream::updateCursor(spa_buffer *spaBuffer)
+{
+    spa_meta *meta = spa_buffer_find_meta(spaBuffer, SPA_META_Cursor);
+    if (!meta || meta->size < sizeof(spa_meta_cursor)) {
+        return;
+    }
+    const spa_meta_cursor *cursorMeta = static_cast<const spa_meta_cursor *>(meta->data);
+
+    // the position is in buffer coordinates, the frames start at the crop
+    QRect crop;
+    if (cropMetadata(spaBuffer, &crop)) {
+        m_cursorCropOrigin = crop.topLeft();
+    } else if (hasFrameContent(spaBuffer)) {
+        m_cursorCropOrigin = QPoint();
+    }
+
+    Cursor cursor = m_cursor;
+    cursor.visible = spa_meta_cursor_is_valid(cursorMeta);
+    if (cursor.visible) {
+        cursor.position = QPoint(cursorMeta->position.x, cursorMeta->position.y) - m_cursorCropOrigin;
+        cursor.hotspot = QPoint(cursorMeta->hotspot.x, cursorMeta->hotspot.y);
+    }
+
+    // a bitmap only comes with a new shape, an empty one hides the cursor
+    if (cursor.visible && cursorMeta->bitmap_offset >= sizeof(spa_meta_cursor)
+            && cursorMeta->bitmap_offset + sizeof(spa_meta_bitmap) <= meta->size) {
+        const spa_meta_bitmap *bitmap = SPA_MEMBER(cursorMeta, cursorMeta->bitmap_offset, spa_meta_bitmap);
+        const QSize size(bitmap->size.width, bitmap->size.height);
+        const QImage::Format format = bitmap->format == SPA_VIDEO_FORMAT_BGRA ? QImage::Format_ARGB32_Premultiplied
+                                    : bitmap->format == SPA_VIDEO_FORMAT_RGBA ? QImage::Format_RGBA8888_Premultiplied
+                                                                              : QImage::Format_Invalid;
+        if (size.isEmpty()) {
+            cursor.image = QImage();
+        } else if (format != QImage::Format_Invalid && bitmap->offset >= sizeof(spa_meta_bitmap)
+                   && bitmap->stride >= size.width() * 4
+                   && cursorMeta->bitmap_offset + bitmap->offset + quint64(bitmap->stride) * size.height() <= meta->size) {
+            const uchar *pixels = SPA_MEMBER(bitmap, bitmap->offset, const uchar);
+            cursor.image = QImage(pixels, size.width(), size.height(), bitmap->stride, format).copy();
+        } else if (bitmap->format != m_ignoredCursorFormat) {
+            m_ignoredCursorFormat = bitmap->format;
+            qWarning() << "Ignoring cursor bitmap of format" << bitmap->format << "and size" << size;
+        }
+    }
+    cursor.visible = cursor.visible && !cursor.image.isNull();
+
+    if (cursor.visible == m_cursor.visible && cursor.position == m_cursor.position
+            && cursor.hotspot == m_cursor.hotspot && cursor.image.cacheKey() == m_cursor.image.cacheKey()) {
+        return;
+    }
+    m_cursor = cursor;
+    emit CursorChanged(m_cursor);
+}
+
+bool PipewireStream::frameCrop(spa_buffer *spaBuffer, QRect *crop)
+{
+    struct spa_meta_region* videoMetadata =
+    static_cast<struct spa_meta_region*>(spa_buffer_find_meta_data(
+        spaBuffer, SPA_META_VideoCrop, sizeof(*videoMetadata)));
+
+    if (videoMetadata && (videoMetadata->region.size.width > static_cast<uint32_t>(streamSize.width()) ||
+                          videoMetadata->region.size.height > static_cast<uint32_t>(streamSize.height()))) {
+        qWarning() << "Stream metadata sizes are wrong!";
+        ++stats.cropRejects;
+        return false;
+    }
+
+    if (!cropMetadata(spaBuffer, crop)) {
+        *crop = QRect(QPoint(0, 0), streamSize);
+    }
+    return true;
+}
+
+bool PipewireStream::cropMetadata(spa_buffer *spaBuffer, QRect *crop) const
+{
+    const spa_meta_region *videoMetadata = static_cast<const spa_meta_region *>(
+        spa_buffer_find_meta_data(spaBuffer, SPA_META_VideoCrop, sizeof(*videoMetadata)));
+
+    // an empty region means no crop
+    if (!videoMetadata || videoMetadata->region.size.width == 0 || videoMetadata->region.size.height == 0 ||
+        videoMetadata->region.size.width > static_cast<uint32_t>(streamSize.width()) ||
+        videoMetadata->region.size.height > static_cast<uint32_t>(streamSize.height())) {
+        return false;
+    }
+
+    const spa_region &region = videoMetadata->region;
+    *crop = QRect(0, 0, region.size.width, region.size.height);
+
+    // Adjust source content based on crop video position if needed
+    if (region.position.x >= 0 && region.position.x + crop->width() <= streamSize.width()) {
+        crop->moveLeft(region.position.x);
+    }
+    if (region.position.y >= 0 && region.position.y + crop->height() <= streamSize.height()) {
+        crop->moveTop(region.position.y);
+    }
+    return true;
+}
+
+bool PipewireStream::deliverFrame(pw_buffer *pwBuffer)
+{
+    auto spaBuffer = pwBuffer->buffer;
+
+    // a handle keeps the MemFd mapping alive, MemPtr memory belongs to the
+    // producer and is gone after remove_buffer, so those frames are copied
+    if (spaBuffer->datas[0].type != SPA_DATA_MemFd) {
+        return false;
+    }
+
+    QMutexLocker locker(&m_processMutex);
+
+    // handles describe a single packed plane
+    if (videoFormat.format == SPA_VIDEO_FORMAT_ENCODED || planeCount(videoFormat.format) > 1) {
+        return false;
+    }
+
+    QRect crop;
+    if (!frameCrop(spaBuffer, &crop)) {
+        releaseBuffer(pwBuffer);
+        return true;
+    }
+
+    // not announced through add_buffer, nothing could invalidate a handle
+    const std::shared_ptr<BufferToken> token = m_bufferTokens.value(pwBuffer);
+    if (!token) {
+        return false;
+    }
+
+    const qint64 mapStart = StreamStats::now();
+    QSharedPointer<MemFdMapping> mapping = mapMemFd(spaBuffer->datas[0]);
+    stats.map.record(StreamStats::now() - mapStart);
+    if (!mapping) {
+        releaseBuffer(pwBuffer);
+        return true;
+    }
+    const uint8_t *data = SPA_MEMBER(mapping->map, spaBuffer->datas[0].mapoffset, uint8_t) + spaBuffer->datas[0].chunk->offset;
+
+    // the handle holds the mapping in case the buffer is removed meanwhile
+    std::function<void()> release = [token, mapping] {
+        token->release();
+    };
+
+    PipewireFrameHandle frame(new PipewireFrame(data, spaBuffer->datas[0].chunk->stride, streamSize, crop,
+                                                videoFormat.format, std::move(release)));
+
+    struct spa_meta_header *header = static_cast<struct spa_meta_header*>(
+        spa_buffer_find_meta_data(spaBuffer, SPA_META_Header, sizeof(*header)));
+    if (header) {
+        frame->pts = header->pts;
+    }
+    if (!frameDamage(spaBuffer, crop, &frame->damage)) {
+        frame->damage = QRect(QPoint(0, 0), crop.size());
+    }
+
+    // consumers run unlocked, so several workers can serve them at once
+    locker.unlock();
+
+    const qint64 emitStart = StreamStats::now();
+    emit FrameReady(frame);
+    stats.emission.record(StreamStats::now() - emitStart);
+    return true;
+}
+
+QString PipewireStream::statsSummary() const
+{
+    QString summary = stats.summary();
+    if (m_source) {
+        summary += QLatin1Char('\n') + m_source->summary();
+    }
+    return summary;
+}
+
+void PipewireStream::setRateControl(int msec, std::unique_ptr<RatePolicy> policy)
+{
+    if (msec <= 0) {
+        delete m_rateTimer;
+        m_rateTimer = nullptr;
+        m_rateController.reset();
+        applyRateLimits(RateLimits());
+        return;
+    }
+
+    if (!m_rateTimer || policy) {
+        m_rateController.reset(new RateController(std::move(policy)));
+    }
+    if (!m_rateTimer) {
+        m_rateTimer = new QTimer(this);
+        connect(m_rateTimer, &QTimer::timeout, this, [this] {
+            const int capacity = m_workers.isEmpty() ? 0 : handoffCapacity + m_workers.size();
+            applyRateLimits(m_rateController->sample(stats, m_framesInFlight.load(), capacity, qMax(1, m_workers.size())));
+        });
+    }
+    m_rateTimer->start(msec);
+}
+
+void PipewireStream::applyRateLimits(const RateLimits &limits)
+{
+    QMutexLocker locker(&m_processMutex);
+    if (limits == m_rateLimits) {
+        return;
+    }
+    m_rateLimits = limits;
+    locker.unlock();
+
+    stats.framerateLimit = limits.framerate;
+    stats.scaleLimit = limits.scale;
+    qInfo() << "Stream" << pwStreamNodeId << "limits changed to" << limits.framerate << "fps at" << limits.scale << "% size";
+    emit RateLimitsChanged(limits.framerate, limits.scale);
+
+    if (m_renegotiateEvent) {
+        pw_loop_signal_event(pw_thread_loop_get_loop(pwMainLoop), m_renegotiateEvent);
+    }
+}
+
+void PipewireStream::releaseBuffer(pw_buffer *pwBuffer)
+{
+    // buffers can be given back on any thread; don't take the loop lock for
+    // it, the loop may be waiting on the very thread releasing the buffer
+    if (!m_returnedBuffers.push(pwBuffer)) {
+        qWarning() << "Returned buffer queue overflow";
+        return;
+    }
+
+    pw_loop_signal_event(pw_thread_loop_get_loop(pwMainLoop), m_returnEvent);
+}
+
+void PipewireStream::BufferToken::release()
+{
+    QMutexLocker locker(&mutex);
+    if (stream) {
+        stream->releaseBuffer(buffer);
+    }
+}
+
+void PipewireStream::BufferToken::invalidate()
+{
+    // waits for a release in progress, its buffer is then in the returned
+    // queue and dropped from there
+    QMutexLocker locker(&mutex);
+    stream = nullptr;
+}
+
+void PipewireStream::onBuffersReturned(void *data, uint64_t count)
+{
+    Q_UNUSED(count);
+    auto d = static_cast<PipewireStream *>(data);
+
+    d->queueBuffersBack();
+}
+
+void PipewireStream::queueBuffersBack(pw_buffer *except)
+{
+    pw_buffer *buffer = nullptr;
+    while (m_returnedBuffers.pop(buffer)) {
+        if (buffer != except) {
+            pw_stream_queue_buffer(pwStream, buffer);
+        }
+    }
+}
+
+void PipewireStream::startWorkers()
+{
+    if (conversionThreads > 1) {
+        m_bandPool.reset(new BandPool(conversionThreads - 1));
+    }
+    if (!pyramidLevels.isEmpty()) {
+        m_pyramid.reset(new FramePyramid(pyramidLevels, framePool));
+    }
+
+    if (workerCount <= 0) {
+        return;
+    }
+
+    m_handoff.reset(new BoundedQueue<QueuedFrame>(handoffCapacity));
+    m_freeSlots.release(qMax(1, handoffCapacity));
+
+    for (int i = 0; i < workerCount; ++i) {
+        QThread *worker = QThread::create([this] {
+            for (;;) {
+                m_queuedFrames.acquire();
+                QueuedFrame frame;
+                m_handoff->pop(frame);
+                m_freeSlots.release();
+
+                if (!frame.buffer) {
+                    // stop request
+                    return;
+                }
+
+                processQueuedFrame(frame);
+                frameDone();
+            }
+        });
+        worker->setObjectName(QStringLiteral("pipewire-frame-worker-%1").arg(i));
+        worker->start();
+        m_workers.append(worker);
+    }
+}
+
+void PipewireStream::stopWorkers()
+{
+    for (int i = 0; i < m_workers.size(); ++i) {
+        m_freeSlots.acquire();
+        m_handoff->push(QueuedFrame());
+        m_queuedFrames.release();
+    }
+
+    for (QThread *worker : qAsConst(m_workers)) {
+        worker->wait();
+        delete worker;
+    }
+    m_workers.clear();
+}
+
+void PipewireStream::enqueueFrame(const QueuedFrame &frame)
+{
+    switch (overflowPolicy) {
+    case BlockWhenFull:
+        m_freeSlots.acquire();
+        break;
+    case DropNewest:
+        if (!m_freeSlots.tryAcquire()) {
+            ++stats.queueDrops;
+            pw_stream_queue_buffer(pwStream, frame.buffer);
+            return;
+        }
+        break;
+    case DropOldest:
+        if (!m_freeSlots.tryAcquire()) {
+            // claim the oldest frame before a worker does and take over its
+            // slot; if the workers got them all, one of them is about to
+            // free a slot
+            if (m_queuedFrames.tryAcquire()) {
+                QueuedFrame oldest;
+                m_handoff->pop(oldest);
+                ++stats.queueDrops;
+                pw_stream_queue_buffer(pwStream, oldest.buffer);
+                frameDone();
+            } else {
+                m_freeSlots.acquire();
+            }
+        }
+        break;
+    }
+
+    // holding a free slot guarantees room
+    ++m_framesInFlight;
+    m_handoff->push(frame);
+    m_queuedFrames.release();
+}
+
+void PipewireStream::processQueuedFrame(const QueuedFrame &frame)
+{
+    if (deliveryMode == ZeroCopyDelivery && deliverFrame(frame.buffer)) {
+        // requeued once the last frame handle is dropped
+        return;
+    }
+
+    const qint64 processStart = StreamStats::now();
+    const qint64 cpuStart = StreamStats::threadCpuTime();
+    QMutexLocker locker(&m_processMutex);
+    if (!handleFrame(frame.buffer, frame.sequence)) {
+        releaseBuffer(frame.buffer);
+    }
+    stats.process.record(StreamStats::now() - processStart);
+    stats.cpu.record(StreamStats::threadCpuTime() - cpuStart);
+}
+
+void PipewireStream::frameDone()
+{
+    if (--m_framesInFlight == 0) {
+        QMutexLocker locker(&m_idleMutex);
+        m_workersIdle.wakeAll();
+    }
+}
+
+void PipewireStream::waitForWorkers()
+{
+    QMutexLocker locker(&m_idleMutex);
+    while (m_framesInFlight.load() > 0) {
+        m_workersIdle.wait(&m_idleMutex);
+    }
+}
+
+PipewireStream::MemFdMapping::~MemFdMapping()
+{
+    munmap(map, size);
+}
+
+QSharedPointer<PipewireStream::MemFdMapping> PipewireStream::mapMemFd(const spa_data &data)
+{
+    const size_t mapSize = data.maxsize + data.mapoffset;
+
+    auto cached = memFdMappings.value(data.fd);
+    if (cached && cached->size >= mapSize) {
+        ++stats.mapHits;
+        return cached;
+    }
+
+    ++stats.mapMisses;
+
+    // not announced through add_buffer (or not mappable back then), map it
+    // for this frame only
+    uint8_t *map = static_cast<uint8_t*>(mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE, data.fd, 0));
+    if (map == MAP_FAILED) {
+        qWarning() << "Failed to mmap the memory: " << strerror(errno);
+        return {};
+    }
+
+    return QSharedPointer<MemFdMapping>::create(map, mapSize);
+}
+
+#if HAVE_DMA_BUF
+static uint32_t drmFormat(spa_video_format format)
+{
+    // DRM fourccs name the bits of a little-endian word, SPA the bytes
+    switch (format) {
+    case SPA_VIDEO_FORMAT_RGBx:
+        return GBM_FORMAT_XBGR8888;
+    case SPA_VIDEO_FORMAT_RGBA:
+        return GBM_FORMAT_ABGR8888;
+    case SPA_VIDEO_FORMAT_BGRA:
+        return GBM_FORMAT_ARGB8888;
+    case SPA_VIDEO_FORMAT_RGB:
+        return GBM_FORMAT_BGR888;
+    case SPA_VIDEO_FORMAT_BGR:
+        return GBM_FORMAT_RGB888;
+    case SPA_VIDEO_FORMAT_BGRx:
+    default:
+        return GBM_FORMAT_XRGB8888;
+    }
+}
+
+void PipewireStream::queryDmaBufModifiers()
+{
+    // 24 bit formats are rarely importable, they stay on the shm path
+    const spa_video_format formats[] = {SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_BGRA,
+                                        SPA_VIDEO_FORMAT_RGBx, SPA_VIDEO_FORMAT_RGBA};
+
+    for (spa_video_format format : formats) {
+        EGLint count = 0;
+        if (!eglQueryDmaBufModifiersEXT(m_egl.display, drmFormat(format), 0, nullptr, nullptr, &count) || count == 0) {
+            continue;
+        }
+
+        QVector<EGLuint64KHR> queried(count);
+        QVector<EGLBoolean> externalOnly(count);
+        eglQueryDmaBufModifiersEXT(m_egl.display, drmFormat(format), count, queried.data(), externalOnly.data(), &count);
+
+        // frames are read through GL_TEXTURE_2D, external-only layouts can't be
+        QVector<uint64_t> modifiers;
+        for (EGLint i = 0; i < count; ++i) {
+            if (!externalOnly[i]) {
+                modifiers.append(queried[i]);
+            }
+        }
+        if (!modifiers.contains(DRM_FORMAT_MOD_LINEAR)) {
+            modifiers.append(DRM_FORMAT_MOD_LINEAR);
+        }
+        // for producers without explicit modifier support
+        modifiers.append(DRM_FORMAT_MOD_INVALID);
+
+        m_egl.modifiers.insert(format, modifiers);
+    }
+}
+
+void PipewireStream::onRenegotiate(void *data, uint64_t count)
+{
+    Q_UNUSED(count);
+    auto d = static_cast<PipewireStream *>(data);
+
+    uint8_t buffer[4096];
+    auto builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    QVector<const spa_pod *> params = d->buildFormatParams(&builder);
+    pw_stream_update_params(d->pwStream, params.data(), params.size());
+}
+
+const PipewireStream::DmaBufImport *PipewireStream::importDmaBuf(spa_buffer *spaBuffer)
+{
+    const spa_data &spaData = spaBuffer->datas[0];
+    const int fd = static_cast<int>(spaData.fd);
+
+    const uint64_t modifier = videoFormat.flags & SPA_VIDEO_FLAG_MODIFIER ? videoFormat.modifier : DRM_FORMAT_MOD_INVALID;
+    const uint32_t planes = qMin<uint32_t>(spaBuffer->n_datas, 4);
+
+    auto it = m_dmaBufImports.find(fd);
+    if (it != m_dmaBufImports.end()) {
+        if (it->size == streamSize && it->stride == spaData.chunk->stride &&
+            it->offset == spaData.chunk->offset && it->format == videoFormat.format &&
+            it->modifier == modifier && it->planes == planes) {
+            return &it.value();
+        }
+
+        // renegotiated without the buffer being removed
+        destroyDmaBufImport(it.value());
+        m_dmaBufImports.erase(it);
+    }
+
+    DmaBufImport import;
+    import.size = streamSize;
+    import.stride = spaData.chunk->stride;
+    import.offset = spaData.chunk->offset;
+    import.format = videoFormat.format;
+    import.modifier = modifier;
+    import.planes = planes;
+
+    if (m_egl.dmaBufImport) {
+        DmaBufImage::Plane dmaBufPlanes[4];
+        for (uint32_t i = 0; i < planes; ++i) {
+            const spa_data &plane = spaBuffer->datas[i];
+            dmaBufPlanes[i].fd = static_cast<int>(plane.fd);
+            dmaBufPlanes[i].offset = plane.chunk->offset;
+            dmaBufPlanes[i].stride = static_cast<uint32_t>(plane.chunk->stride);
+        }
+        import.image = DmaBufImage::create(m_egl.display, streamSize, drmFormat(videoFormat.format), modifier,
+                                           dmaBufPlanes, static_cast<int>(planes));
+    } else if (modifier != DRM_FORMAT_MOD_INVALID) {
+        gbm_import_fd_modifier_data importInfo = {};
+        importInfo.width = streamSize.width();
+        importInfo.height = streamSize.height();
+        importInfo.format = drmFormat(videoFormat.format);
+        importInfo.num_fds = planes;
+        importInfo.modifier = modifier;
+        for (uint32_t i = 0; i < planes; ++i) {
+            importInfo.fds[i] = spaBuffer->datas[i].fd;
+            importInfo.strides[i] = spaBuffer->datas[i].chunk->stride;
+            importInfo.offsets[i] = spaBuffer->datas[i].chunk->offset;
+        }
+        import.bo = gbm_bo_import(m_gbmDevice, GBM_BO_IMPORT_FD_MODIFIER, &importInfo, 0);
+        if (import.bo) {
+            import.image = eglCreateImageKHR(m_egl.display, nullptr, EGL_NATIVE_PIXMAP_KHR, import.bo, nullptr);
+        }
+    } else {
+        gbm_import_fd_data importInfo = {fd, static_cast<uint32_t>(streamSize.width()),
+                                         static_cast<uint32_t>(streamSize.height()), static_cast<uint32_t>(spaData.chunk->stride),
+                                         drmFormat(videoFormat.format)};
+        import.bo = gbm_bo_import(m_gbmDevice, GBM_BO_IMPORT_FD, &importInfo, GBM_BO_USE_SCANOUT);
+        if (!import.bo) {
+            qWarning() << "Failed to process buffer: Cannot import passed GBM fd - " << strerror(errno);
+            return nullptr;
+        }
+
+        // create EGL image from imported BO
+        import.image = eglCreateImageKHR(m_egl.display, nullptr, EGL_NATIVE_PIXMAP_KHR, import.bo, nullptr);
+    }
+
+    if (import.image == EGL_NO_IMAGE_KHR) {
+        qWarning() << "Failed to record frame: Error creating EGLImageKHR - " << formatGLError(eglGetError());
+        destroyDmaBufImport(import);
+
+        // stop offering the modifier, renegotiation ends at linear or the
+        // implicit modifier, which both import
+        if (modifier != DRM_FORMAT_MOD_INVALID && modifier != DRM_FORMAT_MOD_LINEAR &&
+            m_egl.modifiers[videoFormat.format].removeAll(modifier)) {
+            qWarning() << "Dropping DMA-BUF modifier" << QString::number(modifier, 16);
+            pw_loop_signal_event(pw_thread_loop_get_loop(pwMainLoop), m_renegotiateEvent);
+        }
+        return nullptr;
+    }
+
+    // create GL 2D texture for framebuffer
+    glGenTextures(1, &import.texture);
+    glBindTexture(GL_TEXTURE_2D, import.texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, import.image);
+
+    return &m_dmaBufImports.insert(fd, import).value();
+}
+
+void PipewireStream::completeReadback()
+{
+    PboReadback::Frame frame;
+    const uint8_t *src = m_readback.mapOldest(&frame);
+
+    // no buffer means it was removed from the pool while in flight
+    if (src && frame.buffer) {
+        // recorded as read back, a replay can't import the DMA-BUF
+        if (recorder) {
+            recorder->recordFrame(SPA_DATA_DmaBuf, src, frame.stride, frame.stride * streamSize.height(),
+                                  frame.crop, frame.damage, frame.pts, frame.sequence);
+        }
+        processFrame(src, frame.stride, frame.crop, frame.damage, frame.sequence, frame.pts);
+    }
+    m_readback.finishOldest();
+
+    if (frame.buffer) {
+        releaseBuffer(frame.buffer);
+    }
+}
+
+void PipewireStream::completeReadbacks(bool wait)
+{
+    while (m_readback.pending() && (wait || m_readback.oldestReady())) {
+        completeReadback();
+    }
+}
+
+void PipewireStream::onReadbackPending(void *data, uint64_t count)
+{
+    Q_UNUSED(count);
+    auto d = static_cast<PipewireStream *>(data);
+
+    QMutexLocker locker(&d->m_processMutex);
+    const spa_fraction rate = d->hasVideoFormat ? d->videoFormat.max_framerate : SPA_FRACTION(0, 1);
+    locker.unlock();
+
+    // every new frame pushes the timeout out again
+    const qint64 period = rate.num ? qint64(1000000000) * rate.denom / rate.num : 1000000000 / 60;
+    timespec timeout = {time_t(period / 1000000000), long(period % 1000000000)};
+    pw_loop_update_timer(pw_thread_loop_get_loop(d->pwMainLoop), d->m_readbackTimer, &timeout, nullptr, false);
+}
+
+void PipewireStream::onReadbackTimeout(void *data, uint64_t expirations)
+{
+    Q_UNUSED(expirations);
+    auto d = static_cast<PipewireStream *>(data);
+
+    QMutexLocker locker(&d->m_processMutex);
+    if (!d->m_readback.pending()) {
+        return;
+    }
+    eglMakeCurrent(d->m_egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, d->m_egl.context);
+    d->completeReadbacks(true);
+    eglMakeCurrent(d->m_egl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
+void PipewireStream::destroyDmaBufImport(const DmaBufImport &import)
+{
+    if (import.texture) {
+        glDeleteTextures(1, &import.texture);
+    }
+    if (import.image != EGL_NO_IMAGE_KHR) {
+        eglDestroyImageKHR(m_egl.display, import.image);
+    }
+    if (import.bo) {
+        gbm_bo_destroy(import.bo);
+    }
+}
+#endif /* HAVE_DMA_BUF */
@@ -2,6 +2,17 @@
 #define PIPEWIRESTRAEM_H
 
 #include <QWidget>
+#include <QTimer>
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QSemaphore>
+#include <QSharedPointer>
+#include <QThread>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <memory>
 
 #include <spa/param/format-utils.h>
 #include <spa/param/video/format-utils.h>
@@ -10,6 +21,21 @@
 
 #include <pipewire/pipewire.h>
 
+#include "BandPool.h"
+#include "BoundedQueue.h"
+#include "FrameConverter.h"
+#include "FramePool.h"
+#include "FramePyramid.h"
+#include "FrameRecorder.h"
+#include "FrameRingWriter.h"
+#include "FrameStitcher.h"
+#include "PipewireFrame.h"
+#include "PipewireSource.h"
+#include "RateController.h"
+#include "StreamStats.h"
+#include "TileHasher.h"
+#include "VideoEncoder.h"
+
 
 #define HAVE_DMA_BUF 1
 
@@ -17,9 +43,13 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <drm_fourcc.h>
 #include <gbm.h>
 #include <epoxy/egl.h>
 #include <epoxy/gl.h>
+
+#include "DmaBufImage.h"
+#include "PboReadback.h"
 #endif /* HAVE_DMA_BUF */
 
 
@@ -28,6 +58,56 @@ class PipewireStream : public QObject
     Q_OBJECT
 
 public:
+    enum DeliveryMode {
+        // convert every frame into fb and emit ImageReady
+        CopyDelivery,
+        // emit FrameReady with a handle into the PipeWire buffer itself for
+        // MemFd buffers, DMA-BUF and MemPtr frames still go through the copy
+        // path
+        ZeroCopyDelivery
+    };
+
+    // what onStreamProcess does when the handoff queue to the workers is full
+    enum OverflowPolicy {
+        // give the oldest queued buffer back to the stream
+        DropOldest,
+        // give the incoming buffer back to the stream
+        DropNewest,
+        // wait for a worker, this stalls the PipeWire loop
+        BlockWhenFull
+    };
+
+    // formats offered to the compositor. Packed RGB frames are converted
+    // and emitted through ImageReady/FrameReady; NV12/I420 frames only go to
+    // the encoder and are only offered when one is attached, encoded
+    // frames are emitted as PacketReady
+    enum StreamFormat {
+        PackedRgbFormat,
+        Nv12Format,
+        I420Format,
+        H264Format,
+        MjpegFormat
+    };
+
+    // how the compositor shows the pointer, the values of the pointer
+    // enum of zkde_screencast_unstable_v1
+    enum CursorMode {
+        CursorHidden = 1,
+        CursorEmbedded = 2,
+        // position and bitmap come in SPA_META_Cursor, see CursorChanged
+        CursorMetadata = 4
+    };
+
+    // the pointer from SPA_META_Cursor, position in the coordinates of the
+    // emitted frames, where the crop's top left corner is 0,0
+    struct Cursor {
+        bool visible = false;
+        QPoint position;
+        QPoint hotspot;
+        // premultiplied, kept until the compositor sends another shape
+        QImage image;
+    };
+
     PipewireStream(QObject *parent = nullptr);
     ~PipewireStream();
 
@@ -35,13 +115,74 @@ public:
     static void onStreamParamChanged(void *data, uint32_t id, const struct spa_pod *format);
     static void onStreamStateChanged(void *data, pw_stream_state old, pw_stream_state state, const char *error_message);
     static void onStreamProcess(void *data);
+    static void onStreamAddBuffer(void *data, pw_buffer *buffer);
+    static void onStreamRemoveBuffer(void *data, pw_buffer *buffer);
+    static void onBuffersReturned(void *data, uint64_t count);
+    static void onRenegotiate(void *data, uint64_t count);
+#if HAVE_DMA_BUF
+    static void onReadbackPending(void *data, uint64_t count);
+    static void onReadbackTimeout(void *data, uint64_t expirations);
+#endif /* HAVE_DMA_BUF */
 
 
     void initPw();
+    // connect through a loop and core shared with other streams, they have
+    // to outlive the stream; see CaptureManager
+    void initPw(pw_thread_loop *loop, pw_core *core);
+    bool connectStream();
 
     // pw handling
     pw_stream *createReceivingStream();
-    void handleFrame(pw_buffer *pwBuffer);
+    // EnumFormat params in formatPreference order
+    QVector<const spa_pod *> buildFormatParams(spa_pod_builder *builder);
+    // take a negotiated format, also used by FrameReplayer
+    void setVideoFormat(uint32_t subtype, const spa_video_info_raw &info);
+    // returns true when the buffer is kept for asynchronous readback and
+    // will be queued back by the stream itself
+    bool handleFrame(pw_buffer *pwBuffer, quint64 sequence);
+    void processFrame(const uint8_t *src, qint64 srcStride, const QRect &crop, const QRegion &damage, quint64 sequence, qint64 pts);
+    void processYuvFrame(spa_buffer *spaBuffer, const QRect &crop, qint64 pts);
+    void processPacket(spa_buffer *spaBuffer);
+    // returns false when the buffer has to go through the copy path instead
+    bool deliverFrame(pw_buffer *pwBuffer);
+
+    // what frame handles hold instead of the stream and buffer, they can
+    // outlive both; once remove_buffer or the destructor invalidated it,
+    // releasing does nothing
+    struct BufferToken {
+        QMutex mutex;
+        PipewireStream *stream = nullptr;
+        pw_buffer *buffer = nullptr;
+
+        void release();
+        void invalidate();
+    };
+    // every buffer of the pool, guarded by m_processMutex
+    QHash<pw_buffer *, std::shared_ptr<BufferToken>> m_bufferTokens;
+    void releaseBuffer(pw_buffer *pwBuffer);
+    void queueBuffersBack(pw_buffer *except = nullptr);
+    bool frameCrop(spa_buffer *spaBuffer, QRect *crop);
+    // the crop SPA_META_VideoCrop asks for, false without one that fits
+    bool cropMetadata(spa_buffer *spaBuffer, QRect *crop) const;
+    // false for buffers without usable data, e.g. a cursor update
+    static bool hasFrameContent(spa_buffer *spaBuffer);
+    // whether the buffer carries a valid SPA_META_Cursor
+    static bool hasCursor(spa_buffer *spaBuffer);
+    // on the loop thread, emits CursorChanged when anything changed
+    void updateCursor(spa_buffer *spaBuffer);
+    // damaged area relative to the crop, false when the whole frame changed
+    bool frameDamage(spa_buffer *spaBuffer, const QRect &crop, QRegion *damage);
+
+    // MemFd mapping, unmapped once neither the cache nor a frame holds it
+    struct MemFdMapping {
+        MemFdMapping(uint8_t *map, size_t size) : map(map), size(size) {}
+        ~MemFdMapping();
+        uint8_t *map;
+        size_t size;
+    };
+    QSharedPointer<MemFdMapping> mapMemFd(const spa_data &data);
+    // start of the chunk in a MemFd/MemPtr block, mapping keeps it mapped
+    const uint8_t *mapData(const spa_data &data, QSharedPointer<MemFdMapping> *mapping);
 
 
     // pipewire stuff
@@ -49,6 +190,8 @@ public:
     struct pw_core *pwCore = nullptr;
     struct pw_stream *pwStream = nullptr;
     struct pw_thread_loop *pwMainLoop = nullptr;
+    // false when loop and core are shared, only the stream is ours then
+    bool m_ownsLoop = true;
 
     // wayland-like listeners
     // ...of events that happen in pipewire server
@@ -61,8 +204,17 @@ public:
 
     uint pwStreamNodeId = 0;
 
-    // negotiated video format
-    spa_video_info_raw *videoFormat = nullptr;
+    // most preferred first, set before initPw()
+    QList<StreamFormat> formatPreference = {PackedRgbFormat};
+
+    // negotiated video format, SPA_VIDEO_FORMAT_ENCODED for h264/mjpeg;
+    // only valid once hasVideoFormat is set
+    spa_video_info_raw videoFormat = {};
+    bool hasVideoFormat = false;
+    uint32_t mediaSubtype = SPA_MEDIA_SUBTYPE_raw;
+
+    // copy/crop/swizzle kernel for the negotiated format
+    FrameConverter converter;
 
     // screen geometry holder
     QSize streamSize;
@@ -74,23 +226,192 @@ public:
     // sanity indicator
     bool isValid = true;
 
-    char *fb = nullptr;
+    DeliveryMode deliveryMode = CopyDelivery;
+
+    // the mode the compositor was asked for, SPA_META_Cursor is only
+    // requested with CursorMetadata; set before initPw()
+    CursorMode cursorMode = CursorMetadata;
+    // last cursor seen, loop thread only
+    Cursor m_cursor;
+    // crop origin the cursor position is made relative to, kept for
+    // cursor updates without crop metadata
+    QPoint m_cursorCropOrigin;
+    // bitmap format last reported as unsupported, to log it only once
+    uint32_t m_ignoredCursorFormat = SPA_VIDEO_FORMAT_UNKNOWN;
+
+    // frame processing threads, 0 processes frames on the PipeWire loop;
+    // set before initPw()
+    int workerCount = 1;
+    int handoffCapacity = 2;
+    OverflowPolicy overflowPolicy = DropOldest;
+
+    // threads converting one frame together, the calling one included;
+    // updates smaller than minParallelPixels are converted inline.
+    // set before initPw()
+    int conversionThreads = 1;
+    int conversionBandHeight = 64;
+    int minParallelPixels = 1920 * 1080;
+    std::unique_ptr<BandPool> m_bandPool;
+
+    // reduced copies of fb emitted through LevelReady, 32 bit frames outside
+    // the stitcher only. Filled during conversion, so the convert timing
+    // includes them; set before initPw()
+    QVector<FramePyramid::Level> pyramidLevels;
+    std::unique_ptr<FramePyramid> m_pyramid;
+
+    void startWorkers();
+    void stopWorkers();
+    // dequeued buffer and its position in the stream, dropped buffers
+    // leave gaps in the sequence
+    struct QueuedFrame {
+        pw_buffer *buffer = nullptr;
+        quint64 sequence = 0;
+    };
+    void enqueueFrame(const QueuedFrame &frame);
+    void processQueuedFrame(const QueuedFrame &frame);
+    // a frame left the handoff queue or a worker, wakes waitForWorkers()
+    void frameDone();
+    void waitForWorkers();
+
+    // buffers handed from the PipeWire loop to the workers
+    std::unique_ptr<BoundedQueue<QueuedFrame>> m_handoff;
+    QSemaphore m_queuedFrames;
+    QSemaphore m_freeSlots;
+    QList<QThread *> m_workers;
+    // buffers between enqueueFrame and the end of their processing
+    std::atomic<int> m_framesInFlight{0};
+    QMutex m_idleMutex;
+    QWaitCondition m_workersIdle;
+
+    // the most buffers the stream asks PipeWire for
+    static const int MAX_BUFFERS = 32;
+    // buffers given back from other threads, queued to the stream on the
+    // loop thread; a buffer is in it at most once, so a push never fails
+    BoundedQueue<pw_buffer *> m_returnedBuffers{MAX_BUFFERS};
+    spa_source *m_returnEvent = nullptr;
+    // sends EnumFormat again from the loop thread, e.g. after a modifier failed
+    spa_source *m_renegotiateEvent = nullptr;
+
+    // guards stream state shared between the loop and the workers:
+    // format, fb, mapping and import caches, GL
+    QMutex m_processMutex;
+
+    // number of DMA-BUF frames in flight, kept below the number of buffers
+    // in the pool; 1 reads back synchronously. A frame is delivered once
+    // its copy finished, at most readbackDepth - 1 frames late, or a frame
+    // period after it when no newer frame arrives
+    int readbackDepth = 2;
+
+    // MemFd buffers mapped once in add_buffer, keyed by fd
+    QHash<int, QSharedPointer<MemFdMapping>> memFdMappings;
+
+    // gets every converted frame when set, straight from the PipeWire buffer
+    VideoEncoder *encoder = nullptr;
+    // gets the format and every received packed RGB frame when set
+    FrameRecorder *recorder = nullptr;
+    // gets every converted frame when set, for readers in other processes
+    FrameRingWriter *frameRing = nullptr;
+    // re-export the frames as a PipeWire source node of this name, so other
+    // local consumers can share the session; set before initPw()
+    QString sourceName;
+    std::unique_ptr<PipewireSource> m_source;
+    // frames are converted into the stream's area of the stitched desktop
+    // instead of fb when set, no ImageReady is emitted then
+    FrameStitcher *stitcher = nullptr;
+    // whether the last frame went to the stitcher
+    bool m_stitched = false;
+
+    // frame counters and stage timings, readable from any thread
+    StreamStats stats;
+    // stats plus the counters of the re-exported source, for logging
+    QString statsSummary() const;
+
+    // sample the load every msec milliseconds and renegotiate frame rate and
+    // size when the policy says so, 0 turns it off and lifts the limits.
+    // LadderRatePolicy when no policy is given
+    void setRateControl(int msec, std::unique_ptr<RatePolicy> policy = nullptr);
+    void applyRateLimits(const RateLimits &limits);
+    std::unique_ptr<RateController> m_rateController;
+    QTimer *m_rateTimer = nullptr;
+    // requested from the compositor, guarded by m_processMutex
+    RateLimits m_rateLimits;
+    // last size negotiated without downscaling
+    QSize m_nativeSize;
+
+    // frame memory for fb, shared by every stream unless replaced before
+    // the first frame
+    std::shared_ptr<FramePool> framePool = FramePool::instance();
+    FrameBufferHandle fb;
+    // fb holds the last frame, so damaged areas can be updated in place
+    bool m_fbValid = false;
+    // find changed tiles by hashing when the producer sends no damage
+    bool tileHashing = true;
+    TileHasher m_tileHasher;
+    // every dequeued buffer, counted on the loop thread
+    quint64 m_frameSequence = 0;
+    // last frame converted into fb
+    quint64 m_lastSequence = 0;
 
 #if HAVE_DMA_BUF
     struct EGLStruct {
         QList<QByteArray> extensions;
         EGLDisplay display = EGL_NO_DISPLAY;
         EGLContext context = EGL_NO_CONTEXT;
+        // a display on our own GBM device goes with the stream, the
+        // surfaceless one is the same for every stream in the process
+        bool ownsDisplay = false;
+        bool dmaBufImport = false;
+        // importable modifiers per spa_video_format, empty without
+        // EGL_EXT_image_dma_buf_import_modifiers
+        QHash<uint32_t, QVector<uint64_t>> modifiers;
     };
 
+    // imported DMA-BUF kept for the life of the buffer in the pool
+    struct DmaBufImport {
+        gbm_bo *bo = nullptr;
+        EGLImageKHR image = EGL_NO_IMAGE_KHR;
+        GLuint texture = 0;
+        QSize size;
+        int32_t stride = 0;
+        uint32_t offset = 0;
+        spa_video_format format = SPA_VIDEO_FORMAT_UNKNOWN;
+        uint64_t modifier = DRM_FORMAT_MOD_INVALID;
+        uint32_t planes = 1;
+    };
+    void queryDmaBufModifiers();
+    const DmaBufImport *importDmaBuf(spa_buffer *spaBuffer);
+    void destroyDmaBufImport(const DmaBufImport &import);
+    void completeReadback();
+    // deliver the finished readbacks in order, or all of them
+    void completeReadbacks(bool wait);
+
     bool m_eglInitialized = false;
-    qint32 m_drmFd = 0; // for GBM buffer mmap
+    qint32 m_drmFd = -1; // for GBM buffer mmap
     gbm_device *m_gbmDevice = nullptr; // for passed GBM buffer retrieval
 
     EGLStruct m_egl;
+
+    // keyed by DMA-BUF fd, dropped in remove_buffer
+    QHash<int, DmaBufImport> m_dmaBufImports;
+    PboReadback m_readback;
+    // signalled when readbacks stay pending, arms m_readbackTimer on the loop
+    spa_source *m_readbackEvent = nullptr;
+    spa_source *m_readbackTimer = nullptr;
 #endif /* HAVE_DMA_BUF */
 signals:
-    void ImageReady(QImage* image);
+    // damage is the part of the image updated since the last emission
+    void ImageReady(QImage* image, const QRegion &damage);
+    // pyramidLevels[level] of the image, right after its ImageReady;
+    // damage in level coordinates
+    void LevelReady(int level, QImage *image, const QRegion &damage);
+    void FrameReady(PipewireFrameHandle frame);
+    // the cursor moved, changed shape or was hidden; emitted from the
+    // PipeWire loop, frames no longer change for cursor motion alone
+    void CursorChanged(const PipewireStream::Cursor &cursor);
+    // one compressed frame, pts from spa_meta_header or -1
+    void PacketReady(const QByteArray &packet, qint64 pts);
+    // the stream is being renegotiated with new limits, scale in percent
+    void RateLimitsChanged(int framerate, int scale);
 
 };
 #endif // PIPEWIRESTRAEM_H
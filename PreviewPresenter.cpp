@@ -0,0 +1,297 @@
+#include "PreviewPresenter.h"
+
+#include <QDebug>
+#include <QPainter>
+#include <QTimer>
+#include <QtMath>
+
+#include <cstring>
+
+#include "DWayland/Client/buffer.h"
+#include "DWayland/Client/shm_pool.h"
+#include "DWayland/Client/surface.h"
+
+#include "ImageScaler.h"
+
+using namespace KWayland::Client;
+
+// enough for one buffer on screen, one queued and one being drawn; more
+// are added only while the compositor holds on to all of them
+static const size_t bufferCount = 3;
+static const size_t maxBufferCount = 5;
+
+// the scaler reads 32 bit pixels in either byte order
+static bool scalableFormat(QImage::Format format, bool *swapRedBlue)
+{
+    switch (format) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+        *swapRedBlue = false;
+        return true;
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+        *swapRedBlue = true;
+        return true;
+    default:
+        return false;
+    }
+}
+
+PreviewPresenter::PreviewPresenter(Surface *surface, ShmPool *shm, QObject *parent)
+    : QObject(parent)
+    , m_surface(surface)
+    , m_shm(shm)
+{
+    connect(m_surface, &Surface::frameRendered, this, &PreviewPresenter::onFrameRendered);
+}
+
+PreviewPresenter::~PreviewPresenter()
+{
+    dropBuffers();
+}
+
+void PreviewPresenter::setSize(const QSize &size)
+{
+    if (size == m_size) {
+        return;
+    }
+    m_size = size;
+    dropBuffers();
+    m_sizeChanged = true;
+}
+
+void PreviewPresenter::submitFrame(QImage *image, const QRegion &damage)
+{
+    QImage frame = *image;
+    bool swapRedBlue = false;
+    if (!scalableFormat(frame.format(), &swapRedBlue)) {
+        frame = frame.convertToFormat(QImage::Format_RGB32);
+    }
+
+    QMutexLocker locker(&m_mutex);
+    const bool resized = frame.size() != m_image.size();
+    m_image = frame;
+    m_swapRedBlue = swapRedBlue;
+    queueFrame(resized ? QRegion() : damage);
+}
+
+void PreviewPresenter::copyFrame(QImage *image, const QRegion &damage)
+{
+    bool swapRedBlue = false;
+    if (!scalableFormat(image->format(), &swapRedBlue)) {
+        // converting makes a copy already
+        submitFrame(image, damage);
+        return;
+    }
+
+    QMutexLocker locker(&m_mutex);
+    if (image->size() != m_image.size() || image->format() != m_image.format() || damage.isEmpty()) {
+        m_image = image->copy();
+        m_swapRedBlue = swapRedBlue;
+        queueFrame(QRegion());
+        return;
+    }
+
+    // bits() detaches when present() is still reading the previous frame
+    uchar *bits = m_image.bits();
+    const qint64 stride = m_image.bytesPerLine();
+    for (const QRect &rect : damage & image->rect()) {
+        for (int y = rect.top(); y <= rect.bottom(); ++y) {
+            std::memcpy(bits + y * stride + rect.x() * 4, image->constScanLine(y) + rect.x() * 4, rect.width() * 4);
+        }
+    }
+    queueFrame(damage);
+}
+
+// m_mutex is held, m_image is the new frame
+void PreviewPresenter::queueFrame(const QRegion &damage)
+{
+    ++framesSubmitted;
+    if (m_newFrame) {
+        ++framesDropped;
+    }
+    m_newFrame = true;
+    m_damage = damage.isEmpty() ? QRegion(m_image.rect()) : m_damage + damage;
+    schedulePresent();
+}
+
+void PreviewPresenter::setCursor(const QImage &image, const QPoint &hotspot, const QPoint &position, bool visible)
+{
+    QMutexLocker locker(&m_mutex);
+    m_cursorImage = image;
+    m_cursorHotspot = hotspot;
+    m_cursorPosition = position;
+    m_cursorVisible = visible && !image.isNull();
+    m_cursorChanged = true;
+    schedulePresent();
+}
+
+// m_mutex is held
+void PreviewPresenter::schedulePresent()
+{
+    if (!m_presentQueued) {
+        m_presentQueued = true;
+        QMetaObject::invokeMethod(this, &PreviewPresenter::present, Qt::QueuedConnection);
+    }
+}
+
+void PreviewPresenter::present()
+{
+    QMutexLocker locker(&m_mutex);
+    m_presentQueued = false;
+    if (m_framePending || m_size.isEmpty() || (!m_newFrame && !m_sizeChanged && !m_cursorChanged)) {
+        return;
+    }
+
+    Buffer *target = acquireBuffer();
+    if (!target) {
+        // the compositor has every buffer, try again shortly
+        QTimer::singleShot(2, this, &PreviewPresenter::present);
+        return;
+    }
+
+    const QImage image = m_image;
+    const bool swapRedBlue = m_swapRedBlue;
+    const QRegion damage = m_damage;
+    const QImage cursorImage = m_cursorImage;
+    const bool cursorVisible = m_cursorVisible;
+    const QPoint cursorOrigin = m_cursorPosition - m_cursorHotspot;
+    const bool cursorChanged = m_cursorChanged;
+    m_damage = QRegion();
+    m_newFrame = false;
+    m_cursorChanged = false;
+    locker.unlock();
+
+    // image damage in surface pixels; a bilinear output pixel also depends
+    // on the source pixels around it, hence the margin
+    const QRect bounds(QPoint(0, 0), m_size);
+    const qreal sx = image.isNull() ? 1 : qreal(m_size.width()) / image.width();
+    const qreal sy = image.isNull() ? 1 : qreal(m_size.height()) / image.height();
+    QRegion surfaceDamage;
+    if (image.isNull() || m_drawnPlaceholder || m_sizeChanged || image.size() != m_drawnImageSize) {
+        surfaceDamage = bounds;
+    } else {
+        const int marginX = qCeil(sx / 2) + 1;
+        const int marginY = qCeil(sy / 2) + 1;
+        for (const QRect &rect : damage) {
+            const QRectF scaled(rect.x() * sx, rect.y() * sy, rect.width() * sx, rect.height() * sy);
+            surfaceDamage += scaled.toAlignedRect().adjusted(-marginX, -marginY, marginX, marginY) & bounds;
+        }
+    }
+
+    // the cursor is drawn over the frame, so where it was and where it is
+    // get redrawn when it changes
+    QRectF cursorTarget;
+    QRect cursorRect;
+    if (cursorVisible && !image.isNull()) {
+        cursorTarget = QRectF(cursorOrigin.x() * sx, cursorOrigin.y() * sy, cursorImage.width() * sx, cursorImage.height() * sy);
+        cursorRect = cursorTarget.toAlignedRect() & bounds;
+    }
+    if (cursorChanged) {
+        surfaceDamage += m_drawnCursorRect;
+        surfaceDamage += cursorRect;
+    }
+
+    for (Buffer &buffer : m_buffers) {
+        buffer.stale += surfaceDamage;
+    }
+    // the target may hold the cursor at the same place already, it is
+    // blended onto the bare frame again
+    target->stale += cursorRect;
+
+    auto buffer = target->buffer.toStrongRef();
+    const qint64 stride = m_size.width() * 4;
+    if (image.isNull()) {
+        // nothing captured yet, a red rectangle shows the anchor of the top level
+        QImage surfaceImage(buffer->address(), m_size.width(), m_size.height(), stride, QImage::Format_ARGB32_Premultiplied);
+        surfaceImage.fill(Qt::white);
+        QPainter painter(&surfaceImage);
+        painter.setBrush(Qt::red);
+        painter.setPen(Qt::black);
+        painter.drawRect(50, 50, 400, 400);
+    } else {
+        for (const QRect &rect : target->stale) {
+            ImageScaler::scale(image.constBits(), image.bytesPerLine(), image.size(), swapRedBlue,
+                               buffer->address(), stride, m_size, rect);
+        }
+        if (!cursorRect.isEmpty()) {
+            QImage surfaceImage(buffer->address(), m_size.width(), m_size.height(), stride, QImage::Format_ARGB32_Premultiplied);
+            QPainter painter(&surfaceImage);
+            painter.setRenderHint(QPainter::SmoothPixmapTransform);
+            painter.drawImage(cursorTarget, cursorImage);
+        }
+    }
+    target->stale = QRegion();
+
+    m_surface->attachBuffer(*buffer);
+    for (const QRect &rect : surfaceDamage) {
+        m_surface->damage(rect);
+    }
+    buffer->setReleased(false);
+    target->attached = true;
+    m_surface->commit(Surface::CommitFlag::FrameCallback);
+    m_framePending = true;
+    ++framesPresented;
+
+    m_drawnImageSize = image.size();
+    m_drawnPlaceholder = image.isNull();
+    m_drawnCursorRect = cursorRect;
+    m_sizeChanged = false;
+}
+
+void PreviewPresenter::onFrameRendered()
+{
+    m_framePending = false;
+    present();
+}
+
+PreviewPresenter::Buffer *PreviewPresenter::acquireBuffer()
+{
+    while (m_buffers.size() < bufferCount) {
+        if (!addBuffer()) {
+            return nullptr;
+        }
+    }
+
+    for (Buffer &buffer : m_buffers) {
+        auto shmBuffer = buffer.buffer.toStrongRef();
+        if (shmBuffer && (!buffer.attached || shmBuffer->isReleased())) {
+            return &buffer;
+        }
+    }
+
+    if (m_buffers.size() < maxBufferCount && addBuffer()) {
+        return &m_buffers.back();
+    }
+    return nullptr;
+}
+
+bool PreviewPresenter::addBuffer()
+{
+    // used buffers are never handed out by the pool again
+    auto shmBuffer = m_shm->getBuffer(m_size, m_size.width() * 4).toStrongRef();
+    if (!shmBuffer) {
+        qWarning() << "Failed to get a preview buffer of" << m_size;
+        return false;
+    }
+    shmBuffer->setUsed(true);
+
+    Buffer buffer;
+    buffer.buffer = shmBuffer;
+    buffer.stale = QRect(QPoint(0, 0), m_size);
+    m_buffers.push_back(buffer);
+    return true;
+}
+
+void PreviewPresenter::dropBuffers()
+{
+    // the pool reuses them once the compositor lets go
+    for (Buffer &buffer : m_buffers) {
+        if (auto shmBuffer = buffer.buffer.toStrongRef()) {
+            shmBuffer->setUsed(false);
+        }
+    }
+    m_buffers.clear();
+}
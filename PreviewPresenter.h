@@ -0,0 +1,105 @@
+#ifndef PREVIEWPRESENTER_H
+#define PREVIEWPRESENTER_H
+
+#include <QImage>
+#include <QMutex>
+#include <QObject>
+#include <QRegion>
+#include <QSharedPointer>
+
+#include <atomic>
+#include <vector>
+
+namespace KWayland {
+namespace Client {
+class Buffer;
+class ShmPool;
+class Surface;
+}
+}
+
+// Shows captured frames in the preview window at the pace of the display.
+// Frames come in from any thread and only the latest one is kept; it is
+// drawn when the compositor's frame callback says the previous one was
+// used, so at most one frame is scaled per refresh and the rest are
+// dropped. The window cycles through a fixed set of SHM buffers; each one
+// remembers what changed since it was last drawn, so only that part is
+// scaled into it, with ImageScaler.
+class PreviewPresenter : public QObject
+{
+    Q_OBJECT
+
+public:
+    PreviewPresenter(KWayland::Client::Surface *surface, KWayland::Client::ShmPool *shm, QObject *parent = nullptr);
+    ~PreviewPresenter();
+
+    // window size in surface pixels, the next frame is drawn in full
+    void setSize(const QSize &size);
+
+    // any thread; keeps a shallow copy, so the image must own its data or
+    // hold it through a cleanup function like PipewireStream's images.
+    // damage is in image coordinates, empty for the whole image
+    void submitFrame(QImage *image, const QRegion &damage);
+    // any thread; copies the damaged part, for images only valid during
+    // the call like FrameStitcher's
+    void copyFrame(QImage *image, const QRegion &damage);
+
+    // any thread; the pointer drawn over the frames, for streams sending it
+    // as metadata. position is in image coordinates, hotspot in the image's
+    void setCursor(const QImage &image, const QPoint &hotspot, const QPoint &position, bool visible);
+
+    // main thread; draw the latest frame unless the compositor still
+    // has the previous one pending
+    void present();
+
+    std::atomic<quint64> framesSubmitted{0};
+    std::atomic<quint64> framesPresented{0};
+    // replaced by a newer frame before they were drawn
+    std::atomic<quint64> framesDropped{0};
+
+private:
+    struct Buffer {
+        QWeakPointer<KWayland::Client::Buffer> buffer;
+        // the compositor got it at some point, until then isReleased() is false
+        bool attached = false;
+        // surface area that changed since the buffer was last drawn
+        QRegion stale;
+    };
+
+    void queueFrame(const QRegion &damage);
+    void schedulePresent();
+    void onFrameRendered();
+    Buffer *acquireBuffer();
+    bool addBuffer();
+    void dropBuffers();
+
+    KWayland::Client::Surface *m_surface;
+    KWayland::Client::ShmPool *m_shm;
+
+    // main thread only
+    QSize m_size;
+    std::vector<Buffer> m_buffers;
+    // committed with a frame callback that hasn't arrived yet
+    bool m_framePending = false;
+    // the image and size the buffers were last drawn from
+    QSize m_drawnImageSize;
+    bool m_drawnPlaceholder = false;
+    QRect m_drawnCursorRect;
+    bool m_sizeChanged = true;
+
+    // the latest frame, shared with the submitting threads
+    QMutex m_mutex;
+    QImage m_image;
+    bool m_swapRedBlue = false;
+    // image area changed since the last present
+    QRegion m_damage;
+    bool m_newFrame = false;
+    bool m_presentQueued = false;
+    QImage m_cursorImage;
+    QPoint m_cursorHotspot;
+    QPoint m_cursorPosition;
+    bool m_cursorVisible = false;
+    bool m_cursorChanged = false;
+};
+
+#endif // PREVIEWPRESENTER_H
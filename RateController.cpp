@@ -0,0 +1,103 @@
+#include "RateController.h"
+
+#include "StreamStats.h"
+
+#include <QtGlobal>
+
+LadderRatePolicy::LadderRatePolicy()
+{
+    // frame rate goes first, the picture is worth more than its smoothness
+    ladder = {{60, 100}, {30, 100}, {20, 100}, {15, 100}, {15, 75}, {15, 50}, {10, 50}, {5, 50}};
+}
+
+RateLimits LadderRatePolicy::decide(const StreamLoad &load, const RateLimits &current)
+{
+    // an idle screen says nothing about the consumer
+    if (load.frames == 0 || ladder.isEmpty()) {
+        return current;
+    }
+
+    int level = ladder.indexOf(current);
+    if (level < 0) {
+        level = 0;
+    }
+
+    const double budget = 1e9 / current.framerate * qMax(1, load.workers);
+    const double utilization = load.processMean / budget;
+    const bool overloaded = load.drops > load.frames * dropTolerance ||
+                            (load.queueCapacity > 0 && load.queueDepth >= load.queueCapacity) ||
+                            utilization > overloadUtilization;
+
+    if (overloaded) {
+        m_headroom = 0;
+        if (++m_overloaded >= overloadWindows && level + 1 < ladder.size()) {
+            m_overloaded = 0;
+            return ladder[level + 1];
+        }
+        return current;
+    }
+    m_overloaded = 0;
+
+    if (level == 0) {
+        return current;
+    }
+
+    // processing time follows the pixel count, the load also the frame rate
+    const RateLimits &up = ladder[level - 1];
+    const double pixels = double(up.scale * up.scale) / (current.scale * current.scale);
+    const double projected = utilization * pixels * up.framerate / current.framerate;
+    if (load.queueDepth > 0 || projected >= headroomUtilization) {
+        m_headroom = 0;
+        return current;
+    }
+
+    if (++m_headroom >= headroomWindows) {
+        m_headroom = 0;
+        return up;
+    }
+    return current;
+}
+
+RateController::RateController(std::unique_ptr<RatePolicy> policy)
+    : m_policy(policy ? std::move(policy) : std::unique_ptr<RatePolicy>(new LadderRatePolicy))
+{
+}
+
+RateLimits RateController::sample(StreamStats &stats, int queueDepth, int queueCapacity, int workers)
+{
+    const qint64 now = StreamStats::now();
+    const quint64 frames = stats.framesReceived.load();
+    const quint64 drops = stats.framesDropped.load() + stats.queueDrops.load();
+    const quint64 processed = stats.process.count();
+    const quint64 processTime = stats.process.sum();
+
+    if (m_primed) {
+        StreamLoad load;
+        load.window = now - m_time;
+        load.frames = frames - m_frames;
+        load.drops = drops - m_drops;
+        load.queueDepth = queueDepth;
+        load.queueCapacity = queueCapacity;
+        load.workers = workers;
+        load.processMean = processed > m_processed ? static_cast<qint64>((processTime - m_processTime) / (processed - m_processed)) : 0;
+
+        const RateLimits next = m_policy->decide(load, m_limits);
+        ++stats.rateDecisions;
+        if (next.framerate * next.scale * next.scale < m_limits.framerate * m_limits.scale * m_limits.scale) {
+            ++stats.rateDecreases;
+        } else if (next != m_limits) {
+            ++stats.rateIncreases;
+        }
+        m_limits = next;
+        stats.framerateLimit = next.framerate;
+        stats.scaleLimit = next.scale;
+    }
+
+    m_primed = true;
+    m_time = now;
+    m_frames = frames;
+    m_drops = drops;
+    m_processed = processed;
+    m_processTime = processTime;
+    return m_limits;
+}
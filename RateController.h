@@ -0,0 +1,92 @@
+#ifndef RATECONTROLLER_H
+#define RATECONTROLLER_H
+
+#include <QVector>
+
+#include <memory>
+
+struct StreamStats;
+
+// what the stream asks the compositor for: frames per second and the
+// percentage of the native size in each dimension
+struct RateLimits {
+    int framerate = 60;
+    int scale = 100;
+
+    bool operator==(const RateLimits &other) const { return framerate == other.framerate && scale == other.scale; }
+    bool operator!=(const RateLimits &other) const { return !(*this == other); }
+};
+
+// consumer load over one sampling window
+struct StreamLoad {
+    qint64 window = 0;       // ns since the previous sample
+    quint64 frames = 0;      // buffers dequeued
+    quint64 drops = 0;       // buffers queued back unprocessed
+    int queueDepth = 0;      // buffers waiting for or held by a worker
+    int queueCapacity = 0;   // 0 when frames are processed on the loop
+    int workers = 1;
+    qint64 processMean = 0;  // ns per processed buffer
+};
+
+// decides the limits for the next window, returning `current` keeps them
+class RatePolicy
+{
+public:
+    virtual ~RatePolicy() = default;
+    virtual RateLimits decide(const StreamLoad &load, const RateLimits &current) = 0;
+};
+
+// Walks a ladder of limits, one step down after overloadWindows overloaded
+// windows in a row and one step up after headroomWindows windows where the
+// next step up is projected to fit. Going up takes longer so a stream on
+// the edge doesn't oscillate.
+class LadderRatePolicy : public RatePolicy
+{
+public:
+    LadderRatePolicy();
+
+    RateLimits decide(const StreamLoad &load, const RateLimits &current) override;
+
+    // best limits first
+    QVector<RateLimits> ladder;
+    // processing time over frame budget above which a window is overloaded
+    double overloadUtilization = 0.9;
+    // projected utilization of the next step up below which it is taken
+    double headroomUtilization = 0.6;
+    // dropped share of the dequeued buffers tolerated in a window
+    double dropTolerance = 0.02;
+    int overloadWindows = 2;
+    int headroomWindows = 5;
+
+private:
+    int m_overloaded = 0;
+    int m_headroom = 0;
+};
+
+// Turns cumulative stream counters into per-window load for a policy and
+// records every decision in the stream's stats.
+class RateController
+{
+public:
+    // LadderRatePolicy when no policy is given
+    explicit RateController(std::unique_ptr<RatePolicy> policy = nullptr);
+
+    const RateLimits &limits() const { return m_limits; }
+
+    // returns the limits for the next window
+    RateLimits sample(StreamStats &stats, int queueDepth, int queueCapacity, int workers);
+
+private:
+    std::unique_ptr<RatePolicy> m_policy;
+    RateLimits m_limits;
+
+    // counters at the previous sample, the first sample only records them
+    bool m_primed = false;
+    qint64 m_time = 0;
+    quint64 m_frames = 0;
+    quint64 m_drops = 0;
+    quint64 m_processed = 0;
+    quint64 m_processTime = 0;
+};
+
+#endif // RATECONTROLLER_H
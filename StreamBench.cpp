@@ -0,0 +1,350 @@
+#include "StreamBench.h"
+
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QProcess>
+#include <QRect>
+#include <QStringList>
+#include <QTemporaryDir>
+#include <QThread>
+#include <QTimer>
+
+#include <cstring>
+#include <time.h>
+
+#include "CaptureManager.h"
+#include "FrameConverter.h"
+#include "PipewireSource.h"
+#include "PipewireStream.h"
+
+// how long setting up may take before the run is given up
+static const qint64 SETUP_TIMEOUT = 10000000000LL;
+// rows changed per frame without fullUpdates
+static const int BAND_HEIGHT = 64;
+
+static qint64 processCpuTime()
+{
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+StreamBench::StreamBench(QObject *parent)
+    : StreamBench(Settings(), parent)
+{
+}
+
+StreamBench::StreamBench(const Settings &settings, QObject *parent)
+    : QObject(parent)
+    , m_settings(settings)
+{
+}
+
+StreamBench::~StreamBench()
+{
+    // the stream goes first, it may be linked to the source
+    delete m_manager;
+    stopProducer();
+
+    if (m_daemon) {
+        m_daemon->terminate();
+        m_daemon->waitForFinished(3000);
+    }
+}
+
+void StreamBench::start()
+{
+    if (m_settings.privateDaemon && !startDaemon()) {
+        finish(false, QStringLiteral("bench failed to start pipewire"));
+        return;
+    }
+
+    // both connect to the daemon the environment points at
+    if (!startProducer()) {
+        finish(false, QStringLiteral("bench failed to start the producer"));
+        return;
+    }
+    m_manager = new CaptureManager(1, false);
+    if (!m_manager->isValid()) {
+        finish(false, QStringLiteral("bench failed to connect the capture manager"));
+        return;
+    }
+
+    m_phase = WaitingForSource;
+    m_phaseStart = StreamStats::now();
+    m_pollTimer = new QTimer(this);
+    connect(m_pollTimer, &QTimer::timeout, this, &StreamBench::poll);
+    m_pollTimer->start(10);
+}
+
+bool StreamBench::startDaemon()
+{
+    m_runtimeDir.reset(new QTemporaryDir);
+    if (!m_runtimeDir->isValid()) {
+        qWarning() << "Failed to create a runtime directory for pipewire";
+        return false;
+    }
+
+    QProcessEnvironment environment = QProcessEnvironment::systemEnvironment();
+    environment.insert(QStringLiteral("PIPEWIRE_RUNTIME_DIR"), m_runtimeDir->path());
+    environment.remove(QStringLiteral("PIPEWIRE_REMOTE"));
+
+    m_daemon = new QProcess(this);
+    m_daemon->setProcessEnvironment(environment);
+    m_daemon->setStandardOutputFile(QProcess::nullDevice());
+    m_daemon->start(QStringLiteral("pipewire"), QStringList());
+    if (!m_daemon->waitForStarted(3000)) {
+        qWarning() << "Failed to start pipewire:" << m_daemon->errorString();
+        return false;
+    }
+
+    // the clients in this process connect to it from now on
+    qputenv("PIPEWIRE_RUNTIME_DIR", QFile::encodeName(m_runtimeDir->path()));
+    qunsetenv("PIPEWIRE_REMOTE");
+
+    // the socket shows up once the daemon listens
+    const QString socket = QDir(m_runtimeDir->path()).filePath(QStringLiteral("pipewire-0"));
+    for (int i = 0; i < 300 && !QFile::exists(socket); ++i) {
+        if (m_daemon->state() != QProcess::Running) {
+            break;
+        }
+        QThread::msleep(10);
+    }
+    if (!QFile::exists(socket)) {
+        qWarning() << "pipewire didn't create" << socket;
+        return false;
+    }
+    return true;
+}
+
+bool StreamBench::startProducer()
+{
+    pw_init(nullptr, nullptr);
+
+    const int bpp = FrameConverter::bytesPerPixel(m_settings.format);
+    m_frameStride = SPA_ROUND_UP_N(qint64(m_settings.size.width()) * bpp, 4);
+    m_frame.assign(m_frameStride * m_settings.size.height(), 0);
+
+    m_producerLoop = pw_thread_loop_new("bench-producer", nullptr);
+    if (!m_producerLoop) {
+        qWarning() << "Failed to create the producer loop";
+        return false;
+    }
+    pw_thread_loop_lock(m_producerLoop);
+    pw_loop *loop = pw_thread_loop_get_loop(m_producerLoop);
+
+    m_producerContext = pw_context_new(loop, nullptr, 0);
+    m_producerCore = m_producerContext ? pw_context_connect(m_producerContext, nullptr, 0) : nullptr;
+    if (!m_producerCore) {
+        qWarning() << "Failed to connect the producer";
+        pw_thread_loop_unlock(m_producerLoop);
+        return false;
+    }
+
+    m_source.reset(new PipewireSource(m_producerCore, QStringLiteral("screencast-bench-source")));
+    m_source->dataTypes = 1 << m_settings.dataType;
+    m_source->setFormat(m_settings.format, m_settings.size, SPA_FRACTION(uint32_t(m_settings.framerate), 1));
+
+    // frames are only published once the consumer negotiated
+    const qint64 period = 1000000000LL / qMax(1, m_settings.framerate);
+    timespec value = {0, 1};
+    timespec interval = {time_t(period / 1000000000LL), long(period % 1000000000LL)};
+    m_producerTimer = pw_loop_add_timer(loop, &onProducerTimer, this);
+    pw_loop_update_timer(loop, m_producerTimer, &value, &interval, false);
+
+    if (pw_thread_loop_start(m_producerLoop) < 0) {
+        qWarning() << "Failed to start the producer loop";
+        pw_thread_loop_unlock(m_producerLoop);
+        return false;
+    }
+    pw_thread_loop_unlock(m_producerLoop);
+    return true;
+}
+
+void StreamBench::stopProducer()
+{
+    if (!m_producerLoop) {
+        return;
+    }
+
+    pw_thread_loop_stop(m_producerLoop);
+    if (m_producerTimer) {
+        pw_loop_destroy_source(pw_thread_loop_get_loop(m_producerLoop), m_producerTimer);
+    }
+    if (m_link) {
+        pw_proxy_destroy(m_link);
+    }
+    m_source.reset();
+    if (m_producerCore) {
+        pw_core_disconnect(m_producerCore);
+    }
+    if (m_producerContext) {
+        pw_context_destroy(m_producerContext);
+    }
+    pw_thread_loop_destroy(m_producerLoop);
+    m_producerLoop = nullptr;
+}
+
+void StreamBench::onProducerTimer(void *data, uint64_t expirations)
+{
+    Q_UNUSED(expirations);
+    static_cast<StreamBench *>(data)->produceFrame();
+}
+
+void StreamBench::produceFrame()
+{
+    ++m_frameSequence;
+    const QSize &size = m_settings.size;
+    const int value = int(m_frameSequence * 37) & 0xff;
+
+    QRect damage(QPoint(0, 0), size);
+    if (!m_settings.fullUpdates) {
+        const int y = int((m_frameSequence * BAND_HEIGHT) % size.height());
+        damage = QRect(0, y, size.width(), qMin(BAND_HEIGHT, size.height() - y));
+    }
+    std::memset(m_frame.data() + damage.y() * m_frameStride, value, damage.height() * m_frameStride);
+
+    // stamped like a compositor would, when the content is ready
+    m_source->publish(m_frame.data(), m_frameStride, size, damage, m_frameSequence, StreamStats::now());
+}
+
+void StreamBench::linkNodes(uint32_t sourceId, uint32_t streamId)
+{
+    // what a session manager would do
+    pw_thread_loop_lock(m_producerLoop);
+    pw_properties *props = pw_properties_new(PW_KEY_LINK_OUTPUT_NODE, QByteArray::number(sourceId).constData(),
+                                             PW_KEY_LINK_INPUT_NODE, QByteArray::number(streamId).constData(),
+                                             PW_KEY_OBJECT_LINGER, "false",
+                                             nullptr);
+    m_link = static_cast<pw_proxy *>(pw_core_create_object(m_producerCore, "link-factory", PW_TYPE_INTERFACE_Link,
+                                                           PW_VERSION_LINK, &props->dict, 0));
+    pw_properties_free(props);
+    pw_thread_loop_unlock(m_producerLoop);
+
+    if (!m_link) {
+        qWarning() << "Failed to link node" << sourceId << "to" << streamId;
+    }
+}
+
+void StreamBench::poll()
+{
+    const qint64 now = StreamStats::now();
+    const qint64 elapsed = now - m_phaseStart;
+
+    switch (m_phase) {
+    case WaitingForSource: {
+        pw_thread_loop_lock(m_producerLoop);
+        const uint32_t sourceId = m_source->nodeId();
+        pw_thread_loop_unlock(m_producerLoop);
+        if (sourceId == SPA_ID_INVALID) {
+            break;
+        }
+
+        m_stream = m_manager->createStream(sourceId);
+        m_manager->startStream(m_stream);
+        if (!m_stream->pwStream) {
+            finish(false, QStringLiteral("bench failed to create the capture stream"));
+            return;
+        }
+        m_phase = WaitingForStream;
+        m_phaseStart = now;
+        break;
+    }
+    case WaitingForStream: {
+        pw_thread_loop_lock(m_stream->pwMainLoop);
+        const uint32_t streamId = pw_stream_get_node_id(m_stream->pwStream);
+        pw_thread_loop_unlock(m_stream->pwMainLoop);
+        if (streamId == SPA_ID_INVALID) {
+            break;
+        }
+
+        // a session manager links the target node on its own
+        if (m_settings.privateDaemon) {
+            linkNodes(m_stream->pwStreamNodeId, streamId);
+        }
+        m_phase = WaitingForFrames;
+        m_phaseStart = now;
+        break;
+    }
+    case WaitingForFrames:
+        if (m_stream->stats.framesReceived.load() > 0) {
+            m_phase = WarmingUp;
+            m_phaseStart = now;
+        }
+        break;
+    case WarmingUp:
+        if (elapsed >= qint64(m_settings.warmupMsec) * 1000000) {
+            beginMeasurement();
+            m_phase = Measuring;
+            m_phaseStart = now;
+        }
+        return;
+    case Measuring:
+        if (elapsed >= qint64(m_settings.durationMsec) * 1000000) {
+            const StreamStats &stats = m_stream->stats;
+            const double seconds = (now - m_measureStart) / 1e9;
+            const quint64 published = m_source->framesPublished.load() - m_publishedStart;
+            const quint64 skipped = m_source->framesSkipped.load() - m_skippedStart;
+            const quint64 produced = published + skipped;
+            const quint64 received = stats.framesReceived.load();
+            const quint64 dropped = stats.framesDropped.load() + stats.queueDrops.load();
+            const quint64 processed = received - qMin(received, dropped);
+            const qint64 cpu = processCpuTime() - m_cpuStart;
+
+            QStringList lines;
+            lines << QStringLiteral("bench %1x%2 %3 %4 %5 fps, %6 updates, %7s")
+                         .arg(m_settings.size.width())
+                         .arg(m_settings.size.height())
+                         .arg(QLatin1String(FrameConverter::formatName(m_settings.format)))
+                         .arg(m_settings.dataType == SPA_DATA_MemPtr ? QStringLiteral("MemPtr") : QStringLiteral("MemFd"))
+                         .arg(m_settings.framerate)
+                         .arg(m_settings.fullUpdates ? QStringLiteral("full") : QStringLiteral("band"))
+                         .arg(seconds, 0, 'f', 1);
+            lines << QStringLiteral("frames produced=%1 producerSkips=%2 received=%3 dropped=%4 processed=%5 fps=%6 dropRate=%7%")
+                         .arg(produced)
+                         .arg(skipped)
+                         .arg(received)
+                         .arg(dropped)
+                         .arg(processed)
+                         .arg(processed / seconds, 0, 'f', 1)
+                         .arg(produced ? 100.0 * (produced - qMin(produced, processed)) / produced : 0.0, 0, 'f', 2);
+            lines << QStringLiteral("glass-to-callback p50=%1us p99=%2us max=%3us")
+                         .arg(stats.frameAge.percentile(50) / 1000.0, 0, 'f', 1)
+                         .arg(stats.frameAge.percentile(99) / 1000.0, 0, 'f', 1)
+                         .arg(stats.frameAge.max() / 1000.0, 0, 'f', 1);
+            // the process includes the producer's frame generation and copy
+            lines << QStringLiteral("cpu/frame processing=%1us process=%2us")
+                         .arg(stats.cpu.mean() / 1000.0, 0, 'f', 1)
+                         .arg(processed ? cpu / 1000.0 / processed : 0.0, 0, 'f', 1);
+            lines << stats.summary();
+            finish(true, lines.join(QLatin1Char('\n')));
+        }
+        return;
+    }
+
+    if (elapsed > SETUP_TIMEOUT) {
+        finish(false, QStringLiteral("bench timed out in setup phase %1").arg(m_phase));
+    }
+}
+
+void StreamBench::beginMeasurement()
+{
+    m_stream->stats.reset();
+    m_publishedStart = m_source->framesPublished.load();
+    m_skippedStart = m_source->framesSkipped.load();
+    m_cpuStart = processCpuTime();
+    m_measureStart = StreamStats::now();
+}
+
+void StreamBench::finish(bool ok, const QString &report)
+{
+    if (m_pollTimer) {
+        m_pollTimer->stop();
+    }
+    m_report = report;
+    if (!ok) {
+        qWarning().noquote() << report;
+    }
+    emit Finished(ok);
+}
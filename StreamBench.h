@@ -0,0 +1,110 @@
+#ifndef STREAMBENCH_H
+#define STREAMBENCH_H
+
+#include <QObject>
+#include <QSize>
+#include <QString>
+
+#include <memory>
+#include <vector>
+
+#include <spa/param/video/raw.h>
+
+#include <pipewire/pipewire.h>
+
+class CaptureManager;
+class PipewireSource;
+class PipewireStream;
+class QProcess;
+class QTemporaryDir;
+class QTimer;
+
+// End-to-end benchmark of initPw -> createReceivingStream -> onStreamProcess
+// -> handleFrame. A PipewireSource on its own loop stands in for the
+// compositor and sends generated frames stamped with CLOCK_MONOTONIC pts;
+// a PipewireStream from a CaptureManager captures them by node id.
+// With privateDaemon a pipewire instance is started in a temporary runtime
+// directory, so it runs on a headless box; without a session manager there
+// the two nodes are linked by hand.
+class StreamBench : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Settings {
+        QSize size = QSize(1920, 1080);
+        spa_video_format format = SPA_VIDEO_FORMAT_BGRx;
+        // SPA_DATA_MemFd or SPA_DATA_MemPtr
+        uint32_t dataType = SPA_DATA_MemFd;
+        int framerate = 60;
+        // every frame changes completely, otherwise a band of rows moves down
+        bool fullUpdates = true;
+        int warmupMsec = 1000;
+        int durationMsec = 10000;
+        bool privateDaemon = true;
+    };
+
+    // no default argument, Settings isn't complete inside the class
+    explicit StreamBench(QObject *parent = nullptr);
+    StreamBench(const Settings &settings, QObject *parent = nullptr);
+    ~StreamBench();
+
+    // set everything up and measure from the event loop, Finished follows
+    void start();
+    QString report() const { return m_report; }
+
+    static void onProducerTimer(void *data, uint64_t expirations);
+
+signals:
+    void Finished(bool ok);
+
+private:
+    enum Phase {
+        WaitingForSource,
+        WaitingForStream,
+        WaitingForFrames,
+        WarmingUp,
+        Measuring
+    };
+
+    bool startDaemon();
+    bool startProducer();
+    void stopProducer();
+    void linkNodes(uint32_t sourceId, uint32_t streamId);
+    void produceFrame();
+    void poll();
+    void beginMeasurement();
+    void finish(bool ok, const QString &report);
+
+    const Settings m_settings;
+    Phase m_phase = WaitingForSource;
+    QTimer *m_pollTimer = nullptr;
+    qint64 m_phaseStart = 0;
+
+    std::unique_ptr<QTemporaryDir> m_runtimeDir;
+    QProcess *m_daemon = nullptr;
+
+    // the stand-in compositor
+    pw_thread_loop *m_producerLoop = nullptr;
+    pw_context *m_producerContext = nullptr;
+    pw_core *m_producerCore = nullptr;
+    spa_source *m_producerTimer = nullptr;
+    pw_proxy *m_link = nullptr;
+    std::unique_ptr<PipewireSource> m_source;
+    std::vector<uint8_t> m_frame;
+    qint64 m_frameStride = 0;
+    quint64 m_frameSequence = 0;
+
+    CaptureManager *m_manager = nullptr;
+    PipewireStream *m_stream = nullptr;
+
+    // counters when the measurement started
+    qint64 m_measureStart = 0;
+    qint64 m_cpuStart = 0;
+    quint64 m_publishedStart = 0;
+    quint64 m_skippedStart = 0;
+
+    QString m_report;
+};
+
+#endif // STREAMBENCH_H
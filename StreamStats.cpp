@@ -0,0 +1,158 @@
+#include "StreamStats.h"
+
+#include <QStringList>
+
+#include <time.h>
+
+void LatencyHistogram::record(qint64 ns)
+{
+    const quint64 value = ns > 0 ? static_cast<quint64>(ns) : 0;
+
+    m_buckets[bucketFor(value)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+
+    qint64 max = m_max.load(std::memory_order_relaxed);
+    while (ns > max && !m_max.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::reset()
+{
+    for (auto &bucket : m_buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    m_count.store(0, std::memory_order_relaxed);
+    m_sum.store(0, std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+}
+
+qint64 LatencyHistogram::mean() const
+{
+    const quint64 count = m_count.load(std::memory_order_relaxed);
+    return count ? static_cast<qint64>(m_sum.load(std::memory_order_relaxed) / count) : 0;
+}
+
+qint64 LatencyHistogram::percentile(double p) const
+{
+    const quint64 count = m_count.load(std::memory_order_relaxed);
+    if (!count) {
+        return 0;
+    }
+
+    const quint64 rank = qMax<quint64>(1, static_cast<quint64>(count * p / 100.0 + 0.5));
+    quint64 seen = 0;
+    for (int i = 0; i < BUCKETS; ++i) {
+        seen += m_buckets[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            return qMin<qint64>(bucketUpperBound(i), max());
+        }
+    }
+    return max();
+}
+
+int LatencyHistogram::bucketFor(quint64 value)
+{
+    if (value < SUB_BUCKETS) {
+        return static_cast<int>(value);
+    }
+
+    // top two bits below the most significant one pick the sub bucket
+    const int msb = 63 - __builtin_clzll(value);
+    const int sub = static_cast<int>((value >> (msb - 2)) & (SUB_BUCKETS - 1));
+    return (msb - 1) * SUB_BUCKETS + sub;
+}
+
+quint64 LatencyHistogram::bucketUpperBound(int bucket)
+{
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+
+    const int msb = bucket / SUB_BUCKETS + 1;
+    const quint64 sub = bucket % SUB_BUCKETS;
+    const quint64 width = quint64(1) << (msb - 2);
+    return ((SUB_BUCKETS + sub) << (msb - 2)) + width - 1;
+}
+
+void StreamStats::reset()
+{
+    framesReceived = 0;
+    framesDropped = 0;
+    queueDrops = 0;
+    nullChunks = 0;
+    cropRejects = 0;
+    unchangedFrames = 0;
+    cursorOnlyFrames = 0;
+    yuvDrops = 0;
+    mapHits = 0;
+    mapMisses = 0;
+    rateDecisions = 0;
+    rateDecreases = 0;
+    rateIncreases = 0;
+
+    dequeue.reset();
+    map.reset();
+    hash.reset();
+    convert.reset();
+    emission.reset();
+    process.reset();
+    frameAge.reset();
+    cpu.reset();
+}
+
+static QString formatHistogram(const char *name, const LatencyHistogram &histogram)
+{
+    return QStringLiteral("%1 n=%2 mean=%3us p50=%4us p99=%5us max=%6us")
+        .arg(QLatin1String(name))
+        .arg(histogram.count())
+        .arg(histogram.mean() / 1000.0, 0, 'f', 1)
+        .arg(histogram.percentile(50) / 1000.0, 0, 'f', 1)
+        .arg(histogram.percentile(99) / 1000.0, 0, 'f', 1)
+        .arg(histogram.max() / 1000.0, 0, 'f', 1);
+}
+
+QString StreamStats::summary() const
+{
+    QStringList lines;
+    lines << QStringLiteral("frames received=%1 dropped=%2 queueDrops=%3 null=%4 cropRejects=%5 unchanged=%6 cursorOnly=%7 yuvDrops=%8 mapHits=%9 mapMisses=%10")
+                 .arg(framesReceived.load())
+                 .arg(framesDropped.load())
+                 .arg(queueDrops.load())
+                 .arg(nullChunks.load())
+                 .arg(cropRejects.load())
+                 .arg(unchangedFrames.load())
+                 .arg(cursorOnlyFrames.load())
+                 .arg(yuvDrops.load())
+                 .arg(mapHits.load())
+                 .arg(mapMisses.load());
+    lines << QStringLiteral("rate fps=%1 scale=%2% decisions=%3 decreases=%4 increases=%5")
+                 .arg(framerateLimit.load())
+                 .arg(scaleLimit.load())
+                 .arg(rateDecisions.load())
+                 .arg(rateDecreases.load())
+                 .arg(rateIncreases.load());
+    lines << formatHistogram("dequeue", dequeue);
+    lines << formatHistogram("map", map);
+    lines << formatHistogram("hash", hash);
+    lines << formatHistogram("convert", convert);
+    lines << formatHistogram("emit", emission);
+    lines << formatHistogram("process", process);
+    lines << formatHistogram("age", frameAge);
+    lines << formatHistogram("cpu", cpu);
+    return lines.join(QLatin1Char('\n'));
+}
+
+qint64 StreamStats::now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+qint64 StreamStats::threadCpuTime()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
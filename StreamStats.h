@@ -0,0 +1,91 @@
+#ifndef STREAMSTATS_H
+#define STREAMSTATS_H
+
+#include <QString>
+
+#include <atomic>
+
+// Log-linear latency histogram: every power of two is split into four
+// buckets, so percentiles are within 25% of the real value. Recording is
+// lock-free and can happen from any thread.
+class LatencyHistogram
+{
+public:
+    void record(qint64 ns);
+    void reset();
+
+    quint64 count() const { return m_count.load(std::memory_order_relaxed); }
+    qint64 max() const { return m_max.load(std::memory_order_relaxed); }
+    quint64 sum() const { return m_sum.load(std::memory_order_relaxed); }
+    qint64 mean() const;
+    // upper bound of the bucket holding the given percentile (0..100)
+    qint64 percentile(double p) const;
+
+private:
+    static const int SUB_BUCKETS = 4;
+    static const int BUCKETS = 64 * SUB_BUCKETS;
+
+    static int bucketFor(quint64 value);
+    static quint64 bucketUpperBound(int bucket);
+
+    std::atomic<quint64> m_buckets[BUCKETS] = {};
+    std::atomic<quint64> m_count{0};
+    std::atomic<quint64> m_sum{0};
+    std::atomic<qint64> m_max{0};
+};
+
+// Per-stream counters and stage timings, all in nanoseconds
+struct StreamStats
+{
+    // buffers taken from the stream, including the ones dropped below
+    std::atomic<quint64> framesReceived{0};
+    // older buffers queued back unseen because a newer one was waiting
+    std::atomic<quint64> framesDropped{0};
+    // buffers the handoff queue to the workers had no room for
+    std::atomic<quint64> queueDrops{0};
+    // buffers with an empty or corrupted chunk and no cursor update
+    std::atomic<quint64> nullChunks{0};
+    // buffers with crop metadata larger than the stream
+    std::atomic<quint64> cropRejects{0};
+    // frames that changed nothing, neither converted nor emitted
+    std::atomic<quint64> unchangedFrames{0};
+    // buffers with only metadata, the cursor most of all, queued back unprocessed
+    std::atomic<quint64> cursorOnlyFrames{0};
+    // NV12/I420 frames that arrived with no encoder to take them
+    std::atomic<quint64> yuvDrops{0};
+
+    // MemFd buffers found in / missing from the mapping cache
+    std::atomic<quint64> mapHits{0};
+    std::atomic<quint64> mapMisses{0};
+
+    // rate control samples taken and the ones that lowered / raised the limits
+    std::atomic<quint64> rateDecisions{0};
+    std::atomic<quint64> rateDecreases{0};
+    std::atomic<quint64> rateIncreases{0};
+    // limits currently requested from the compositor, kept across reset()
+    std::atomic<int> framerateLimit{60};
+    std::atomic<int> scaleLimit{100};
+
+    LatencyHistogram dequeue;
+    LatencyHistogram map;
+    LatencyHistogram hash;
+    LatencyHistogram convert;
+    LatencyHistogram emission;
+    // a whole buffer, from handleFrame to the buffer going back or its readback starting
+    LatencyHistogram process;
+    // now - spa_meta_header.pts when the buffer is dequeued
+    LatencyHistogram frameAge;
+    // CPU time the processing thread spent on a buffer, unlike process
+    // without the time it waited for the lock or was preempted
+    LatencyHistogram cpu;
+
+    void reset();
+    QString summary() const;
+
+    // CLOCK_MONOTONIC, the clock PipeWire timestamps are taken from
+    static qint64 now();
+    // CLOCK_THREAD_CPUTIME_ID of the calling thread
+    static qint64 threadCpuTime();
+};
+
+#endif // STREAMSTATS_H
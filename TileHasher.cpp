@@ -0,0 +1,252 @@
+#include "TileHasher.h"
+
+#include <QVector>
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define HAVE_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+// Four 64bit lanes over 32 byte stripes, accumulated like XXH3: cheap 32x32
+// multiplies that map onto pmuludq/vmlal, scrambled after every row so
+// rows can't be swapped without changing the hash. The key of stripe s is
+// KEY ^ (s * PRIME64), otherwise the sum over a row wouldn't notice two
+// stripes (8 pixels each) trading places.
+
+static const int STRIPE = 32;
+static const quint64 PRIME32 = 0x9E3779B1ULL;
+static const quint64 PRIME64 = 0x9E3779B97F4A7C15ULL;
+static const quint64 KEY[4] = {0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL,
+                               0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL};
+static const quint64 SEED[4] = {0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL,
+                                0x165667B19E3779F9ULL, 0x85EBCA77C2B2AE63ULL};
+
+static inline quint64 rotl(quint64 value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline quint64 finalize(const quint64 acc[4])
+{
+    quint64 hash = acc[0] ^ rotl(acc[1], 16) ^ rotl(acc[2], 32) ^ rotl(acc[3], 48);
+    hash ^= hash >> 33;
+    hash *= 0xC2B2AE3D27D4EB4FULL;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+quint64 TileHasher::hashTileScalar(const uint8_t *src, qint64 stride, int rowBytes, int rows)
+{
+    quint64 acc[4] = {SEED[0], SEED[1], SEED[2], SEED[3]};
+    const int tail = rowBytes % STRIPE;
+
+    for (int y = 0; y < rows; ++y) {
+        const uint8_t *row = src + y * stride;
+        uint8_t padded[STRIPE] = {};
+
+        quint64 position = 0;
+        for (int x = 0; x < rowBytes; x += STRIPE, position += PRIME64) {
+            const uint8_t *stripe = row + x;
+            if (x + STRIPE > rowBytes) {
+                std::memcpy(padded, stripe, tail);
+                stripe = padded;
+            }
+            for (int i = 0; i < 4; ++i) {
+                quint64 data;
+                std::memcpy(&data, stripe + i * 8, 8);
+                const quint64 keyed = data ^ KEY[i] ^ position;
+                acc[i] += (keyed & 0xffffffff) * (keyed >> 32);
+                acc[i] += data;
+            }
+        }
+
+        for (int i = 0; i < 4; ++i) {
+            acc[i] ^= acc[i] >> 47;
+            acc[i] ^= KEY[i];
+            acc[i] *= PRIME32;
+        }
+    }
+
+    return finalize(acc);
+}
+
+#if HAVE_X86_KERNELS
+__attribute__((target("avx2")))
+static quint64 hashTileAvx2(const uint8_t *src, qint64 stride, int rowBytes, int rows)
+{
+    const __m256i key = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(KEY));
+    const __m256i prime = _mm256_set1_epi64x(PRIME32);
+    const __m256i step = _mm256_set1_epi64x(PRIME64);
+    __m256i acc = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(SEED));
+    const int tail = rowBytes % STRIPE;
+
+    for (int y = 0; y < rows; ++y) {
+        const uint8_t *row = src + y * stride;
+        __m256i position = _mm256_setzero_si256();
+
+        for (int x = 0; x < rowBytes; x += STRIPE, position = _mm256_add_epi64(position, step)) {
+            __m256i data;
+            if (x + STRIPE > rowBytes) {
+                uint8_t padded[STRIPE] = {};
+                std::memcpy(padded, row + x, tail);
+                data = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(padded));
+            } else {
+                data = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + x));
+            }
+            const __m256i keyed = _mm256_xor_si256(data, _mm256_xor_si256(key, position));
+            const __m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+            acc = _mm256_add_epi64(acc, _mm256_add_epi64(product, data));
+        }
+
+        acc = _mm256_xor_si256(acc, _mm256_srli_epi64(acc, 47));
+        acc = _mm256_xor_si256(acc, key);
+        const __m256i low = _mm256_mul_epu32(acc, prime);
+        const __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(acc, 32), prime);
+        acc = _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+    }
+
+    quint64 lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes), acc);
+    return finalize(lanes);
+}
+#endif /* HAVE_X86_KERNELS */
+
+#if HAVE_NEON_KERNELS
+static inline void scrambleNeon(uint64x2_t &acc, uint64x2_t key)
+{
+    acc = veorq_u64(acc, vshrq_n_u64(acc, 47));
+    acc = veorq_u64(acc, key);
+    const uint32x2_t prime = vdup_n_u32(PRIME32);
+    const uint64x2_t low = vmull_u32(vmovn_u64(acc), prime);
+    const uint64x2_t high = vmull_u32(vshrn_n_u64(acc, 32), prime);
+    acc = vaddq_u64(low, vshlq_n_u64(high, 32));
+}
+
+static quint64 hashTileNeon(const uint8_t *src, qint64 stride, int rowBytes, int rows)
+{
+    const uint64x2_t key0 = vld1q_u64(KEY);
+    const uint64x2_t key1 = vld1q_u64(KEY + 2);
+    uint64x2_t acc0 = vld1q_u64(SEED);
+    uint64x2_t acc1 = vld1q_u64(SEED + 2);
+    const uint64x2_t step = vdupq_n_u64(PRIME64);
+    const int tail = rowBytes % STRIPE;
+
+    for (int y = 0; y < rows; ++y) {
+        const uint8_t *row = src + y * stride;
+        uint64x2_t position = vdupq_n_u64(0);
+
+        for (int x = 0; x < rowBytes; x += STRIPE, position = vaddq_u64(position, step)) {
+            const uint8_t *stripe = row + x;
+            uint8_t padded[STRIPE] = {};
+            if (x + STRIPE > rowBytes) {
+                std::memcpy(padded, stripe, tail);
+                stripe = padded;
+            }
+            const uint64x2_t data0 = vreinterpretq_u64_u8(vld1q_u8(stripe));
+            const uint64x2_t data1 = vreinterpretq_u64_u8(vld1q_u8(stripe + 16));
+            const uint64x2_t keyed0 = veorq_u64(data0, veorq_u64(key0, position));
+            const uint64x2_t keyed1 = veorq_u64(data1, veorq_u64(key1, position));
+            acc0 = vmlal_u32(acc0, vmovn_u64(keyed0), vshrn_n_u64(keyed0, 32));
+            acc1 = vmlal_u32(acc1, vmovn_u64(keyed1), vshrn_n_u64(keyed1, 32));
+            acc0 = vaddq_u64(acc0, data0);
+            acc1 = vaddq_u64(acc1, data1);
+        }
+
+        scrambleNeon(acc0, key0);
+        scrambleNeon(acc1, key1);
+    }
+
+    quint64 lanes[4];
+    vst1q_u64(lanes, acc0);
+    vst1q_u64(lanes + 2, acc1);
+    return finalize(lanes);
+}
+#endif /* HAVE_NEON_KERNELS */
+
+typedef quint64 (*TileHashFunction)(const uint8_t *src, qint64 stride, int rowBytes, int rows);
+
+static TileHashFunction selectTileHash()
+{
+#if HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx2")) {
+        return hashTileAvx2;
+    }
+#endif /* HAVE_X86_KERNELS */
+#if HAVE_NEON_KERNELS
+    return hashTileNeon;
+#endif /* HAVE_NEON_KERNELS */
+    return TileHasher::hashTileScalar;
+}
+
+quint64 TileHasher::hashTile(const uint8_t *src, qint64 stride, int rowBytes, int rows)
+{
+    static const TileHashFunction hash = selectTileHash();
+    return hash(src, stride, rowBytes, rows);
+}
+
+void TileHasher::resize(const QSize &maxSize)
+{
+    const int columns = (maxSize.width() + TILE_SIZE - 1) / TILE_SIZE;
+    const int rows = (maxSize.height() + TILE_SIZE - 1) / TILE_SIZE;
+
+    m_maxSize = maxSize;
+    m_hashes.assign(static_cast<size_t>(columns) * rows, 0);
+    invalidate();
+}
+
+void TileHasher::invalidate()
+{
+    m_size = QSize();
+}
+
+QRegion TileHasher::update(const uint8_t *src, qint64 stride, const QSize &size, int bytesPerPixel)
+{
+    const int columns = (size.width() + TILE_SIZE - 1) / TILE_SIZE;
+    const int rows = (size.height() + TILE_SIZE - 1) / TILE_SIZE;
+
+    // hashes of a differently sized frame mean nothing
+    const bool valid = size == m_size;
+    if (m_hashes.size() < static_cast<size_t>(columns) * rows) {
+        m_hashes.resize(static_cast<size_t>(columns) * rows);
+    }
+    m_size = size;
+
+    // runs of changed tiles per tile row, already in the y-x banded order
+    // QRegion::setRects wants
+    QVector<QRect> changed;
+    for (int ty = 0; ty < rows; ++ty) {
+        const int y = ty * TILE_SIZE;
+        const int height = qMin(TILE_SIZE, size.height() - y);
+        int runStart = -1;
+
+        for (int tx = 0; tx <= columns; ++tx) {
+            bool tileChanged = false;
+            if (tx < columns) {
+                const int x = tx * TILE_SIZE;
+                const int width = qMin(TILE_SIZE, size.width() - x);
+                const quint64 hash = hashTile(src + y * stride + x * bytesPerPixel, stride, width * bytesPerPixel, height);
+
+                quint64 &stored = m_hashes[ty * columns + tx];
+                tileChanged = !valid || stored != hash;
+                stored = hash;
+            }
+
+            if (tileChanged && runStart < 0) {
+                runStart = tx;
+            } else if (!tileChanged && runStart >= 0) {
+                const int x = runStart * TILE_SIZE;
+                changed.append(QRect(x, y, qMin(tx * TILE_SIZE, size.width()) - x, height));
+                runStart = -1;
+            }
+        }
+    }
+
+    QRegion region;
+    region.setRects(changed.constData(), changed.size());
+    return region;
+}
@@ -0,0 +1,37 @@
+#ifndef TILEHASHER_H
+#define TILEHASHER_H
+
+#include <QRegion>
+#include <QSize>
+
+#include <vector>
+
+// Change detection for producers that send no damage: the frame is cut into
+// TILE_SIZE x TILE_SIZE tiles and each tile's hash is compared to the one
+// from the previous call. The AVX2/NEON kernels compute the same hash as
+// the scalar one, so results don't depend on the CPU.
+class TileHasher
+{
+public:
+    static constexpr int TILE_SIZE = 64;
+
+    // size the hash array for frames up to maxSize
+    void resize(const QSize &maxSize);
+    // forget the previous frame, the next update reports everything
+    void invalidate();
+
+    // hash a size.width() x size.height() frame at src and return the tiles
+    // that changed since the last update
+    QRegion update(const uint8_t *src, qint64 stride, const QSize &size, int bytesPerPixel);
+
+    static quint64 hashTile(const uint8_t *src, qint64 stride, int rowBytes, int rows);
+    static quint64 hashTileScalar(const uint8_t *src, qint64 stride, int rowBytes, int rows);
+
+private:
+    QSize m_maxSize;
+    // size of the frame the hashes belong to, empty when invalid
+    QSize m_size;
+    std::vector<quint64> m_hashes;
+};
+
+#endif // TILEHASHER_H
@@ -0,0 +1,366 @@
+#include "VideoEncoder.h"
+
+#include <QDebug>
+#include <QThread>
+#include <QtEndian>
+
+#include <cstring>
+
+#if HAVE_VPX
+#include <vpx/vp8cx.h>
+#endif /* HAVE_VPX */
+
+// frames being converted, queued or encoded at once
+static const int PICTURE_COUNT = 3;
+// IVF timestamps are in milliseconds
+static const int TIMEBASE = 1000;
+static const int IVF_HEADER_SIZE = 32;
+static const int IVF_FRAME_HEADER_SIZE = 12;
+
+VideoEncoder::VideoEncoder()
+    : VideoEncoder(Settings())
+{
+}
+
+VideoEncoder::VideoEncoder(const Settings &settings)
+    : m_settings(settings)
+{
+    for (int i = 0; i < PICTURE_COUNT; ++i) {
+        m_free.append(new Picture);
+    }
+}
+
+VideoEncoder::~VideoEncoder()
+{
+    close();
+    qDeleteAll(m_free);
+    qDeleteAll(m_queued);
+}
+
+bool VideoEncoder::open(const QString &path)
+{
+#if HAVE_VPX
+    close();
+
+    bool opened;
+    if (path == QLatin1String("-")) {
+        opened = m_file.open(stdout, QIODevice::WriteOnly);
+    } else {
+        m_file.setFileName(path);
+        opened = m_file.open(QIODevice::WriteOnly | QIODevice::Truncate);
+    }
+    if (!opened) {
+        qWarning() << "Failed to open" << path << "for encoding:" << m_file.errorString();
+        return false;
+    }
+
+    m_closing = false;
+    m_codecSize = QSize();
+    m_firstPts = -1;
+    m_lastPts = -1;
+    m_fileFrames = 0;
+
+    m_thread = QThread::create([this] { encodeLoop(); });
+    m_thread->setObjectName(QStringLiteral("video-encoder"));
+    m_thread->start();
+    return true;
+#else
+    qWarning() << "Built without libvpx, can't encode to" << path;
+    return false;
+#endif /* HAVE_VPX */
+}
+
+void VideoEncoder::close()
+{
+    if (!m_thread) {
+        return;
+    }
+
+    {
+        QMutexLocker locker(&m_mutex);
+        m_closing = true;
+        m_wake.wakeAll();
+    }
+    m_thread->wait();
+    delete m_thread;
+    m_thread = nullptr;
+
+    // the frame count in the header is only known now
+    if (!m_file.isSequential() && m_file.seek(24)) {
+        const quint32 frames = qToLittleEndian(m_fileFrames);
+        m_file.write(reinterpret_cast<const char *>(&frames), sizeof(frames));
+    }
+    m_file.close();
+}
+
+bool VideoEncoder::submit(const uint8_t *data, qint64 stride, const QSize &size, spa_video_format format, qint64 pts)
+{
+    if (!m_thread || size.isEmpty()) {
+        return false;
+    }
+
+    if (format != m_yuv.format()) {
+        m_yuv.setFormat(format);
+    }
+    if (!m_yuv.isValid()) {
+        qWarning() << "Can't encode video format" << format;
+        return false;
+    }
+
+    Picture *picture = takePicture();
+    if (!picture) {
+        return false;
+    }
+
+    picture->data.resize(YuvConverter::packedSize(size));
+    picture->size = size;
+    picture->pts = pts;
+    uint8_t *planes[3];
+    qint64 strides[3];
+    YuvConverter::packedPlanes(picture->data.data(), size, YuvConverter::I420, planes, strides);
+    m_yuv.convert(data, stride, QRect(QPoint(0, 0), size), YuvConverter::I420, planes, strides);
+
+    queuePicture(picture);
+    return true;
+}
+
+bool VideoEncoder::submitYuv(const uint8_t *const planes[3], const qint64 strides[3], const QRect &crop,
+                             YuvConverter::Layout layout, qint64 pts)
+{
+    if (!m_thread || crop.isEmpty()) {
+        return false;
+    }
+
+    Picture *picture = takePicture();
+    if (!picture) {
+        return false;
+    }
+
+    picture->data.resize(YuvConverter::packedSize(crop.size()));
+    picture->size = crop.size();
+    picture->pts = pts;
+    uint8_t *dst[3];
+    qint64 dstStrides[3];
+    YuvConverter::packedPlanes(picture->data.data(), crop.size(), YuvConverter::I420, dst, dstStrides);
+
+    for (int y = 0; y < crop.height(); ++y) {
+        std::memcpy(dst[0] + y * dstStrides[0], planes[0] + (crop.y() + y) * strides[0] + crop.x(), crop.width());
+    }
+
+    // chroma of odd crop offsets is taken from the enclosing 2x2 block
+    const int chromaX = crop.x() / 2;
+    const int chromaY = crop.y() / 2;
+    const int chromaWidth = (crop.width() + 1) / 2;
+    const int chromaHeight = (crop.height() + 1) / 2;
+    for (int y = 0; y < chromaHeight; ++y) {
+        uint8_t *u = dst[1] + y * dstStrides[1];
+        uint8_t *v = dst[2] + y * dstStrides[2];
+        if (layout == YuvConverter::NV12) {
+            const uint8_t *uv = planes[1] + (chromaY + y) * strides[1] + chromaX * 2;
+            for (int x = 0; x < chromaWidth; ++x) {
+                u[x] = uv[2 * x];
+                v[x] = uv[2 * x + 1];
+            }
+        } else {
+            std::memcpy(u, planes[1] + (chromaY + y) * strides[1] + chromaX, chromaWidth);
+            std::memcpy(v, planes[2] + (chromaY + y) * strides[2] + chromaX, chromaWidth);
+        }
+    }
+
+    queuePicture(picture);
+    return true;
+}
+
+VideoEncoder::Picture *VideoEncoder::takePicture()
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_free.isEmpty()) {
+        // the encoder is still busy with older frames
+        ++framesDropped;
+        return nullptr;
+    }
+    return m_free.takeLast();
+}
+
+void VideoEncoder::queuePicture(Picture *picture)
+{
+    QMutexLocker locker(&m_mutex);
+    m_queued.append(picture);
+    m_wake.wakeAll();
+}
+
+void VideoEncoder::encodeLoop()
+{
+    QMutexLocker locker(&m_mutex);
+    for (;;) {
+        while (m_queued.isEmpty() && !m_closing) {
+            m_wake.wait(&m_mutex);
+        }
+        if (m_queued.isEmpty()) {
+            // closing and drained
+            break;
+        }
+
+        Picture *picture = m_queued.takeFirst();
+        locker.unlock();
+#if HAVE_VPX
+        encode(picture);
+#endif /* HAVE_VPX */
+        locker.relock();
+        m_free.append(picture);
+    }
+    locker.unlock();
+
+#if HAVE_VPX
+    if (m_codecInitialized) {
+        flush();
+        vpx_codec_destroy(&m_codec);
+        m_codecInitialized = false;
+    }
+#endif /* HAVE_VPX */
+}
+
+void VideoEncoder::writeFileHeader(const QSize &size)
+{
+    uchar header[IVF_HEADER_SIZE] = {'D', 'K', 'I', 'F'};
+    qToLittleEndian<quint16>(0, header + 4);
+    qToLittleEndian<quint16>(IVF_HEADER_SIZE, header + 6);
+    std::memcpy(header + 8, "VP80", 4);
+    qToLittleEndian<quint16>(size.width(), header + 12);
+    qToLittleEndian<quint16>(size.height(), header + 14);
+    qToLittleEndian<quint32>(TIMEBASE, header + 16);
+    qToLittleEndian<quint32>(1, header + 20);
+    // frame count, patched in close() when the output is seekable
+    qToLittleEndian<quint32>(0, header + 24);
+    qToLittleEndian<quint32>(0, header + 28);
+    m_file.write(reinterpret_cast<const char *>(header), sizeof(header));
+    bytesWritten += sizeof(header);
+}
+
+void VideoEncoder::writeFrame(const void *data, size_t size, qint64 pts)
+{
+    uchar header[IVF_FRAME_HEADER_SIZE];
+    qToLittleEndian<quint32>(size, header);
+    qToLittleEndian<quint64>(pts, header + 4);
+    m_file.write(reinterpret_cast<const char *>(header), sizeof(header));
+    m_file.write(static_cast<const char *>(data), size);
+    // readers on a pipe want frames as they come
+    m_file.flush();
+
+    bytesWritten += sizeof(header) + size;
+    ++m_fileFrames;
+}
+
+#if HAVE_VPX
+bool VideoEncoder::initCodec(const QSize &size)
+{
+    vpx_codec_enc_cfg_t config;
+    if (vpx_codec_enc_config_default(vpx_codec_vp8_cx(), &config, 0) != VPX_CODEC_OK) {
+        qWarning() << "Failed to get default VP8 encoder config";
+        return false;
+    }
+
+    config.g_w = size.width();
+    config.g_h = size.height();
+    config.g_timebase.num = 1;
+    config.g_timebase.den = TIMEBASE;
+    config.g_threads = m_settings.threads;
+    config.g_pass = VPX_RC_ONE_PASS;
+    config.rc_target_bitrate = m_settings.bitrate;
+    if (m_settings.keyframeInterval > 0) {
+        config.kf_mode = VPX_KF_AUTO;
+        config.kf_min_dist = 0;
+        config.kf_max_dist = m_settings.keyframeInterval;
+    }
+    if (m_settings.lowLatency) {
+        // no frame is held back for lookahead, rate control keeps the
+        // buffer small so bitrate spikes don't turn into delay
+        config.g_lag_in_frames = 0;
+        config.g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT;
+        config.rc_end_usage = VPX_CBR;
+        config.rc_buf_initial_sz = 500;
+        config.rc_buf_optimal_sz = 600;
+        config.rc_buf_sz = 1000;
+    } else {
+        config.rc_end_usage = VPX_VBR;
+    }
+
+    if (vpx_codec_enc_init(&m_codec, vpx_codec_vp8_cx(), &config, 0) != VPX_CODEC_OK) {
+        qWarning() << "Failed to initialize VP8 encoder:" << vpx_codec_error(&m_codec);
+        return false;
+    }
+    m_codecInitialized = true;
+    vpx_codec_control(&m_codec, VP8E_SET_CPUUSED, m_settings.lowLatency ? 8 : 2);
+
+    // the header keeps the first size, VP8 keyframes carry later ones
+    if (!m_codecSize.isValid()) {
+        writeFileHeader(size);
+    }
+    m_codecSize = size;
+    return true;
+}
+
+void VideoEncoder::encode(Picture *picture)
+{
+    if (picture->size != m_codecSize || !m_codecInitialized) {
+        if (m_codecInitialized) {
+            flush();
+            vpx_codec_destroy(&m_codec);
+            m_codecInitialized = false;
+        }
+        if (!initCodec(picture->size)) {
+            return;
+        }
+    }
+
+    uint8_t *planes[3];
+    qint64 strides[3];
+    YuvConverter::packedPlanes(picture->data.data(), picture->size, YuvConverter::I420, planes, strides);
+
+    vpx_image_t image;
+    vpx_img_wrap(&image, VPX_IMG_FMT_I420, picture->size.width(), picture->size.height(), 1, planes[0]);
+    for (int i = 0; i < 3; ++i) {
+        image.planes[i] = planes[i];
+        image.stride[i] = strides[i];
+    }
+
+    if (m_firstPts < 0) {
+        m_firstPts = picture->pts;
+    }
+    // the codec wants strictly increasing timestamps
+    const vpx_codec_pts_t pts = qMax<qint64>((picture->pts - m_firstPts) / 1000000, m_lastPts + 1);
+    m_lastPts = pts;
+
+    const unsigned long deadline = m_settings.lowLatency ? VPX_DL_REALTIME : VPX_DL_GOOD_QUALITY;
+    if (vpx_codec_encode(&m_codec, &image, pts, 1, 0, deadline) != VPX_CODEC_OK) {
+        qWarning() << "Failed to encode frame:" << vpx_codec_error_detail(&m_codec);
+        return;
+    }
+    ++framesEncoded;
+    writePackets();
+}
+
+void VideoEncoder::flush()
+{
+    const unsigned long deadline = m_settings.lowLatency ? VPX_DL_REALTIME : VPX_DL_GOOD_QUALITY;
+    do {
+        if (vpx_codec_encode(&m_codec, nullptr, -1, 1, 0, deadline) != VPX_CODEC_OK) {
+            return;
+        }
+    } while (writePackets());
+}
+
+bool VideoEncoder::writePackets()
+{
+    bool written = false;
+    vpx_codec_iter_t iter = nullptr;
+    const vpx_codec_cx_pkt_t *packet;
+    while ((packet = vpx_codec_get_cx_data(&m_codec, &iter))) {
+        if (packet->kind == VPX_CODEC_CX_FRAME_PKT) {
+            writeFrame(packet->data.frame.buf, packet->data.frame.sz, packet->data.frame.pts);
+            written = true;
+        }
+    }
+    return written;
+}
+#endif /* HAVE_VPX */
@@ -0,0 +1,106 @@
+#ifndef VIDEOENCODER_H
+#define VIDEOENCODER_H
+
+#include <QFile>
+#include <QList>
+#include <QMutex>
+#include <QSize>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <vector>
+
+#include <spa/param/video/raw.h>
+
+#include "YuvConverter.h"
+
+#if HAVE_VPX
+#include <vpx/vpx_encoder.h>
+#endif /* HAVE_VPX */
+
+class QThread;
+
+// Software VP8 encoder writing an IVF stream to a file or pipe.
+// submit() converts the frame to I420 on the calling thread and hands it to
+// the encoder thread; when that thread falls behind new frames are dropped
+// instead of queueing up latency.
+class VideoEncoder
+{
+public:
+    struct Settings {
+        // target bitrate in kbit/s
+        int bitrate = 4000;
+        // frames between forced keyframes, 0 leaves it to the codec
+        int keyframeInterval = 120;
+        // realtime deadline, CBR and no lookahead
+        bool lowLatency = true;
+        int threads = 1;
+    };
+
+    // no default argument, Settings isn't complete inside the class
+    VideoEncoder();
+    explicit VideoEncoder(const Settings &settings);
+    ~VideoEncoder();
+
+    VideoEncoder(const VideoEncoder &) = delete;
+    VideoEncoder &operator=(const VideoEncoder &) = delete;
+
+    // start encoding into path, "-" writes to stdout
+    bool open(const QString &path);
+    // encode what is queued and finish the file
+    void close();
+    bool isOpen() const { return m_thread != nullptr; }
+
+    // queue a packed RGB frame, pts in nanoseconds; false when dropped
+    bool submit(const uint8_t *data, qint64 stride, const QSize &size, spa_video_format format, qint64 pts);
+    // queue the crop of an NV12/I420 frame, only copied
+    bool submitYuv(const uint8_t *const planes[3], const qint64 strides[3], const QRect &crop,
+                   YuvConverter::Layout layout, qint64 pts);
+
+    std::atomic<quint64> framesEncoded{0};
+    std::atomic<quint64> framesDropped{0};
+    std::atomic<quint64> bytesWritten{0};
+
+private:
+    struct Picture {
+        QSize size;
+        qint64 pts = 0;
+        std::vector<uint8_t> data;
+    };
+
+    Picture *takePicture();
+    void queuePicture(Picture *picture);
+    void encodeLoop();
+    void writeFileHeader(const QSize &size);
+    void writeFrame(const void *data, size_t size, qint64 pts);
+
+#if HAVE_VPX
+    bool initCodec(const QSize &size);
+    void encode(Picture *picture);
+    void flush();
+    bool writePackets();
+
+    vpx_codec_ctx_t m_codec = {};
+    bool m_codecInitialized = false;
+#endif /* HAVE_VPX */
+
+    Settings m_settings;
+    // caller thread only
+    YuvConverter m_yuv;
+    QFile m_file;
+    QThread *m_thread = nullptr;
+
+    QMutex m_mutex;
+    QWaitCondition m_wake;
+    QList<Picture *> m_free;
+    QList<Picture *> m_queued;
+    bool m_closing = false;
+
+    // encoder thread only
+    QSize m_codecSize;
+    qint64 m_firstPts = -1;
+    qint64 m_lastPts = -1;
+    quint32 m_fileFrames = 0;
+};
+
+#endif // VIDEOENCODER_H
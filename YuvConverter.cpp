@@ -0,0 +1,425 @@
+#include "YuvConverter.h"
+
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define HAVE_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+// chroma is computed from the sum of 2x2 pixels, so with Q14 coefficients
+// the result sits at bit 16
+const int32_t CHROMA_BIAS = (128 << 16) + (1 << 15);
+
+inline uint8_t clampByte(int value)
+{
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+inline uint8_t lumaScalar(const YuvConverter::Kernel &k, const uint8_t *pixel)
+{
+    int32_t sum = k.yBias;
+    for (int i = 0; i < k.bytesPerPixel; ++i) {
+        sum += k.y[i] * pixel[i];
+    }
+    return clampByte(sum >> 14);
+}
+
+// Scalar reference: columns x..width of a pair of rows, row1 repeats row0
+// and y1 is null on the last row of an odd height
+int rowsScalar(const YuvConverter::Kernel &k, const uint8_t *row0, const uint8_t *row1, int x, int width,
+               uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int chromaStep)
+{
+    const int bpp = k.bytesPerPixel;
+    for (; x < width; x += 2) {
+        const int x1 = qMin(x + 1, width - 1);
+        const uint8_t *pixels[4] = {row0 + x * bpp, row0 + x1 * bpp, row1 + x * bpp, row1 + x1 * bpp};
+
+        y0[x] = lumaScalar(k, pixels[0]);
+        if (x + 1 < width) {
+            y0[x + 1] = lumaScalar(k, pixels[1]);
+        }
+        if (y1) {
+            y1[x] = lumaScalar(k, pixels[2]);
+            if (x + 1 < width) {
+                y1[x + 1] = lumaScalar(k, pixels[3]);
+            }
+        }
+
+        int32_t sumU = CHROMA_BIAS;
+        int32_t sumV = CHROMA_BIAS;
+        for (int i = 0; i < bpp; ++i) {
+            const int sum = pixels[0][i] + pixels[1][i] + pixels[2][i] + pixels[3][i];
+            sumU += k.u[i] * sum;
+            sumV += k.v[i] * sum;
+        }
+        const int chroma = x / 2 * chromaStep;
+        u[chroma] = clampByte(sumU >> 16);
+        v[chroma] = clampByte(sumV >> 16);
+    }
+    return x;
+}
+
+#if HAVE_X86_KERNELS
+// Pixels are handled as 32 bit lanes; masking even and odd bytes gives two
+// pairs of 16 bit channels that pmaddwd multiplies with their coefficients.
+
+__attribute__((target("avx2")))
+inline __m256i coefficientPairs(const int16_t *c, int first)
+{
+    return _mm256_set1_epi32(static_cast<uint16_t>(c[first]) | (static_cast<uint32_t>(static_cast<uint16_t>(c[first + 2])) << 16));
+}
+
+// eight pixels, 24 bit ones are expanded to 32 bits with a zero fourth byte;
+// that reads 4 bytes past the eighth pixel
+__attribute__((target("avx2")))
+inline __m256i loadPixelsAvx2(const uint8_t *src, int bpp)
+{
+    if (bpp == 4) {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src));
+    }
+    const __m128i expand = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i low = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src)), expand);
+    const __m128i high = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 12)), expand);
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+}
+
+__attribute__((target("avx2")))
+inline __m256i lumaAvx2(__m256i pixels, __m256i even, __m256i odd, __m256i bias)
+{
+    const __m256i mask = _mm256_set1_epi32(0x00ff00ff);
+    const __m256i evenBytes = _mm256_and_si256(pixels, mask);
+    const __m256i oddBytes = _mm256_and_si256(_mm256_srli_epi32(pixels, 8), mask);
+    const __m256i sum = _mm256_add_epi32(_mm256_madd_epi16(evenBytes, even), _mm256_madd_epi16(oddBytes, odd));
+    return _mm256_srai_epi32(_mm256_add_epi32(sum, bias), 14);
+}
+
+__attribute__((target("avx2")))
+inline void storeLumaAvx2(uint8_t *dst, __m256i first, __m256i second)
+{
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(first, second), 0xD8);
+    packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(packed, packed), 0x08);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), _mm256_castsi256_si128(packed));
+}
+
+// 2x2 sums of eight pixels from two rows, valid in the even 32 bit lanes
+__attribute__((target("avx2")))
+inline void chromaSumsAvx2(__m256i row0, __m256i row1, __m256i *evenBytes, __m256i *oddBytes)
+{
+    const __m256i mask = _mm256_set1_epi32(0x00ff00ff);
+    __m256i even = _mm256_add_epi16(_mm256_and_si256(row0, mask), _mm256_and_si256(row1, mask));
+    __m256i odd = _mm256_add_epi16(_mm256_and_si256(_mm256_srli_epi32(row0, 8), mask),
+                                   _mm256_and_si256(_mm256_srli_epi32(row1, 8), mask));
+    *evenBytes = _mm256_add_epi16(even, _mm256_srli_epi64(even, 32));
+    *oddBytes = _mm256_add_epi16(odd, _mm256_srli_epi64(odd, 32));
+}
+
+// chroma of 16 pixels, the two halves each hold four values in even lanes
+__attribute__((target("avx2")))
+inline __m256i chromaAvx2(__m256i evenA, __m256i oddA, __m256i evenB, __m256i oddB, __m256i even, __m256i odd)
+{
+    const __m256i bias = _mm256_set1_epi32(CHROMA_BIAS);
+    __m256i a = _mm256_add_epi32(_mm256_madd_epi16(evenA, even), _mm256_madd_epi16(oddA, odd));
+    __m256i b = _mm256_add_epi32(_mm256_madd_epi16(evenB, even), _mm256_madd_epi16(oddB, odd));
+    a = _mm256_shuffle_epi32(a, _MM_SHUFFLE(2, 0, 2, 0));
+    b = _mm256_shuffle_epi32(b, _MM_SHUFFLE(2, 0, 2, 0));
+    const __m256i ordered = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(a, b), 0xD8);
+    return _mm256_srai_epi32(_mm256_add_epi32(ordered, bias), 16);
+}
+
+__attribute__((target("avx2")))
+int rowsAvx2(const YuvConverter::Kernel &k, const uint8_t *row0, const uint8_t *row1, int width,
+             uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int chromaStep)
+{
+    const int bpp = k.bytesPerPixel;
+    const __m256i yEven = coefficientPairs(k.y, 0);
+    const __m256i yOdd = coefficientPairs(k.y, 1);
+    const __m256i uEven = coefficientPairs(k.u, 0);
+    const __m256i uOdd = coefficientPairs(k.u, 1);
+    const __m256i vEven = coefficientPairs(k.v, 0);
+    const __m256i vOdd = coefficientPairs(k.v, 1);
+    const __m256i yBias = _mm256_set1_epi32(k.yBias);
+    const __m256i gather = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    // room for the overread of the 24 bit loads
+    const int margin = bpp == 3 ? 2 : 0;
+
+    int x = 0;
+    for (; x + 16 + margin <= width; x += 16) {
+        const __m256i a0 = loadPixelsAvx2(row0 + x * bpp, bpp);
+        const __m256i b0 = loadPixelsAvx2(row0 + (x + 8) * bpp, bpp);
+        const __m256i a1 = loadPixelsAvx2(row1 + x * bpp, bpp);
+        const __m256i b1 = loadPixelsAvx2(row1 + (x + 8) * bpp, bpp);
+
+        storeLumaAvx2(y0 + x, lumaAvx2(a0, yEven, yOdd, yBias), lumaAvx2(b0, yEven, yOdd, yBias));
+        if (y1) {
+            storeLumaAvx2(y1 + x, lumaAvx2(a1, yEven, yOdd, yBias), lumaAvx2(b1, yEven, yOdd, yBias));
+        }
+
+        __m256i evenA, oddA, evenB, oddB;
+        chromaSumsAvx2(a0, a1, &evenA, &oddA);
+        chromaSumsAvx2(b0, b1, &evenB, &oddB);
+        const __m256i chromaU = chromaAvx2(evenA, oddA, evenB, oddB, uEven, uOdd);
+        const __m256i chromaV = chromaAvx2(evenA, oddA, evenB, oddB, vEven, vOdd);
+
+        // eight U then eight V bytes
+        __m256i packed = _mm256_packs_epi32(chromaU, chromaV);
+        packed = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(packed, packed), gather);
+        const __m128i uv = _mm256_castsi256_si128(packed);
+        if (chromaStep == 2) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(u + x), _mm_unpacklo_epi8(uv, _mm_srli_si128(uv, 8)));
+        } else {
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(u + x / 2), uv);
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(v + x / 2), _mm_srli_si128(uv, 8));
+        }
+    }
+    return x;
+}
+#endif /* HAVE_X86_KERNELS */
+
+#if HAVE_NEON_KERNELS
+// vld3/vld4 split eight pixels into one register per byte position
+
+inline uint8x8_t lumaNeon(const uint8x8_t *bytes, int bpp, const int16_t *c, int32_t bias)
+{
+    int32x4_t low = vdupq_n_s32(bias);
+    int32x4_t high = low;
+    for (int i = 0; i < bpp; ++i) {
+        const int16x8_t wide = vreinterpretq_s16_u16(vmovl_u8(bytes[i]));
+        low = vmlal_n_s16(low, vget_low_s16(wide), c[i]);
+        high = vmlal_n_s16(high, vget_high_s16(wide), c[i]);
+    }
+    return vqmovn_u16(vcombine_u16(vqmovun_s32(vshrq_n_s32(low, 14)), vqmovun_s32(vshrq_n_s32(high, 14))));
+}
+
+inline uint16x4_t chromaNeon(const int16x4_t *sums, int bpp, const int16_t *c)
+{
+    int32x4_t sum = vdupq_n_s32(CHROMA_BIAS);
+    for (int i = 0; i < bpp; ++i) {
+        sum = vmlal_n_s16(sum, sums[i], c[i]);
+    }
+    return vqmovun_s32(vshrq_n_s32(sum, 16));
+}
+
+int rowsNeon(const YuvConverter::Kernel &k, const uint8_t *row0, const uint8_t *row1, int width,
+             uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int chromaStep)
+{
+    const int bpp = k.bytesPerPixel;
+
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        uint8x8_t bytes0[4];
+        uint8x8_t bytes1[4];
+        if (bpp == 4) {
+            const uint8x8x4_t first = vld4_u8(row0 + x * 4);
+            const uint8x8x4_t second = vld4_u8(row1 + x * 4);
+            for (int i = 0; i < 4; ++i) {
+                bytes0[i] = first.val[i];
+                bytes1[i] = second.val[i];
+            }
+        } else {
+            const uint8x8x3_t first = vld3_u8(row0 + x * 3);
+            const uint8x8x3_t second = vld3_u8(row1 + x * 3);
+            for (int i = 0; i < 3; ++i) {
+                bytes0[i] = first.val[i];
+                bytes1[i] = second.val[i];
+            }
+        }
+
+        vst1_u8(y0 + x, lumaNeon(bytes0, bpp, k.y, k.yBias));
+        if (y1) {
+            vst1_u8(y1 + x, lumaNeon(bytes1, bpp, k.y, k.yBias));
+        }
+
+        int16x4_t sums[4];
+        for (int i = 0; i < bpp; ++i) {
+            const uint16x8_t vertical = vaddl_u8(bytes0[i], bytes1[i]);
+            sums[i] = vreinterpret_s16_u16(vpadd_u16(vget_low_u16(vertical), vget_high_u16(vertical)));
+        }
+
+        // four U then four V bytes
+        const uint8x8_t uv = vqmovn_u16(vcombine_u16(chromaNeon(sums, bpp, k.u), chromaNeon(sums, bpp, k.v)));
+        if (chromaStep == 2) {
+            vst1_u8(u + x, vzip_u8(uv, vext_u8(uv, uv, 4)).val[0]);
+        } else {
+            vst1_lane_u32(reinterpret_cast<uint32_t *>(u + x / 2), vreinterpret_u32_u8(uv), 0);
+            vst1_lane_u32(reinterpret_cast<uint32_t *>(v + x / 2), vreinterpret_u32_u8(uv), 1);
+        }
+    }
+    return x;
+}
+#endif /* HAVE_NEON_KERNELS */
+
+// byte offsets of red, green and blue
+bool channelLayout(spa_video_format format, int *r, int *g, int *b, int *bpp)
+{
+    switch (format) {
+    case SPA_VIDEO_FORMAT_RGBx:
+    case SPA_VIDEO_FORMAT_RGBA:
+        *r = 0; *g = 1; *b = 2; *bpp = 4;
+        return true;
+    case SPA_VIDEO_FORMAT_BGRx:
+    case SPA_VIDEO_FORMAT_BGRA:
+        *r = 2; *g = 1; *b = 0; *bpp = 4;
+        return true;
+    case SPA_VIDEO_FORMAT_xRGB:
+    case SPA_VIDEO_FORMAT_ARGB:
+        *r = 1; *g = 2; *b = 3; *bpp = 4;
+        return true;
+    case SPA_VIDEO_FORMAT_xBGR:
+    case SPA_VIDEO_FORMAT_ABGR:
+        *r = 3; *g = 2; *b = 1; *bpp = 4;
+        return true;
+    case SPA_VIDEO_FORMAT_RGB:
+        *r = 0; *g = 1; *b = 2; *bpp = 3;
+        return true;
+    case SPA_VIDEO_FORMAT_BGR:
+        *r = 2; *g = 1; *b = 0; *bpp = 3;
+        return true;
+    default:
+        return false;
+    }
+}
+
+} // namespace
+
+YuvConverter::YuvConverter(spa_video_format format, Matrix matrix, Range range, FrameConverter::Isa isa)
+    : m_format(format)
+    , m_matrix(matrix)
+    , m_range(range)
+    , m_isa(isa)
+{
+    updateKernel();
+}
+
+void YuvConverter::setFormat(spa_video_format format)
+{
+    m_format = format;
+    updateKernel();
+}
+
+void YuvConverter::setMatrix(Matrix matrix)
+{
+    m_matrix = matrix;
+    updateKernel();
+}
+
+void YuvConverter::setRange(Range range)
+{
+    m_range = range;
+    updateKernel();
+}
+
+bool YuvConverter::isSupported(spa_video_format format)
+{
+    int r, g, b, bpp;
+    return channelLayout(format, &r, &g, &b, &bpp);
+}
+
+void YuvConverter::updateKernel()
+{
+    m_kernel = Kernel();
+    m_rows = nullptr;
+
+    int r, g, b, bpp;
+    if (!channelLayout(m_format, &r, &g, &b, &bpp)) {
+        return;
+    }
+
+    const double kr = m_matrix == BT709 ? 0.2126 : 0.299;
+    const double kb = m_matrix == BT709 ? 0.0722 : 0.114;
+    const double lumaScale = (m_range == FullRange ? 255.0 : 219.0) / 255.0 * (1 << 14);
+    const double chromaScale = (m_range == FullRange ? 255.0 : 224.0) / 255.0 * (1 << 14);
+
+    // green takes the rounding error, so white stays white and grey has
+    // no chroma
+    const int yr = std::lround(kr * lumaScale);
+    const int yb = std::lround(kb * lumaScale);
+    const int ur = std::lround(-kr / (2 * (1 - kb)) * chromaScale);
+    const int ub = std::lround(0.5 * chromaScale);
+    const int vr = std::lround(0.5 * chromaScale);
+    const int vb = std::lround(-kb / (2 * (1 - kr)) * chromaScale);
+
+    m_kernel.bytesPerPixel = bpp;
+    m_kernel.y[r] = yr;
+    m_kernel.y[g] = std::lround(lumaScale) - yr - yb;
+    m_kernel.y[b] = yb;
+    m_kernel.u[r] = ur;
+    m_kernel.u[g] = -ur - ub;
+    m_kernel.u[b] = ub;
+    m_kernel.v[r] = vr;
+    m_kernel.v[g] = -vr - vb;
+    m_kernel.v[b] = vb;
+    m_kernel.yBias = ((m_range == FullRange ? 0 : 16) << 14) + (1 << 13);
+
+    switch (m_isa) {
+#if HAVE_X86_KERNELS
+    case FrameConverter::AVX2:
+        m_rows = rowsAvx2;
+        break;
+#endif /* HAVE_X86_KERNELS */
+#if HAVE_NEON_KERNELS
+    case FrameConverter::NEON:
+        m_rows = rowsNeon;
+        break;
+#endif /* HAVE_NEON_KERNELS */
+    default:
+        break;
+    }
+}
+
+void YuvConverter::convert(const uint8_t *src, qint64 srcStride, const QRect &crop, Layout layout,
+                           uint8_t *const planes[3], const qint64 strides[3]) const
+{
+    if (!isValid()) {
+        return;
+    }
+
+    src += crop.y() * srcStride + crop.x() * m_kernel.bytesPerPixel;
+    const int width = crop.width();
+    const int height = crop.height();
+    const int chromaStep = layout == NV12 ? 2 : 1;
+
+    for (int y = 0; y < height; y += 2) {
+        const bool pair = y + 1 < height;
+        const uint8_t *row0 = src + y * srcStride;
+        const uint8_t *row1 = pair ? row0 + srcStride : row0;
+        uint8_t *y0 = planes[0] + y * strides[0];
+        uint8_t *y1 = pair ? y0 + strides[0] : nullptr;
+        uint8_t *u = planes[1] + y / 2 * strides[1];
+        uint8_t *v = layout == NV12 ? u + 1 : planes[2] + y / 2 * strides[2];
+
+        const int x = m_rows ? m_rows(m_kernel, row0, row1, width, y0, y1, u, v, chromaStep) : 0;
+        rowsScalar(m_kernel, row0, row1, x, width, y0, y1, u, v, chromaStep);
+    }
+}
+
+qint64 YuvConverter::packedSize(const QSize &size)
+{
+    const qint64 lumaWidth = (size.width() + 1) & ~1;
+    const qint64 lumaHeight = (size.height() + 1) & ~1;
+    return lumaWidth * lumaHeight * 3 / 2;
+}
+
+void YuvConverter::packedPlanes(uint8_t *data, const QSize &size, Layout layout, uint8_t *planes[3], qint64 strides[3])
+{
+    const qint64 lumaWidth = (size.width() + 1) & ~1;
+    const qint64 lumaHeight = (size.height() + 1) & ~1;
+
+    planes[0] = data;
+    strides[0] = lumaWidth;
+    planes[1] = data + lumaWidth * lumaHeight;
+    if (layout == NV12) {
+        strides[1] = lumaWidth;
+        planes[2] = nullptr;
+        strides[2] = 0;
+    } else {
+        strides[1] = lumaWidth / 2;
+        planes[2] = planes[1] + lumaWidth / 2 * (lumaHeight / 2);
+        strides[2] = lumaWidth / 2;
+    }
+}
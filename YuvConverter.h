@@ -0,0 +1,81 @@
+#ifndef YUVCONVERTER_H
+#define YUVCONVERTER_H
+
+#include <QRect>
+
+#include <spa/param/video/raw.h>
+
+#include "FrameConverter.h"
+
+// Packed RGB to 4:2:0 YUV, straight from the negotiated SPA formats into
+// I420 or NV12 planes. Crop and source stride are applied while converting,
+// chroma is the average of each 2x2 block and odd edges repeat the last
+// row/column. All paths compute the same fixed point result as the scalar
+// reference.
+class YuvConverter
+{
+public:
+    enum Matrix {
+        BT601,
+        BT709
+    };
+
+    enum Range {
+        LimitedRange,
+        FullRange
+    };
+
+    enum Layout {
+        // Y, U and V planes
+        I420,
+        // Y plane and one interleaved UV plane
+        NV12
+    };
+
+    explicit YuvConverter(spa_video_format format = SPA_VIDEO_FORMAT_UNKNOWN, Matrix matrix = BT601,
+                          Range range = LimitedRange, FrameConverter::Isa isa = FrameConverter::bestIsa());
+
+    void setFormat(spa_video_format format);
+    void setMatrix(Matrix matrix);
+    void setRange(Range range);
+    spa_video_format format() const { return m_format; }
+    Matrix matrix() const { return m_matrix; }
+    Range range() const { return m_range; }
+    FrameConverter::Isa isa() const { return m_isa; }
+    bool isValid() const { return m_kernel.bytesPerPixel != 0; }
+
+    // Convert the `crop` rectangle of the frame at `src`. I420 writes
+    // planes[0..2], NV12 only planes[0..1]; strides are in bytes.
+    void convert(const uint8_t *src, qint64 srcStride, const QRect &crop, Layout layout,
+                 uint8_t *const planes[3], const qint64 strides[3]) const;
+
+    // planes of a tightly packed buffer, padded to even dimensions
+    static qint64 packedSize(const QSize &size);
+    static void packedPlanes(uint8_t *data, const QSize &size, Layout layout, uint8_t *planes[3], qint64 strides[3]);
+
+    static bool isSupported(spa_video_format format);
+
+    // Q14 coefficients indexed by byte position within a pixel
+    struct Kernel {
+        int bytesPerPixel = 0;
+        int16_t y[4] = {};
+        int16_t u[4] = {};
+        int16_t v[4] = {};
+        int32_t yBias = 0;
+    };
+
+private:
+    typedef int (*RowsFunction)(const Kernel &kernel, const uint8_t *row0, const uint8_t *row1, int width,
+                                uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int chromaStep);
+
+    void updateKernel();
+
+    spa_video_format m_format = SPA_VIDEO_FORMAT_UNKNOWN;
+    Matrix m_matrix = BT601;
+    Range m_range = LimitedRange;
+    FrameConverter::Isa m_isa = FrameConverter::Scalar;
+    Kernel m_kernel;
+    RowsFunction m_rows = nullptr;
+};
+
+#endif // YUVCONVERTER_H
@@ -22,13 +22,19 @@
 // Qt
 #include <QGuiApplication>
 #include <QImage>
-#include <QPainter>
 #include <QThread>
 #include <QJsonDocument>
 #include <QJsonArray>
 #include <QJsonObject>
 
+#include "CaptureManager.h"
+#include "FramePyramid.h"
+#include "FrameReplayer.h"
+#include "FrameStitcher.h"
+#include "MicroBench.h"
 #include "PipewireStream.h"
+#include "PreviewPresenter.h"
+#include "StreamBench.h"
 
 using namespace KWayland::Client;
 
@@ -44,7 +50,6 @@ public:
 private:
     void setupRegistry(Registry *registry);
     void createPopup();
-    void render(QImage *img);
     void renderPopup();
     QThread *m_connectionThread;
     ConnectionThread *m_connectionThreadObject;
@@ -57,12 +62,18 @@ private:
     Surface *m_popupSurface = nullptr;
     XdgShellPopup *m_xdgShellPopup = nullptr;
     ScreenCast *sc = nullptr;
-    ScreenCastStream* scs= nullptr;
 
-    Output *m_output = nullptr;
+    // every announced output is captured, all streams share one PipeWire connection
+    QList<Output *> m_outputs;
+    CaptureManager *m_captureManager = nullptr;
+    // set with SCREENCAST_STITCH, all outputs are shown as one desktop then
+    FrameStitcher *m_stitcher = nullptr;
     DDEShell *m_ddeShell = nullptr;
     DDEShellSurface *m_ddeShellSurface = nullptr;
     KWayland::Client::ServerSideDecorationManager *m_decoration = nullptr;
+
+    // draws the captured frames into m_surface on frame callbacks
+    PreviewPresenter *m_presenter = nullptr;
 };
 
 XdgTest::XdgTest(QObject *parent)
@@ -99,6 +110,20 @@ void XdgTest::init()
     m_connectionThreadObject->initConnection();
 }
 
+// SCREENCAST_CURSOR=<hidden|embedded|metadata>, metadata by default. The
+// stitched desktop has no place for a metadata cursor, it is embedded there
+static PipewireStream::CursorMode cursorMode()
+{
+    const QString mode = qEnvironmentVariable("SCREENCAST_CURSOR");
+    if (mode == QLatin1String("hidden")) {
+        return PipewireStream::CursorHidden;
+    }
+    if (mode == QLatin1String("embedded") || (mode.isEmpty() && qEnvironmentVariableIntValue("SCREENCAST_STITCH") > 0)) {
+        return PipewireStream::CursorEmbedded;
+    }
+    return PipewireStream::CursorMetadata;
+}
+
 void XdgTest::setupRegistry(Registry *registry)
 {
     connect(registry, &Registry::compositorAnnounced, this, [this, registry](quint32 name, quint32 version) {
@@ -126,6 +151,7 @@ void XdgTest::setupRegistry(Registry *registry)
         Q_ASSERT(m_shm);
         m_surface = m_compositor->createSurface(this);
         Q_ASSERT(m_surface);
+        m_presenter = new PreviewPresenter(m_surface, m_shm, this);
         m_xdgShellSurface = m_xdgShell->createSurface(m_surface, this);
         m_ddeShellSurface = m_ddeShell->createShellSurface(m_surface, this);
         auto parentDeco = m_decoration->create(m_surface, this);
@@ -136,7 +162,8 @@ void XdgTest::setupRegistry(Registry *registry)
                     Q_UNUSED(size);
                     Q_UNUSED(states);
                     m_xdgShellSurface->ackConfigure(serial);
-                    render(nullptr);
+                    m_presenter->setSize(m_xdgShellSurface->size().isValid() ? m_xdgShellSurface->size() : QSize(500, 500));
+                    m_presenter->present();
                 });
 
         m_xdgShellSurface->setTitle(QStringLiteral("Test Window"));
@@ -156,17 +183,124 @@ void XdgTest::setupRegistry(Registry *registry)
     });
     connect(registry, &Registry::outputAnnounced, this, [this, registry](quint32 name, quint32 version) {
         Output *o = registry->createOutput(name, version, this);
-        m_output = o;
+        m_outputs.append(o);
          qWarning() << "outputAnnounced::created";
 
-         scs =  sc->streamOutput(m_output->output(),1);
-         connect(scs,&ScreenCastStream::created,[this](u_int32_t node){
+         ScreenCastStream *scs = sc->streamOutput(o->output(), cursorMode());
+         connect(scs,&ScreenCastStream::created,[this, o](u_int32_t node){
               qWarning() << "ScreenCastStream::created" << node;
-                PipewireStream* w = new PipewireStream;
-                w->pwStreamNodeId = node;
-                w->initPw();
-
-                connect(w,&PipewireStream::ImageReady,this,&XdgTest::render,Qt::DirectConnection);
+                if (!m_captureManager) {
+                    // SCREENCAST_LOOPS=<n> spreads the streams over n loops,
+                    // SCREENCAST_PIN_LOOPS=1 pins each to its own CPU
+                    const int loops = qMax(1, qEnvironmentVariableIntValue("SCREENCAST_LOOPS"));
+                    const bool pin = qEnvironmentVariableIntValue("SCREENCAST_PIN_LOOPS") != 0;
+                    m_captureManager = new CaptureManager(loops, pin, this);
+                    // SCREENCAST_STATS=<msec> logs the stats of every stream that often
+                    m_captureManager->setStatsDumpInterval(qEnvironmentVariableIntValue("SCREENCAST_STATS"));
+                }
+
+                // the window shows and the encoder records the first output
+                const bool first = m_captureManager->streams().isEmpty();
+                PipewireStream* w = m_captureManager->createStream(node);
+                if (!w) {
+                    return;
+                }
+                w->cursorMode = cursorMode();
+
+                // SCREENCAST_ENCODE=<file|-> records the stream as VP8/IVF
+                const QString encodePath = qEnvironmentVariable("SCREENCAST_ENCODE");
+                if (first && !encodePath.isEmpty()) {
+                    VideoEncoder::Settings settings;
+                    bool ok;
+                    const int bitrate = qEnvironmentVariableIntValue("SCREENCAST_BITRATE", &ok);
+                    if (ok) {
+                        settings.bitrate = bitrate;
+                    }
+                    VideoEncoder *encoder = new VideoEncoder(settings);
+                    if (encoder->open(encodePath)) {
+                        w->encoder = encoder;
+                        connect(qApp, &QCoreApplication::aboutToQuit, [encoder] { encoder->close(); });
+                    } else {
+                        delete encoder;
+                    }
+                }
+
+                // SCREENCAST_RECORD=<file> records the received frames for
+                // replaying them with SCREENCAST_REPLAY
+                const QString recordPath = qEnvironmentVariable("SCREENCAST_RECORD");
+                if (first && !recordPath.isEmpty()) {
+                    FrameRecorder *recorder = new FrameRecorder;
+                    if (recorder->open(recordPath)) {
+                        w->recorder = recorder;
+                        connect(qApp, &QCoreApplication::aboutToQuit, [recorder] { recorder->close(); });
+                    } else {
+                        delete recorder;
+                    }
+                }
+
+                // SCREENCAST_RING=<path> exports the frames to other processes,
+                // readers connect to <path>-<node> with FrameRingReader
+                const QString ringPath = qEnvironmentVariable("SCREENCAST_RING");
+                if (!ringPath.isEmpty()) {
+                    FrameRingWriter *ring = new FrameRingWriter(4, w);
+                    if (ring->listen(QStringLiteral("%1-%2").arg(ringPath).arg(node))) {
+                        w->frameRing = ring;
+                    } else {
+                        delete ring;
+                    }
+                }
+
+                // SCREENCAST_SOURCE=<name> re-exports the frames as the PipeWire
+                // source node <name>-<node> for other local consumers
+                const QString sourceName = qEnvironmentVariable("SCREENCAST_SOURCE");
+                if (!sourceName.isEmpty()) {
+                    w->sourceName = QStringLiteral("%1-%2").arg(sourceName).arg(node);
+                }
+
+                // SCREENCAST_PYRAMID=<levels> adds reduced copies of the frames,
+                // e.g. "2,4,320x180", see FramePyramid::parseLevels
+                w->pyramidLevels = FramePyramid::parseLevels(qEnvironmentVariable("SCREENCAST_PYRAMID"));
+
+                // SCREENCAST_RATE_CONTROL=<msec> adapts frame rate and size to the load
+                const int rateInterval = qEnvironmentVariableIntValue("SCREENCAST_RATE_CONTROL");
+                if (rateInterval > 0) {
+                    w->setRateControl(rateInterval);
+                }
+
+                // SCREENCAST_STITCH=<msec> lays all outputs out by their geometry
+                // and shows the desktop at that interval
+                const int stitchInterval = qEnvironmentVariableIntValue("SCREENCAST_STITCH");
+                if (stitchInterval > 0) {
+                    if (!m_stitcher) {
+                        m_stitcher = new FrameStitcher(this);
+                        m_stitcher->setInterval(stitchInterval);
+                        // the desktop is only valid during the emission
+                        connect(m_stitcher, &FrameStitcher::FrameReady, this, [this](QImage *image, const QRegion &damage) {
+                            if (m_presenter) {
+                                m_presenter->copyFrame(image, damage);
+                            }
+                        }, Qt::DirectConnection);
+                    }
+                    w->stitcher = m_stitcher;
+                    m_stitcher->setOutputGeometry(w, o->geometry());
+                    connect(o, &Output::changed, w, [this, o, w] { m_stitcher->setOutputGeometry(w, o->geometry()); });
+                }
+
+                m_captureManager->startStream(w);
+
+                if (first && !m_stitcher) {
+                    connect(w, &PipewireStream::ImageReady, this, [this](QImage *image, const QRegion &damage) {
+                        if (m_presenter) {
+                            m_presenter->submitFrame(image, damage);
+                        }
+                    }, Qt::DirectConnection);
+                    // with a metadata cursor the window draws it, frames don't change for it
+                    connect(w, &PipewireStream::CursorChanged, this, [this](const PipewireStream::Cursor &cursor) {
+                        if (m_presenter) {
+                            m_presenter->setCursor(cursor.image, cursor.hotspot, cursor.position, cursor.visible);
+                        }
+                    }, Qt::DirectConnection);
+                }
          });
 
          connect(scs,&ScreenCastStream::failed,[](){
@@ -191,34 +325,142 @@ void XdgTest::setupRegistry(Registry *registry)
 }
 
 
-void XdgTest::render(QImage* img)
+// SCREENCAST_BENCH_SIZE=<w>x<h> for the benchmarks, 1920x1080 by default
+static QSize benchSize()
 {
-
-    const QSize &size = m_xdgShellSurface->size().isValid() ? m_xdgShellSurface->size() : QSize(500, 500);
-    auto buffer = m_shm->getBuffer(size, size.width() * 4).toStrongRef();
-    buffer->setUsed(true);
-    QImage image(buffer->address(), size.width(), size.height(), QImage::Format_ARGB32_Premultiplied);
-
-    //image.fill(QColor(255, 255, 255, 255));
-    // draw a red rectangle indicating the anchor of the top level
-    QPainter painter(&image);
-    painter.setBrush(Qt::red);
-    painter.setPen(Qt::black);
-    if(img!=nullptr)
-        painter.drawImage(image.rect(),*img,img->rect());
-    else
-        painter.drawRect(50, 50, 400, 400);
-
-    m_surface->attachBuffer(*buffer);
-    m_surface->damage(QRect(QPoint(0, 0), size));
-    m_surface->commit(Surface::CommitFlag::None);
-    buffer->setUsed(false);
+    const QStringList size = qEnvironmentVariable("SCREENCAST_BENCH_SIZE").split(QLatin1Char('x'));
+    if (size.size() == 2 && size[0].toInt() > 0 && size[1].toInt() > 0) {
+        return QSize(size[0].toInt(), size[1].toInt());
+    }
+    return QSize(1920, 1080);
 }
 
 int main(int argc, char **argv)
 {
     //qputenv("WAYLAND_DEBUG","1");
     QCoreApplication app(argc, argv);
+
+    // SCREENCAST_REPLAY=<file> runs a recording through the frame processing
+    // instead of capturing, as fast as possible or with SCREENCAST_REPLAY_PACED=1
+    // at the recorded cadence, SCREENCAST_REPLAY_LOOPS=<n> times
+    const QString replayPath = qEnvironmentVariable("SCREENCAST_REPLAY");
+    if (!replayPath.isEmpty()) {
+        FrameReplayer replayer;
+        if (!replayer.open(replayPath)) {
+            return 1;
+        }
+        PipewireStream stream;
+        stream.workerCount = 0;
+        stream.startWorkers();
+        replayer.replay(&stream, qEnvironmentVariableIntValue("SCREENCAST_REPLAY_PACED") != 0,
+                        qMax(1, qEnvironmentVariableIntValue("SCREENCAST_REPLAY_LOOPS")));
+        qInfo().noquote() << replayer.summary() << "\n" << stream.stats.summary();
+        return 0;
+    }
+
+    // SCREENCAST_PYRAMID_BENCH=<frames> times SCREENCAST_PYRAMID, or
+    // "2,4,320x180", at SCREENCAST_BENCH_SIZE against QImage::scaled
+    const int pyramidFrames = qEnvironmentVariableIntValue("SCREENCAST_PYRAMID_BENCH");
+    if (pyramidFrames > 0) {
+        QVector<FramePyramid::Level> levels = FramePyramid::parseLevels(qEnvironmentVariable("SCREENCAST_PYRAMID"));
+        if (levels.isEmpty()) {
+            levels = FramePyramid::parseLevels(QStringLiteral("2,4,320x180"));
+        }
+        return MicroBench::pyramid(levels, benchSize(), pyramidFrames) ? 0 : 1;
+    }
+
+    // SCREENCAST_CONVERT_BENCH=<frames> checks every conversion kernel
+    // against the scalar one and times them at SCREENCAST_BENCH_SIZE
+    const int convertFrames = qEnvironmentVariableIntValue("SCREENCAST_CONVERT_BENCH");
+    if (convertFrames > 0) {
+        return MicroBench::converters(benchSize(), convertFrames) ? 0 : 1;
+    }
+
+    // SCREENCAST_READBACK_BENCH=<frames> times the DMA-BUF readback ring
+    const int readbackFrames = qEnvironmentVariableIntValue("SCREENCAST_READBACK_BENCH");
+    if (readbackFrames > 0) {
+        return MicroBench::readback(benchSize(), readbackFrames) ? 0 : 1;
+    }
+
+    // SCREENCAST_IMPORT_BENCH=<frames> checks and times DMA-BUF import
+    const int importFrames = qEnvironmentVariableIntValue("SCREENCAST_IMPORT_BENCH");
+    if (importFrames > 0) {
+        return MicroBench::dmaBufImport(benchSize(), importFrames) ? 0 : 1;
+    }
+
+    // SCREENCAST_HASH_BENCH=<frames> times tile hashing plus converting
+    // the changed tiles against converting whole frames
+    const int hashFrames = qEnvironmentVariableIntValue("SCREENCAST_HASH_BENCH");
+    if (hashFrames > 0) {
+        return MicroBench::tileHash(benchSize(), hashFrames) ? 0 : 1;
+    }
+
+    // SCREENCAST_BAND_BENCH=<frames> converts in bands on 1 up to
+    // SCREENCAST_BENCH_THREADS threads, all cores by default
+    const int bandFrames = qEnvironmentVariableIntValue("SCREENCAST_BAND_BENCH");
+    if (bandFrames > 0) {
+        const int threads = qEnvironmentVariableIntValue("SCREENCAST_BENCH_THREADS");
+        return MicroBench::bandPool(benchSize(), bandFrames, threads > 0 ? threads : QThread::idealThreadCount()) ? 0 : 1;
+    }
+
+    // SCREENCAST_YUV_BENCH=<frames> checks every YUV kernel against the
+    // scalar one and times them at SCREENCAST_BENCH_SIZE
+    const int yuvFrames = qEnvironmentVariableIntValue("SCREENCAST_YUV_BENCH");
+    if (yuvFrames > 0) {
+        return MicroBench::yuv(benchSize(), yuvFrames) ? 0 : 1;
+    }
+
+    // SCREENCAST_POOL_BENCH=<frames> resizes frames up to
+    // SCREENCAST_BENCH_SIZE with FramePool and with malloc
+    const int poolFrames = qEnvironmentVariableIntValue("SCREENCAST_POOL_BENCH");
+    if (poolFrames > 0) {
+        return MicroBench::framePool(benchSize(), poolFrames) ? 0 : 1;
+    }
+
+    // SCREENCAST_RING_BENCH=<frames> hands SCREENCAST_BENCH_SIZE frames
+    // through the shared memory ring to another process, one every
+    // SCREENCAST_RING_INTERVAL microseconds, 4000 by default
+    const int ringFrames = qEnvironmentVariableIntValue("SCREENCAST_RING_BENCH");
+    if (ringFrames > 0) {
+        const int interval = qEnvironmentVariableIntValue("SCREENCAST_RING_INTERVAL");
+        return MicroBench::ring(benchSize(), ringFrames, interval > 0 ? interval : 4000) ? 0 : 1;
+    }
+
+    // SCREENCAST_BENCH=<seconds> measures the capture path against a
+    // synthetic producer on a private pipewire, see StreamBench; tuned with
+    // SCREENCAST_BENCH_SIZE=<w>x<h>, _FORMAT=<BGRx|RGBx|BGRA|RGBA|RGB|BGR>,
+    // _FPS=<n>, _MEMPTR=1, _BAND=1 and _SESSION=1 to use the session's daemon
+    const int benchSeconds = qEnvironmentVariableIntValue("SCREENCAST_BENCH");
+    if (benchSeconds > 0) {
+        StreamBench::Settings settings;
+        settings.durationMsec = benchSeconds * 1000;
+        settings.size = benchSize();
+        const QString format = qEnvironmentVariable("SCREENCAST_BENCH_FORMAT");
+        for (spa_video_format candidate : {SPA_VIDEO_FORMAT_BGRx, SPA_VIDEO_FORMAT_RGBx, SPA_VIDEO_FORMAT_BGRA,
+                                           SPA_VIDEO_FORMAT_RGBA, SPA_VIDEO_FORMAT_RGB, SPA_VIDEO_FORMAT_BGR}) {
+            if (format == QLatin1String(FrameConverter::formatName(candidate))) {
+                settings.format = candidate;
+            }
+        }
+        if (qEnvironmentVariableIntValue("SCREENCAST_BENCH_FPS") > 0) {
+            settings.framerate = qEnvironmentVariableIntValue("SCREENCAST_BENCH_FPS");
+        }
+        if (qEnvironmentVariableIntValue("SCREENCAST_BENCH_MEMPTR") != 0) {
+            settings.dataType = SPA_DATA_MemPtr;
+        }
+        settings.fullUpdates = qEnvironmentVariableIntValue("SCREENCAST_BENCH_BAND") == 0;
+        settings.privateDaemon = qEnvironmentVariableIntValue("SCREENCAST_BENCH_SESSION") == 0;
+
+        StreamBench bench(settings);
+        QObject::connect(&bench, &StreamBench::Finished, &app, [&bench](bool ok) {
+            qInfo().noquote() << bench.report();
+            QCoreApplication::exit(ok ? 0 : 1);
+        });
+        // start() can fail right away, exit() only works once exec() runs
+        QMetaObject::invokeMethod(&bench, &StreamBench::start, Qt::QueuedConnection);
+        return app.exec();
+    }
+
     XdgTest client;
     client.init();
 
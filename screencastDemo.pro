@@ -4,18 +4,72 @@ greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 CONFIG += c++17
 CONFIG += link_pkgconfig wayland-scanner
-PKGCONFIG += wayland-client libspa-0.2 libpipewire-0.3 gbm epoxy
+PKGCONFIG += wayland-client libspa-0.2 libpipewire-0.3 gbm epoxy libdrm
+
+# software VP8 encoding is optional
+packagesExist(vpx) {
+    PKGCONFIG += vpx
+    DEFINES += HAVE_VPX=1
+}
 
 # You can make your code fail to compile if it uses deprecated APIs.
 # In order to do so, uncomment the following line.
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 SOURCES += \
+    BandPool.cpp \
+    CaptureManager.cpp \
+    DmaBufImage.cpp \
+    FrameConverter.cpp \
+    FramePool.cpp \
+    FramePyramid.cpp \
+    FrameRecorder.cpp \
+    FrameReplayer.cpp \
+    FrameRingReader.cpp \
+    FrameRingWriter.cpp \
+    FrameStitcher.cpp \
+    ImageScaler.cpp \
+    MicroBench.cpp \
+    PboReadback.cpp \
+    PipewireFrame.cpp \
+    PipewireSource.cpp \
     PipewireStream.cpp \
+    PreviewPresenter.cpp \
+    RateController.cpp \
+    StreamBench.cpp \
+    StreamStats.cpp \
+    TileHasher.cpp \
+    VideoEncoder.cpp \
+    YuvConverter.cpp \
     main.cpp
 
 HEADERS += \
-    PipewireStream.h
+    BandPool.h \
+    CaptureManager.h \
+    DmaBufImage.h \
+    FrameConverter.h \
+    FramePool.h \
+    FramePyramid.h \
+    FrameRecorder.h \
+    FrameRecording.h \
+    FrameReplayer.h \
+    FrameRing.h \
+    FrameRingReader.h \
+    FrameRingWriter.h \
+    FrameStitcher.h \
+    ImageScaler.h \
+    MicroBench.h \
+    PboReadback.h \
+    PipewireFrame.h \
+    PipewireSource.h \
+    PipewireStream.h \
+    PreviewPresenter.h \
+    RateController.h \
+    StreamBench.h \
+    StreamStats.h \
+    TileHasher.h \
+    VideoEncoder.h \
+    YuvConverter.h
 
 # Default rules for deployment.
 qnx: target.path = /tmp/$${TARGET}/bin